@@ -20,11 +20,68 @@
 
 /* Routines */
 
+/*
+ * Make a dictionary, keyed on code position, of what is live at each
+ * site in a heap profile, as written by run --heap-profile or
+ * HEAP_DUMP: a tuple of objects and bytes, totalled over every process
+ * which allocated at that position.
+ */
+static void
+index_profile(struct value *sites, struct value *profile)
+{
+	unsigned int i;
+	struct value *site, *total;
+	struct value tag, t;
+
+	value_dict_new(sites, 63);
+	value_symbol_new(&tag, "live", 4);
+	for (i = 0; i < value_tuple_get_size(profile); i++) {
+		site = value_tuple_fetch(profile, i);
+		total = value_dict_fetch(sites, value_tuple_fetch(site, 1));
+		if (value_is_null(total)) {
+			value_tuple_new(&t, &tag, 2);
+			value_tuple_store_integer(&t, 0, 0);
+			value_tuple_store_integer(&t, 1, 0);
+			value_dict_store(sites, value_tuple_fetch(site, 1), &t);
+			total = &t;
+		}
+		value_tuple_store_integer(total, 0,
+		    value_tuple_fetch_integer(total, 0) +
+		    value_tuple_fetch_integer(site, 2));
+		value_tuple_store_integer(total, 1,
+		    value_tuple_fetch_integer(total, 1) +
+		    value_tuple_fetch_integer(site, 3));
+	}
+}
+
+/*
+ * If the profile has a site at the given code position, render what
+ * is live there, between the given prefix and suffix.
+ */
+static void
+annotate(struct process *p, struct value *sites, int pc,
+	 const char *prefix, const char *suffix)
+{
+	struct value t;
+	struct value *site;
+
+	if (value_is_null(sites))
+		return;
+	value_integer_set(&t, pc);
+	site = value_dict_fetch(sites, &t);
+	if (value_is_null(site))
+		return;
+	process_render(p, "%s%d objects, %d bytes live%s", prefix,
+	    value_tuple_fetch_integer(site, 0),
+	    value_tuple_fetch_integer(site, 1), suffix);
+}
+
 static void
-disassemble(struct reporter *r, struct process *p, struct value *code)
+disassemble(struct reporter *r, struct process *p, struct value *code,
+	    struct value *sites)
 {
 	struct opcode_entry *oe;
-	int count, pc, opcode;
+	int count, pc, at, opcode;
 	struct value *val;
 	struct value t;
 	struct chain *back, *front;
@@ -66,6 +123,9 @@ disassemble(struct reporter *r, struct process *p, struct value *code)
 	if (reporter_has_errors(r))
 		return;
 
+	annotate(p, sites, SITE_NATIVE, "; ", " allocated outside the VM\n");
+	annotate(p, sites, SITE_MESSAGE, "; ", " received in messages\n");
+
 	/* second pass */
 	pc = 0;
 	for (;;) {
@@ -82,6 +142,7 @@ disassemble(struct reporter *r, struct process *p, struct value *code)
 		oe = &opcode_table[opcode];
 		process_render(p, "%s ", oe->token);
 		count = oe->arity;
+		at = pc;
 
 		pc++;
 		val = value_tuple_fetch(code, pc);
@@ -105,6 +166,7 @@ disassemble(struct reporter *r, struct process *p, struct value *code)
 			}
 		}
 
+		annotate(p, sites, at, "\t; ", "");
 		process_render(p, "\n");
 	}
 
@@ -117,26 +179,43 @@ disassemble_main(struct value *args, struct value *result)
         struct reporter *r;
 	struct process *p;
 	struct value code;	/* virtual machine code we will dump */
-	struct value *asmfile, *vmfile;
-        struct value asmfile_sym, vmfile_sym;
+	struct value profile, sites;
+	struct value *asmfile, *vmfile, *proffile;
+        struct value asmfile_sym, vmfile_sym, proffile_sym;
 
         value_symbol_new(&asmfile_sym, "asmfile", 7);
         value_symbol_new(&vmfile_sym, "vmfile", 6);
+        value_symbol_new(&proffile_sym, "profile", 7);
 
   	asmfile = value_dict_fetch(args, &asmfile_sym);
 	vmfile = value_dict_fetch(args, &vmfile_sym);
+	proffile = value_dict_fetch(args, &proffile_sym);
 
 	r = reporter_new("Disassembly", NULL, 1);
 
 	/*
 	 * Load.
 	 */
-	p = file_open(value_symbol_get_token(vmfile), "r");
-	value_load(&code, p);
-	stream_close(NULL, p);
+	if (!value_load_file(&code, value_symbol_get_token(vmfile))) {
+		report(r, REPORT_ERROR, "Could not load '%s'",
+		    value_symbol_get_token(vmfile));
+		value_integer_set(result, 1);
+		reporter_free(r);
+		return;
+	}
+
+	value_copy(&sites, &VNULL);
+	if (!value_is_null(proffile)) {
+		if (value_load_file(&profile,
+		    value_symbol_get_token(proffile)))
+			index_profile(&sites, &profile);
+		else
+			report(r, REPORT_ERROR, "Could not load '%s'",
+			    value_symbol_get_token(proffile));
+	}
 
 	p = file_open(value_symbol_get_token(asmfile), "w");
-	disassemble(r, p, &code);
+	disassemble(r, p, &code, &sites);
 	stream_close(NULL, p);
 
 	value_integer_set(result, reporter_has_errors(r) ? 1 : 0);
@@ -4,8 +4,23 @@
  * exposing a stream-like interface.
  */
 
+/*
+ * On POSIX systems, files may also be mapped into memory.
+ */
+#if defined(__unix__) && !defined(STANDALONE) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <stdio.h>
 
+#ifdef _POSIX_C_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "lib.h"
 #include "process.h"
 #include "file.h"
@@ -16,6 +31,43 @@
 #include "cmdline.h"
 #endif
 
+/*
+ * A file process's aux: the file, and how it was opened, so that it
+ * can be opened again when a running program is restored.
+ */
+struct file {
+	FILE		*f;
+	char		*locator;
+	char		 mode[4];
+};
+
+#define	FILE_OF(p)	(((struct file *)(p)->aux)->f)
+
+/*
+ * Writes, flushes and reads go straight to the file, where stdio
+ * buffers them.
+ */
+static void
+file_write(struct process *p, const void *data, unsigned int size)
+{
+	assert(p->aux != NULL);
+	fwrite(data, size, 1, FILE_OF(p));
+}
+
+static void
+file_flush(struct process *p)
+{
+	assert(p->aux != NULL);
+	fflush(FILE_OF(p));
+}
+
+static unsigned int
+file_read(struct process *p, void *buffer, unsigned int size)
+{
+	assert(p->aux != NULL);
+	return (unsigned int)fread(buffer, 1, size, FILE_OF(p));
+}
+
 static void run(struct process *p)
 {
 	struct value msg;
@@ -44,7 +96,7 @@ static void run(struct process *p)
 				result = fwrite(
 				    value_symbol_get_token(payload),
 				    value_symbol_get_length(payload),
-				    1, (FILE *)p->aux
+				    1, FILE_OF(p)
 				);
                         	if (result) {
 					/* some kind of error occurred */
@@ -53,19 +105,25 @@ static void run(struct process *p)
 				sender = value_get_process(value_tuple_fetch(&msg, 0));
 				size = value_get_integer(value_tuple_fetch(&msg, 1));
 
-				buffer = value_symbol_new_buffer(&response, size);
-				result = fread(buffer, size, 1, (FILE *)p->aux);
-                        	if (result) {
-					/* some kind of error occurred, or we just need more */
-				}
+				buffer = malloc(size);
+				assert(buffer != NULL);
+				result = fread(buffer, 1, size, FILE_OF(p));
+				value_symbol_new(&response, buffer, result);
+				free(buffer);
 				process_enqueue(sender, &response);
 			} else if (strcmp(tag, "eof") == 0) {
 				sender = value_get_process(value_tuple_fetch(&msg, 0));
 
-				value_boolean_set(&response, feof((FILE *)p->aux));
+				value_boolean_set(&response, feof(FILE_OF(p)));
 				process_enqueue(sender, &response);
+			} else if (strcmp(tag, "flush") == 0) {
+				fflush(FILE_OF(p));
 			} else if (strcmp(tag, "close") == 0) {
-				fclose((FILE *)p->aux);
+				struct file *file = p->aux;
+
+				fclose(file->f);
+				free(file->locator);
+				free(file);
 				p->aux = NULL;
 			}
 		}
@@ -75,12 +133,25 @@ static void run(struct process *p)
 }
 
 static struct process *
-file_fopen(FILE *file)
+file_fopen(FILE *f, const char *locator, const char *mode)
 {
 	struct process *p;
+	struct file *file;
+
+	file = malloc(sizeof(struct file));
+	assert(file != NULL);
+	file->f = f;
+	file->locator = malloc(strlen(locator) + 1);
+	assert(file->locator != NULL);
+	memcpy(file->locator, locator, strlen(locator) + 1);
+	strncpy(file->mode, mode, sizeof(file->mode) - 1);
+	file->mode[sizeof(file->mode) - 1] = '\0';
 
 	p = process_new();
 	p->run = run;
+	p->write = file_write;
+	p->flush = file_flush;
+	p->read = file_read;
 	p->aux = file;
 
 	return p;
@@ -92,13 +163,13 @@ file_open(const char *locator, const char *mode)
 	FILE *f;
 
 	if (strcmp(locator, "*stdin") == 0) {
-		return file_fopen(stdin);
+		return file_fopen(stdin, locator, mode);
 	}
 	if (strcmp(locator, "*stdout") == 0) {
-		return file_fopen(stdout);
+		return file_fopen(stdout, locator, mode);
 	}
 	if (strcmp(locator, "*stderr") == 0) {
-		return file_fopen(stderr);
+		return file_fopen(stderr, locator, mode);
 	}
 
 	if ((f = fopen(locator, mode)) == NULL) {
@@ -109,5 +180,84 @@ file_open(const char *locator, const char *mode)
 		exit(1);
 	}
 
-	return file_fopen(f);
+	return file_fopen(f, locator, mode);
+}
+
+int
+file_describe(struct process *p, const char **locator, const char **mode,
+	      long *position)
+{
+	struct file *file;
+
+	if (p->run != run || (file = p->aux) == NULL)
+		return 0;
+	*locator = file->locator;
+	*mode = file->mode;
+	*position = file->locator[0] == '*' ? -1 : ftell(file->f);
+	return 1;
+}
+
+/*
+ * Whatever was written to the file before is kept, so a file opened
+ * for writing is opened again for appending.
+ */
+struct process *
+file_reopen(const char *locator, const char *mode, long position)
+{
+	struct process *p;
+
+	if (mode[0] == 'w')
+		p = file_open(locator, "a");
+	else
+		p = file_open(locator, mode);
+	if (position > 0 && mode[0] == 'r')
+		fseek(FILE_OF(p), position, SEEK_SET);
+	return p;
+}
+
+/*
+ * Map the named file into memory, read-only, and return its contents,
+ * setting the given size to its length.  Returns NULL if the file could
+ * not be mapped (or cannot be, on this system, or is empty), in which
+ * case the caller should fall back to reading it with file_open().
+ */
+void *
+file_map(const char *locator, unsigned long *size)
+{
+#ifdef _POSIX_C_SOURCE
+	struct stat st;
+	void *data;
+	int fd;
+
+	if (locator[0] == '*')
+		return NULL;
+	if ((fd = open(locator, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    (off_t)(size_t)st.st_size != st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	*size = (unsigned long)st.st_size;
+	return data;
+#else
+	(void)locator;
+	(void)size;
+	return NULL;
+#endif
+}
+
+void
+file_unmap(void *data, unsigned long size)
+{
+#ifdef _POSIX_C_SOURCE
+	munmap(data, size);
+#else
+	(void)data;
+	(void)size;
+#endif
 }
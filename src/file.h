@@ -11,4 +11,23 @@ struct process;
 
 struct process	*file_open(const char *, const char *);
 
+/*
+ * If the process is an open file, set the locator and mode with which
+ * it was opened, and the position it has reached (or -1 if it has
+ * none), and return true; otherwise return false.
+ */
+int		 file_describe(struct process *, const char **, const char **,
+		    long *);
+
+/*
+ * Open a file described by file_describe() again, as it was then.
+ */
+struct process	*file_reopen(const char *, const char *, long);
+
+/*
+ * Map a file into memory for reading, where the system allows it.
+ */
+void		*file_map(const char *, unsigned long *);
+void		 file_unmap(void *, unsigned long);
+
 #endif /* !__FILE_H_ */
@@ -0,0 +1,100 @@
+/*
+ * gcbench.c
+ * Benchmark the garbage collector on a large synthetic graph of
+ * tuples, with 1, 2, 4 and 8 collector threads.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <sys/time.h>
+
+#include "lib.h"
+#include "cmdline.h"
+
+#include "render.h"
+#include "process.h"
+#include "file.h"
+
+#include "value.h"
+
+#define GRAPH_TUPLE_SIZE	3
+
+static unsigned int
+get_arg(struct value *args, const char *name, unsigned int def)
+{
+	struct value sym, *v;
+
+	value_symbol_new(&sym, name, strlen(name));
+	v = value_dict_fetch(args, &sym);
+	if (value_is_null(v))
+		return def;
+	return (unsigned int)k_atoi(value_symbol_get_token(v),
+				    value_symbol_get_length(v));
+}
+
+/*
+ * Build a graph of count tuples.  Tuple i refers to tuples 2i+1 and
+ * 2i+2, so it is wide enough to mark in parallel, and also to tuple
+ * i/2, so that it is not merely a tree.
+ */
+static void
+build_graph(struct value *root, unsigned int count)
+{
+	struct value *all, tag;
+	unsigned int i, j;
+
+	all = malloc(count * sizeof(struct value));
+	assert(all != NULL);
+	value_integer_set(&tag, 0);
+	for (i = 0; i < count; i++)
+		value_tuple_new(&all[i], &tag, GRAPH_TUPLE_SIZE);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < 2; j++) {
+			if (2 * i + 1 + j < count)
+				value_tuple_store(&all[i], j, &all[2 * i + 1 + j]);
+		}
+		value_tuple_store(&all[i], 2, &all[i / 2]);
+	}
+	value_copy(root, &all[0]);
+	free(all);
+}
+
+static long
+elapsed_ms(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000L +
+	       (end->tv_usec - start->tv_usec) / 1000L;
+}
+
+static void
+gcbench_main(struct value *args, struct value *result)
+{
+	struct process *out;
+	struct value root;
+	struct timeval start, end;
+	unsigned int count, rounds, threads, r;
+
+	count = get_arg(args, "tuples", 10000000);
+	rounds = get_arg(args, "rounds", 3);
+	out = file_open("*stdout", "w");
+
+	process_render(out, "building graph of %d tuples\n", count);
+	build_graph(&root, count);
+
+	for (threads = 1; threads <= 8; threads *= 2) {
+		value_gc_set_threads(threads);
+		for (r = 0; r < rounds; r++) {
+			gettimeofday(&start, NULL);
+			value_gc(&root);
+			gettimeofday(&end, NULL);
+			process_render(out, "threads %d round %d: %d ms\n",
+			    threads, r, (int)elapsed_ms(&start, &end));
+		}
+	}
+
+	value_integer_set(result, 0);
+}
+
+MAIN(gcbench_main)
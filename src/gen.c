@@ -253,7 +253,7 @@ gen_flatten(struct value *gen, struct value *dest)
 		unsigned int i = 0;
 		unsigned int current_size = value_tuple_get_size(current);
 		struct value *x;
-		for (i = 0; i < (current_size - 1) && i < dest_size; i++) {
+		for (i = 0; i < (current_size - 1) && j < dest_size; i++) {
 			x = value_tuple_fetch(current, i);
 
 #ifdef DEBUG
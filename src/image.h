@@ -0,0 +1,103 @@
+/*
+ * image.h
+ * The compact binary representation of values, as written by save.c
+ * and read by load.c.
+ */
+
+#ifndef __IMAGE_H_
+#define __IMAGE_H_
+
+/*
+ * An image is the magic number, a version byte, one value, and then
+ * a trailer.
+ *
+ * Each value is one byte of IMAGE_ code followed by its contents.
+ * Numbers (integers and lengths) are written as varints: seven bits
+ * at a time, least significant first, with the high bit of each byte
+ * set if more follow.  Integers are first zigzag-encoded, so that
+ * small negative numbers are short too.  So an image reads the same
+ * on any host, whatever its byte order or word size.
+ *
+ *   IMAGE_NULL				(nothing)
+ *   IMAGE_INTEGER	 integer
+ *   IMAGE_BOOLEAN	 byte, 0 or 1
+ *   IMAGE_PROCESS	 name value
+ *   IMAGE_LABEL	 name value
+ *   IMAGE_SYMBOL	 length, bytes of token
+ *   IMAGE_TUPLE	 tag value, size, that many values, [index]
+ *   IMAGE_DICT		 layer size, length, that many key-value pairs
+ *   IMAGE_REF		 offset
+ *   IMAGE_SHARED	 value
+ *   IMAGE_FROZEN	 value
+ *   IMAGE_STRING	 index
+ *
+ * A tuple or dictionary which appears more than once (as the very
+ * same value, not merely an equal one) is written in full only the
+ * first time; after that, as a reference to the offset (from the
+ * start of the image) of the code which began it.  So shared
+ * structure stays shared when loaded, and cycles can be written
+ * (though not through a tuple's own tag.)
+ *
+ * Symbols are shared by content instead.  The image's string table
+ * is built up as it is read: each symbol written in full is given the
+ * next index, counting from 0, and any later equal symbol is written
+ * as just that index.  So each tag, key and name is stored, and made
+ * when loaded, only once.
+ *
+ * A tuple of at least IMAGE_INDEX_MIN values is followed by an index
+ * of them, so that any one of them can be found without reading the
+ * others: a byte giving the width of each entry and then, unless that
+ * is 0 (for no index), an entry for each value, giving the distance
+ * back to it from the width byte, in that many bytes, least
+ * significant first.  A tuple is only given an index when its values
+ * take up at least IMAGE_INDEX_COST times as much as the index would.
+ *
+ * After the value comes the trailer, which says where to find what
+ * a value in the middle of the image may depend on: the number of
+ * symbols written in full, then the offset of each (as the distance
+ * from the one before), so that the symbol with any index can be
+ * found; and the number of tuples with indexes, then for each, its
+ * offset (as the distance from the one before) and the distance from
+ * there to its index.  The last IMAGE_TRAILER_SIZE bytes of the image
+ * give the offset of the trailer, least significant first.  A reader
+ * which reads the whole value in order can ignore the trailer.
+ *
+ * Processes and labels mean nothing outside the running program, so
+ * each is written as a value which names it: null, unless whoever
+ * saved it knew better (see value_save_state().)  A process is read
+ * back as whichever process its name finds, if any, and a label as
+ * its name.  The state of a running program also marks the values
+ * which were in the shared heap, or frozen, so that they can be put
+ * back there.
+ *
+ * Version 4 images, which have neither indexes nor a trailer; version
+ * 3 images, in which symbols are referred back to by offset like other
+ * values; version 2 images, in which processes and labels have no
+ * names; and images written before there was a magic number (which
+ * begin with a value type, and hold host-order structures) can still
+ * be read.
+ */
+
+#define	IMAGE_MAGIC		"\211KSH"
+#define	IMAGE_MAGIC_SIZE	4
+#define	IMAGE_VERSION		5
+
+#define	IMAGE_NULL		0
+#define	IMAGE_INTEGER		1
+#define	IMAGE_BOOLEAN		2
+#define	IMAGE_PROCESS		3
+#define	IMAGE_LABEL		4
+#define	IMAGE_SYMBOL		9
+#define	IMAGE_TUPLE		10
+#define	IMAGE_DICT		11
+#define	IMAGE_REF		12
+#define	IMAGE_SHARED		13
+#define	IMAGE_FROZEN		14
+#define	IMAGE_STRING		15
+
+#define	IMAGE_VARINT_MAX	10	/* bytes, for an unsigned long */
+#define	IMAGE_INDEX_MIN		64	/* values, in a tuple with an index */
+#define	IMAGE_INDEX_COST	4
+#define	IMAGE_TRAILER_SIZE	8	/* bytes */
+
+#endif /* !__IMAGE_H_ */
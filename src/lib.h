@@ -27,6 +27,7 @@
 #ifdef STANDALONE
 /* stdlib.h */
 void	*malloc(unsigned int);
+void	*realloc(void *, unsigned int);
 void	 free(void *);
 void	 exit(int);
 void	 abort(void);
@@ -37,6 +38,7 @@ int	 strncmp(const char *, const char *, unsigned int);
 char	*strncpy(char *, const char *, unsigned int);
 int      strlen(const char *);
 void	*memset(void *, int, unsigned int);
+void	*memcpy(void *, const void *, unsigned int);
 
 /* ctype.h */
 int	 k_isspace(char);
@@ -51,6 +53,26 @@ int	 k_isalpha(char);
 #define k_isalpha(x) isalpha((int)x)
 #endif
 
+/*
+ * In builds with THREADS, storage private to each thread, and atomic
+ * reads, writes, increments and decrements (which yield the new value)
+ * of integers or pointers shared between threads.  Otherwise, these
+ * are just what they seem.
+ */
+#ifdef THREADS
+#define	THREAD_LOCAL		__thread
+#define	ATOMIC_READ(x)		__atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define	ATOMIC_WRITE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define	ATOMIC_INC(x)		__sync_add_and_fetch(&(x), 1)
+#define	ATOMIC_DEC(x)		__sync_sub_and_fetch(&(x), 1)
+#else
+#define	THREAD_LOCAL
+#define	ATOMIC_READ(x)		(x)
+#define	ATOMIC_WRITE(x, v)	((x) = (v))
+#define	ATOMIC_INC(x)		(++(x))
+#define	ATOMIC_DEC(x)		(--(x))
+#endif
+
 int	 k_atoi(const char *, unsigned int);
 
 #endif	/* !__LIB_H_ */
@@ -1,13 +1,16 @@
 /*
  * load.c
- * Load values from a stream-like process.
+ * Load values from a stream-like process, through a reader, or from
+ * a file mapped into memory.
  */
 
 #include "lib.h"
 
 #include "load.h"
+#include "image.h"
 #include "value.h"
 #include "stream.h"
+#include "file.h"
 
 #ifdef DEBUG
 #include "cmdline.h"
@@ -15,75 +18,853 @@
 #include "render.h"
 #endif
 
-int
-value_load(struct value *value, struct process *p)
+/*
+ * An image mapped into memory, from which the values of large tuples
+ * are loaded only when they are fetched.  It is shared by all the lazy
+ * tuples made from it, and never changes, so they may load from it in
+ * several threads at once.  The trailer tells where each symbol, and
+ * each index, is to be found.
+ */
+struct image {
+	struct lazy_source lazy;
+	const char	*data;
+	unsigned long	 size;
+	unsigned long	 trailer;	/* offset */
+	unsigned char	 version;
+	unsigned long	*strings;	/* offset of each symbol */
+	unsigned long	 num_strings;
+	struct indexed	*indexed;	/* sorted by start */
+	unsigned long	 num_indexed;
+};
+
+struct indexed {
+	unsigned long	 start;
+	unsigned long	 index;
+};
+
+/*
+ * Where a value is being loaded from: either a block of memory, which
+ * is decoded in place, or (if that is NULL) a reader.  When loading
+ * lazily from an image, any value it refers to which has not been
+ * loaded this time is loaded afresh from where it is in the image.
+ */
+struct source {
+	const char	*pos;
+	const char	*end;
+	struct reader	*reader;
+	struct image	*image;		/* if loading lazily, else NULL */
+	unsigned long	 offset;	/* bytes got so far */
+	struct loaded	*loaded;	/* table of loaded_size entries */
+	unsigned int	 loaded_size;
+	unsigned int	 loaded_count;
+	struct value	*strings;	/* table of strings_size symbols */
+	unsigned int	 strings_size;
+	unsigned int	 strings_count;
+	unsigned char	 version;
+	process_finder	 finder;	/* for names of processes, or NULL */
+};
+
+/*
+ * Structured values loaded so far, by the offsets at which they began,
+ * for references back to them.  They are noted in the order in which
+ * they begin, so the table is sorted by offset.  A tuple is noted
+ * before its tag is loaded, though it cannot be created until after;
+ * until then its value is null.
+ */
+struct loaded {
+	unsigned long	 offset;
+	struct value	 value;
+};
+
+#define	LOADED_INITIAL	256
+
+/*
+ * Since version 4, every symbol in an image is given the next index
+ * in a table of strings, and later equal symbols refer to it by that
+ * index; so each distinct symbol is made only once, and all of its
+ * occurrences share it.
+ */
+#define	STRINGS_INITIAL	64
+
+static int
+get(struct source *s, void *buffer, unsigned int size)
+{
+	if (s->pos == NULL) {
+		if (reader_read(s->reader, buffer, size) != size)
+			return 0;
+	} else {
+		if ((unsigned int)(s->end - s->pos) < size)
+			return 0;
+		memcpy(buffer, s->pos, size);
+		s->pos += size;
+	}
+	s->offset += size;
+	return 1;
+}
+
+static int
+get_byte(struct source *s, unsigned char *c)
+{
+	if (s->pos == NULL) {
+		if (reader_read(s->reader, c, 1) != 1)
+			return 0;
+	} else {
+		if (s->pos == s->end)
+			return 0;
+		*c = (unsigned char)*s->pos++;
+	}
+	s->offset++;
+	return 1;
+}
+
+/*
+ * Where in the table the value which began at the given offset is, or
+ * would be, noted.
+ */
+static unsigned int
+noted_at(const struct source *s, unsigned long offset)
+{
+	unsigned int lo = 0, hi = s->loaded_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->loaded[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Note that a value begins at the given offset, returning where in
+ * the table it was noted, or -1 if the table could not grow.  Values
+ * are usually noted in order; those loaded afresh from earlier in an
+ * image are slotted in.
+ */
+static int
+note(struct source *s, unsigned long offset, const struct value *value)
+{
+	struct loaded *table;
+	unsigned int size, i, at;
+
+	if (s->loaded_count == s->loaded_size) {
+		size = s->loaded_size == 0 ? LOADED_INITIAL : 2 * s->loaded_size;
+		table = realloc(s->loaded, size * sizeof(struct loaded));
+		if (table == NULL)
+			return -1;
+		s->loaded = table;
+		s->loaded_size = size;
+	}
+	at = s->loaded_count;
+	if (at > 0 && s->loaded[at - 1].offset > offset) {
+		at = noted_at(s, offset);
+		for (i = s->loaded_count; i > at; i--)
+			s->loaded[i] = s->loaded[i - 1];
+	}
+	s->loaded[at].offset = offset;
+	value_copy(&s->loaded[at].value, value);
+	s->loaded_count++;
+	return (int)at;
+}
+
+/*
+ * Give the symbol the next index in the table of strings.
+ */
+static int
+note_string(struct source *s, const struct value *value)
+{
+	struct value *table;
+	unsigned int size;
+
+	if (s->strings_count == s->strings_size) {
+		size = s->strings_size == 0 ?
+		    STRINGS_INITIAL : 2 * s->strings_size;
+		table = realloc(s->strings, size * sizeof(struct value));
+		if (table == NULL)
+			return 0;
+		s->strings = table;
+		s->strings_size = size;
+	}
+	value_copy(&s->strings[s->strings_count++], value);
+	return 1;
+}
+
+/*
+ * Find where in the table the value which began at the given offset
+ * was noted, or -1 if none was.
+ */
+static int
+find_noted(const struct source *s, unsigned long offset)
+{
+	unsigned int lo = noted_at(s, offset);
+
+	if (lo == s->loaded_count || s->loaded[lo].offset != offset)
+		return -1;
+	return (int)lo;
+}
+
+static int load(struct value *, struct source *);
+
+/*
+ * Load the value which begins at the given offset in the image, then
+ * carry on from where we were.
+ */
+static int
+load_at(struct source *s, unsigned long offset, struct value *value)
+{
+	const char *pos = s->pos;
+	unsigned long was = s->offset;
+	int ok;
+
+	s->pos = s->image->data + offset;
+	s->offset = offset;
+	ok = load(value, s);
+	s->pos = pos;
+	s->offset = was;
+	return ok;
+}
+
+/*
+ * Find the value which began at the given offset, which is before the
+ * reference to it; or, if loading lazily and it has not been loaded
+ * this time, load it afresh.
+ */
+static int
+find(struct source *s, unsigned long offset, unsigned long before,
+     struct value *value)
+{
+	int n;
+
+	if ((n = find_noted(s, offset)) >= 0) {
+		if (value_is_null(&s->loaded[n].value))
+			return 0;
+		value_copy(value, &s->loaded[n].value);
+		return 1;
+	}
+	if (s->image == NULL || offset >= before)
+		return 0;
+	return load_at(s, offset, value);
+}
+
+static int
+get_varint(struct source *s, unsigned long *u)
+{
+	unsigned char c;
+	unsigned int shift = 0;
+
+	*u = 0;
+	do {
+		if (shift >= 7 * IMAGE_VARINT_MAX || !get_byte(s, &c))
+			return 0;
+		*u |= (unsigned long)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 1;
+}
+
+static int
+get_length(struct source *s, unsigned int *length)
+{
+	unsigned long u;
+
+	if (!get_varint(s, &u) || (unsigned long)(unsigned int)u != u)
+		return 0;
+	*length = (unsigned int)u;
+	return 1;
+}
+
+static int
+get_integer(struct source *s, int *n)
+{
+	unsigned long u;
+
+	if (!get_varint(s, &u))
+		return 0;
+	if (u & 1)
+		*n = -(int)(u >> 1) - 1;
+	else
+		*n = (int)(u >> 1);
+	return 1;
+}
+
+static int
+get_symbol(struct source *s, struct value *value, unsigned int length)
 {
-	unsigned int length, i;
 	char *buffer;
-	unsigned char squeeze;
+	int ok;
 
-	stream_read(NULL, p, &squeeze, sizeof(squeeze));
-	value->type = (enum value_type)squeeze;
+	if (s->pos != NULL) {
+		/*
+		 * The token is right there; no need to read it into
+		 * a buffer first.
+		 */
+		if ((unsigned int)(s->end - s->pos) < length ||
+		    !value_symbol_new(value, s->pos, length))
+			return 0;
+		s->pos += length;
+		s->offset += length;
+		return 1;
+	}
+	if ((buffer = malloc(length)) == NULL)
+		return 0;
+	ok = get(s, buffer, sizeof(char) * length) &&
+	    value_symbol_new(value, buffer, length);
+	free(buffer);
+	return ok;
+}
+
+/*
+ * Skip over the index which follows the values of a large tuple.
+ */
+static int
+skip_index(struct source *s, unsigned int length)
+{
+	unsigned char width, buffer[64];
+	unsigned long size;
+	unsigned int n;
+
+	if (!get_byte(s, &width) || width > sizeof(unsigned long))
+		return 0;
+	size = (unsigned long)width * length;
+	if (s->pos != NULL) {
+		if ((unsigned long)(s->end - s->pos) < size)
+			return 0;
+		s->pos += size;
+		s->offset += size;
+		return 1;
+	}
+	while (size > 0) {
+		n = size < sizeof(buffer) ? (unsigned int)size : sizeof(buffer);
+		if (!get(s, buffer, n))
+			return 0;
+		size -= n;
+	}
+	return 1;
+}
+
+/*
+ * If the tuple which began at the given offset in the image was given
+ * an index, return the offset of the index; otherwise 0.
+ */
+static unsigned long
+find_index(const struct image *image, unsigned long start,
+	   unsigned int length)
+{
+	unsigned long lo = 0, hi = image->num_indexed, mid, index;
+	unsigned char width;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (image->indexed[mid].start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == image->num_indexed || image->indexed[lo].start != start)
+		return 0;
+	index = image->indexed[lo].index;
+	width = (unsigned char)image->data[index];
+	if (width == 0 || width > sizeof(unsigned long) ||
+	    (image->trailer - index - 1) / width < length)
+		return 0;
+	return index;
+}
+
+static int
+load(struct value *value, struct source *s)
+{
+	unsigned int length, i;
+	unsigned char code;
+	unsigned long start = s->offset, offset;
+	int n;
+
+	if (!get_byte(s, &code))
+		return 0;
+
+	switch (code) {
+	case IMAGE_NULL:
+		value_copy(value, &VNULL);
+		break;
+	case IMAGE_PROCESS:
+	    {
+		struct value name;
+		struct process *p = NULL;
+
+		if (s->version >= 3 && !load(&name, s))
+			return 0;
+		if (s->version >= 3 && s->finder != NULL)
+			p = s->finder(&name);
+		if (p != NULL)
+			value_process_set(value, p);
+		else
+			value_copy(value, &VNULL);
+		break;
+	    }
+	case IMAGE_LABEL:
+		if (s->version < 3)
+			value_copy(value, &VNULL);
+		else if (!load(value, s))
+			return 0;
+		break;
+	case IMAGE_INTEGER:
+		if (!get_integer(s, &n))
+			return 0;
+		value_integer_set(value, n);
+		break;
+	case IMAGE_BOOLEAN:
+		if (!get_byte(s, &code))
+			return 0;
+		value_boolean_set(value, code != 0);
+		break;
+	case IMAGE_SYMBOL:
+		if (!get_length(s, &length) || !get_symbol(s, value, length))
+			return 0;
+		if (s->version >= 4 && s->image == NULL ? !note_string(s, value) :
+		    note(s, start, value) < 0)
+			return 0;
+		break;
+	case IMAGE_STRING:
+		if (!get_varint(s, &offset))
+			return 0;
+		if (s->image != NULL) {
+			/*
+			 * Symbols are noted by offset instead, since
+			 * not every one has been loaded.
+			 */
+			if (offset >= s->image->num_strings ||
+			    !find(s, s->image->strings[offset], start, value) ||
+			    value->type != VALUE_SYMBOL)
+				return 0;
+			break;
+		}
+		if (offset >= s->strings_count)
+			return 0;
+		value_copy(value, &s->strings[offset]);
+		break;
+	case IMAGE_TUPLE:
+	    {
+		struct value tag, val;
+		unsigned long index = 0;
+
+		if (note(s, start, &VNULL) < 0 || !load(&tag, s) ||
+		    !get_length(s, &length))
+			return 0;
+		if (s->image != NULL && length >= IMAGE_INDEX_MIN)
+			index = find_index(s->image, start, length);
+		if (index != 0 ?
+		    !value_tuple_new_lazy(value, &tag, length, &s->image->lazy,
+		    index) : !value_tuple_new(value, &tag, length))
+			return 0;
+		/* Values loaded afresh along the way may have moved its note. */
+		value_copy(&s->loaded[find_noted(s, start)].value, value);
+		if (index != 0) {
+			/*
+			 * Leave the values where they are, until they
+			 * are fetched.
+			 */
+			s->offset = index + 1 + (unsigned long)length *
+			    (unsigned char)s->image->data[index];
+			s->pos = s->image->data + s->offset;
+			break;
+		}
+		for (i = 0; i < length; i++) {
+			if (!load(&val, s))
+				return 0;
+			value_tuple_store(value, i, &val);
+		}
+		if (length >= IMAGE_INDEX_MIN && s->version >= 5 &&
+		    !skip_index(s, length))
+			return 0;
+		break;
+	    }
+	case IMAGE_DICT:
+	    {
+		struct value key, val;
+
+		if (!get_length(s, &length) || !value_dict_new(value, length) ||
+		    note(s, start, value) < 0 || !get_length(s, &length))
+			return 0;
+		for (i = 0; i < length; i++) {
+			if (!load(&key, s) || !load(&val, s))
+				return 0;
+			value_dict_store(value, &key, &val);
+		}
+		break;
+	    }
+	case IMAGE_REF:
+		if (!get_varint(s, &offset) || !find(s, offset, start, value))
+			return 0;
+		break;
+	case IMAGE_SHARED:
+	    {
+		struct heap *heap = value_heap_get_current();
+
+		value_heap_set_current(NULL);
+		n = load(value, s);
+		value_heap_set_current(heap);
+		if (!n)
+			return 0;
+		break;
+	    }
+	case IMAGE_FROZEN:
+	    {
+		struct value thawed;
+		unsigned int strings = s->strings_count;
+
+		/*
+		 * Freezing copies; later references should find the
+		 * frozen copy.
+		 */
+		if (!load(&thawed, s) || !value_freeze(value, &thawed))
+			return 0;
+		if ((n = find_noted(s, start + 1)) >= 0)
+			value_copy(&s->loaded[n].value, value);
+		else if (value->type == VALUE_SYMBOL &&
+		    s->strings_count > strings)
+			value_copy(&s->strings[strings], value);
+		break;
+	    }
+	default:
+		return 0;
+	}
 
 #ifdef DEBUG
 	process_render(process_err, "(load:%s ", type_name_table[value->type]);
+	value_portray(process_err, value);
+	process_render(process_err, ")\n");
 #endif
+	return 1;
+}
+
+/*
+ * Images from before there was a magic number: structures as they
+ * were laid out in memory on the host which wrote them.  The type of
+ * the value has already been read.
+ */
+static int
+load_legacy(struct value *value, struct source *s, unsigned char squeeze)
+{
+	unsigned int length, i;
+
+	value->type = (enum value_type)squeeze;
 
 	if ((value->type & VALUE_STRUCTURED) == 0) {
-		stream_read(NULL, p, &value->value, sizeof(value->value));
+		if (!get(s, &value->value, sizeof(value->value)))
+			return 0;
 	} else {
 		switch (value->type) {
 		case VALUE_SYMBOL:
-		    {
-			stream_read(NULL, p, &length, sizeof(length));
-			buffer = malloc(length);
-			stream_read(NULL, p, buffer, sizeof(char) * length);
-			if (!value_symbol_new(value, buffer, length)) {
-                                free(buffer);
-                                return 0;
-                        }
-			free(buffer);
+			if (!get(s, &length, sizeof(length)) ||
+			    !get_symbol(s, value, length))
+				return 0;
 			break;
-		    }
 		case VALUE_TUPLE:
 		    {
 			struct value tag;
-                        if (!value_load(&tag, p))
-                                return 0;
-                        /* XXX should eventually dispatch to a handler based on tag? */
-                        if (value_equal(&tag, &tag_dict)) {
-                                struct value key, val;
-
-                                stream_read(NULL, p, &length, sizeof(length)); /* length is layer_size here */
-                                value_dict_new(value, length);  /* xxx */
-                                stream_read(NULL, p, &length, sizeof(length)); /* length is num entries here */
-                                for (i = 0; i < length; i++) {
-                                        value_load(&key, p);
-                                        value_load(&val, p);
-                                        value_dict_store(value, &key, &val);
-                                }
-                        } else {
-                                struct value val;
-
-                                stream_read(NULL, p, &length, sizeof(length));
-                                value_tuple_new(value, &tag, length);
-                                for (i = 0; i < length; i++) {
-                                        value_load(&val, p);
-                                        value_tuple_store(value, i, &val);
-                                }
-                        }
+
+			if (!get_byte(s, &squeeze) ||
+			    !load_legacy(&tag, s, squeeze))
+				return 0;
+			if (value_equal(&tag, &tag_dict)) {
+				struct value key, val;
+
+				/* length is layer_size here */
+				if (!get(s, &length, sizeof(length)) ||
+				    !value_dict_new(value, length))
+					return 0;
+				/* length is num entries here */
+				if (!get(s, &length, sizeof(length)))
+					return 0;
+				for (i = 0; i < length; i++) {
+					if (!get_byte(s, &squeeze) ||
+					    !load_legacy(&key, s, squeeze) ||
+					    !get_byte(s, &squeeze) ||
+					    !load_legacy(&val, s, squeeze))
+						return 0;
+					value_dict_store(value, &key, &val);
+				}
+			} else {
+				struct value val;
+
+				if (!get(s, &length, sizeof(length)) ||
+				    !value_tuple_new(value, &tag, length))
+					return 0;
+				for (i = 0; i < length; i++) {
+					if (!get_byte(s, &squeeze) ||
+					    !load_legacy(&val, s, squeeze))
+						return 0;
+					value_tuple_store(value, i, &val);
+				}
+			}
 			break;
 		    }
 		default:
-			assert(value->type == VALUE_SYMBOL ||
-			       value->type == VALUE_TUPLE);
 			return 0;
 		}
 	}
-
-#ifdef DEBUG
-	value_portray(process_err, value);
-	process_render(process_err, ")\n");
-#endif
 	return 1;
 }
+
+/*
+ * Read the header, and then the value, of an image.
+ */
+static int
+load_image(struct value *value, struct source *s)
+{
+	unsigned char magic[IMAGE_MAGIC_SIZE];
+	unsigned char version;
+	int ok;
+
+	if (!get_byte(s, &magic[0]))
+		return 0;
+	if (magic[0] != (unsigned char)IMAGE_MAGIC[0])
+		return load_legacy(value, s, magic[0]);
+	if (!get(s, magic + 1, IMAGE_MAGIC_SIZE - 1) ||
+	    strncmp((char *)magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) != 0 ||
+	    !get_byte(s, &version) || version < 2 || version > IMAGE_VERSION)
+		return 0;
+	s->version = version;
+	ok = load(value, s);
+	free(s->loaded);
+	free(s->strings);
+	return ok;
+}
+
+static void
+init_source(struct source *s, process_finder finder)
+{
+	s->image = NULL;
+	s->offset = 0;
+	s->loaded = NULL;
+	s->loaded_size = 0;
+	s->loaded_count = 0;
+	s->strings = NULL;
+	s->strings_size = 0;
+	s->strings_count = 0;
+	s->finder = finder;
+}
+
+/*
+ * Load the value of a lazy tuple made from the image.
+ */
+static int
+image_load(struct lazy_source *lazy, unsigned long index, unsigned int at,
+	   struct value *value)
+{
+	struct image *image = (struct image *)lazy;
+	const unsigned char *entry;
+	unsigned char width = (unsigned char)image->data[index];
+	unsigned long back = 0;
+	struct source s;
+	int ok;
+
+	entry = (const unsigned char *)image->data + index + 1 +
+	    (unsigned long)width * at;
+	while (width > 0)
+		back = (back << 8) | entry[--width];
+	if (back == 0 || back > index)
+		return 0;
+
+	init_source(&s, NULL);
+	s.image = image;
+	s.version = image->version;
+	s.reader = NULL;
+	s.offset = index - back;
+	s.pos = image->data + s.offset;
+	s.end = image->data + image->trailer;
+	ok = load(value, &s);
+	free(s.loaded);
+	return ok;
+}
+
+static void
+image_release(struct lazy_source *lazy)
+{
+	struct image *image = (struct image *)lazy;
+
+	/* The data is not changed, only unmapped. */
+	file_unmap((void *)(PTR_INT)image->data, image->size);
+	free(image->strings);
+	free(image->indexed);
+	free(image);
+}
+
+/*
+ * Read the trailer of an image mapped into memory, to load it lazily.
+ * Returns NULL if the image cannot be loaded lazily (it is too old, or
+ * nothing in it has an index) or memory ran short; it can still be
+ * loaded in full.
+ */
+static struct image *
+image_new(const char *data, unsigned long size)
+{
+	struct image *image;
+	struct source s;
+	unsigned long trailer = 0, u, last;
+	unsigned int i;
+
+	if (size < IMAGE_MAGIC_SIZE + 1 + IMAGE_TRAILER_SIZE ||
+	    strncmp(data, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) != 0 ||
+	    (unsigned char)data[IMAGE_MAGIC_SIZE] < 5)
+		return NULL;
+	for (i = IMAGE_TRAILER_SIZE; i > 0; i--) {
+		u = (unsigned char)data[size - IMAGE_TRAILER_SIZE + i - 1];
+		if (trailer >> (8 * (sizeof(unsigned long) - 1)) != 0)
+			return NULL;
+		trailer = (trailer << 8) | u;
+	}
+	if (trailer <= IMAGE_MAGIC_SIZE + 1 ||
+	    trailer > size - IMAGE_TRAILER_SIZE)
+		return NULL;
+
+	if ((image = malloc(sizeof(struct image))) == NULL)
+		return NULL;
+	image->lazy.load = image_load;
+	image->lazy.release = image_release;
+	image->lazy.refs = 1;
+	image->data = data;
+	image->size = size;
+	image->trailer = trailer;
+	image->version = (unsigned char)data[IMAGE_MAGIC_SIZE];
+	image->strings = NULL;
+	image->indexed = NULL;
+
+	/*
+	 * Every entry takes at least a byte, which bounds how many
+	 * there can be.
+	 */
+	init_source(&s, NULL);
+	s.reader = NULL;
+	s.pos = data + trailer;
+	s.end = data + size - IMAGE_TRAILER_SIZE;
+	if (!get_varint(&s, &image->num_strings) ||
+	    image->num_strings > (unsigned long)(s.end - s.pos))
+		goto fail;
+	if (image->num_strings > 0 && (image->strings =
+	    malloc(image->num_strings * sizeof(unsigned long))) == NULL)
+		goto fail;
+	for (u = 0, last = 0; u < image->num_strings; u++) {
+		if (!get_varint(&s, &image->strings[u]))
+			goto fail;
+		image->strings[u] += last;
+		last = image->strings[u];
+		if (last >= trailer)
+			goto fail;
+	}
+	if (!get_varint(&s, &image->num_indexed) ||
+	    image->num_indexed == 0 ||
+	    image->num_indexed > (unsigned long)(s.end - s.pos) ||
+	    (image->indexed =
+	    malloc(image->num_indexed * sizeof(struct indexed))) == NULL)
+		goto fail;
+	for (u = 0, last = 0; u < image->num_indexed; u++) {
+		if (!get_varint(&s, &image->indexed[u].start) ||
+		    !get_varint(&s, &image->indexed[u].index))
+			goto fail;
+		image->indexed[u].start += last;
+		image->indexed[u].index += image->indexed[u].start;
+		last = image->indexed[u].start;
+		if (image->indexed[u].index >= trailer)
+			goto fail;
+	}
+	return image;
+
+fail:
+	free(image->strings);
+	free(image->indexed);
+	free(image);
+	return NULL;
+}
+
+int
+value_load(struct value *value, struct reader *r)
+{
+	struct source s;
+
+	init_source(&s, NULL);
+	s.pos = NULL;
+	s.end = NULL;
+	s.reader = r;
+	return load_image(value, &s);
+}
+
+int
+value_load_memory(struct value *value, const void *data, unsigned int size)
+{
+	struct source s;
+
+	init_source(&s, NULL);
+	s.pos = (const char *)data;
+	s.end = s.pos + size;
+	s.reader = NULL;
+	return load_image(value, &s);
+}
+
+/*
+ * Load from the named file, mapping it into memory if possible, and
+ * otherwise reading it as a stream.  If it is mapped, and to be loaded
+ * lazily, the mapping is kept for as long as any lazy tuple needs it.
+ */
+static int
+load_file(struct value *value, const char *locator, process_finder finder,
+	  int lazy)
+{
+	struct source s;
+	struct process *p;
+	void *data;
+	unsigned long size;
+	int ok;
+
+	init_source(&s, finder);
+	if ((data = file_map(locator, &size)) != NULL) {
+		s.pos = (const char *)data;
+		s.end = s.pos + size;
+		s.reader = NULL;
+		if (lazy)
+			s.image = image_new(s.pos, size);
+		ok = load_image(value, &s);
+		if (s.image != NULL)
+			value_lazy_release(&s.image->lazy);
+		else
+			file_unmap(data, size);
+		return ok;
+	}
+
+	p = file_open(locator, "r");
+	s.pos = NULL;
+	s.end = NULL;
+	if ((s.reader = reader_new(p)) == NULL) {
+		stream_close(NULL, p);
+		return 0;
+	}
+	ok = load_image(value, &s);
+	reader_free(s.reader);
+	stream_close(NULL, p);
+	return ok;
+}
+
+int
+value_load_file(struct value *value, const char *locator)
+{
+	return load_file(value, locator, NULL, 0);
+}
+
+int
+value_load_lazily(struct value *value, const char *locator)
+{
+	struct heap *heap = value_heap_get_current();
+	int ok;
+
+	value_heap_set_current(NULL);
+	ok = load_file(value, locator, NULL, 1) && value_freeze(value, value);
+	value_heap_set_current(heap);
+	return ok;
+}
+
+int
+value_load_state(struct value *value, const char *locator,
+		 process_finder finder)
+{
+	return load_file(value, locator, finder, 0);
+}
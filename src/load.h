@@ -8,8 +8,41 @@
 #define __LOAD_H_
 
 struct process;
+struct reader;
 struct value;
 
-int value_load(struct value *, struct process *);
+/*
+ * Each of these sets the given value to the value loaded, and returns
+ * false if it could not be loaded (it was cut short, or memory could
+ * not be allocated.)
+ */
+int value_load(struct value *, struct reader *);
+int value_load_memory(struct value *, const void *, unsigned int);
+
+/*
+ * Load from the named file, mapping it into memory if possible, and
+ * otherwise reading it as a stream (as for *stdin.)
+ */
+int value_load_file(struct value *, const char *);
+
+/*
+ * Like value_load_file(), but into the shared heap, frozen, and if the
+ * file can be mapped into memory, leaving the values of each tuple
+ * which has an index (see image.h) to be loaded only when they are
+ * fetched.  The file stays mapped until none of them is needed any
+ * longer.  A value which is referred to from more than one such tuple
+ * is made once for each.
+ */
+int value_load_lazily(struct value *, const char *);
+
+/*
+ * Load the state of a running program, as saved by value_save_state(),
+ * from the named file.  Each process is found, by its name, with the
+ * given function, which returns NULL if the name finds none; values
+ * which were in the shared heap, or frozen, are put back there.
+ */
+typedef struct process *(*process_finder)(const struct value *);
+
+int value_load_state(struct value *, const char *, process_finder);
 
 #endif /* !__LOAD_H_ */
@@ -6,7 +6,107 @@
 
 #include "lib.h"
 
+#ifdef THREADS
+#include <pthread.h>
+#endif
+
 #include "process.h"
+#include "registry.h"
+#include "sched.h"
+#include "stream.h"
+
+/*
+ * List of all processes which have been created but not yet freed.
+ */
+static struct process *live_head = NULL;
+static unsigned int num_created = 0;
+
+/*
+ * List of processes which have ended, linked through next_live, and
+ * kept until no value refers to them (see process_retire().)
+ */
+static struct process *ended_head = NULL;
+
+/*
+ * With several threads, live_lock guards the list of live processes.
+ * Processes without heaps of their own (streams) are run directly by
+ * whichever thread writes to them, so native_lock serializes all use
+ * of them; the thread holding it may take it again, as when a stream
+ * answers a read by writing to another process.  watch_lock guards
+ * every process's watches (see below), and is taken before
+ * native_lock, never after.
+ */
+#ifdef THREADS
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t native_lock = PTHREAD_MUTEX_INITIALIZER;
+static THREAD_LOCAL unsigned int native_depth = 0;
+
+static void
+lock_native(void)
+{
+	if (native_depth++ == 0)
+		pthread_mutex_lock(&native_lock);
+}
+
+static void
+unlock_native(void)
+{
+	if (--native_depth == 0)
+		pthread_mutex_unlock(&native_lock);
+}
+
+#define	LOCK_LIVE()	pthread_mutex_lock(&live_lock)
+#define	UNLOCK_LIVE()	pthread_mutex_unlock(&live_lock)
+#define	LOCK_WATCH()	pthread_mutex_lock(&watch_lock)
+#define	UNLOCK_WATCH()	pthread_mutex_unlock(&watch_lock)
+#define	LOCK_NATIVE()	lock_native()
+#define	UNLOCK_NATIVE()	unlock_native()
+#else
+#define	LOCK_LIVE()	do { } while (0)
+#define	UNLOCK_LIVE()	do { } while (0)
+#define	LOCK_WATCH()	do { } while (0)
+#define	UNLOCK_WATCH()	do { } while (0)
+#define	LOCK_NATIVE()	do { } while (0)
+#define	UNLOCK_NATIVE()	do { } while (0)
+#endif
+
+/*
+ * The tag index of a mailbox: a hash table of chains, one for each
+ * distinct tag, each linking the messages with that tag from oldest
+ * to newest.  A chain holds no copy of its tag; the tag of its oldest
+ * message serves.  Empty chains are freed.
+ */
+struct tag_chain {
+	struct tag_chain *next;		/* in the same bucket */
+	unsigned int	 hash;
+	struct message	*oldest;
+	struct message	*newest;
+};
+
+struct tag_index {
+	struct tag_chain **buckets;
+	unsigned int	 size;		/* a power of two */
+	unsigned int	 count;		/* of chains */
+};
+
+#define TAG_INDEX_MIN	16
+
+/*
+ * A watch is one process's interest in the end of another; a link is
+ * a pair of them, one each way.  Each watch is on two lists: the
+ * watchers of the watched process, and the watches of the watcher,
+ * so that it can be dropped when either ends first.
+ */
+struct watch {
+	struct process	*watcher;
+	struct process	*watched;
+	int		 link;		/* or else a monitor */
+	struct watch	*next_watcher;	/* of the watched process */
+	struct watch	*prev_watcher;
+	struct watch	*next_watching;	/* of the watcher */
+	struct watch	*prev_watching;
+};
 
 struct process *
 process_new(void)
@@ -16,22 +116,280 @@ process_new(void)
 	p = malloc(sizeof(struct process));
 	p->head = NULL;
 	p->tail = NULL;
+	p->tags = NULL;
+	p->registration = NULL;
+	p->watchers = NULL;
+	p->watching = NULL;
+	p->supervised = 0;
+	p->entry = 0;
+	p->restarts = 0;
+#ifdef THREADS
+	p->inbox = NULL;
+#endif
 	p->run = NULL;
+	p->write = NULL;
+	p->flush = NULL;
+	p->buffer = NULL;
+	p->read = NULL;
 	p->aux = NULL;
+	value_copy(&p->aux_value, &VNULL);
+	p->heap = NULL;
 	p->waiting = 0;
 	p->done = 0;
+	p->sched = SCHED_NONE;
+	p->priority = PRIORITY_NORMAL;
+	p->slice = 0;
+	p->slice_used = 0;
+	p->latency = 0;
+	p->ready_since = 0;
+	p->due = 0;
+	p->timer_set = 0;
+	p->timed_out = 0;
+	p->sleeping = 0;
+	p->deadline = 0;
+	p->capacity = 0;
+	p->overflow = MAILBOX_BLOCK;
+	p->depth = 0;
+	p->max_depth = 0;
+	p->received = 0;
+	p->dropped = 0;
+	p->refused = 0;
+	p->send_to = NULL;
+	p->senders = NULL;
+	p->next_sender = NULL;
 	p->next = NULL;
+	p->prev = NULL;
+	p->next_timer = NULL;
+	p->prev_timer = NULL;
+	p->timer_slot = NULL;
+	p->referenced = 0;
+
+	LOCK_LIVE();
+	p->number = ++num_created;
+	p->prev_live = NULL;
+	p->next_live = live_head;
+	if (live_head != NULL)
+		live_head->prev_live = p;
+	live_head = p;
+	UNLOCK_LIVE();
 
 	return p;
 }
 
-void
-process_enqueue(struct process *p, const struct value *v)
+/*** tag index ***/
+
+/*
+ * The tag by which the message would be indexed, or NULL if it would
+ * not be.
+ */
+static const struct value *
+message_tag(const struct message *m)
+{
+	const struct value *tag;
+
+	if (m->value.type != VALUE_TUPLE)
+		return NULL;
+	tag = value_tuple_get_tag(&m->value);
+	if (tag->type != VALUE_SYMBOL && tag->type != VALUE_INTEGER)
+		return NULL;
+	return tag;
+}
+
+static struct tag_chain *
+find_chain(const struct tag_index *ti, const struct value *tag,
+	   unsigned int hash)
+{
+	struct tag_chain *c;
+
+	for (c = ti->buckets[hash & (ti->size - 1)]; c != NULL; c = c->next) {
+		if (c->hash == hash &&
+		    value_equal(message_tag(c->oldest), tag))
+			return c;
+	}
+	return NULL;
+}
+
+static void
+grow_index(struct tag_index *ti)
+{
+	struct tag_chain **old = ti->buckets, *c, *n;
+	unsigned int i, old_size = ti->size;
+
+	ti->size = old_size == 0 ? TAG_INDEX_MIN : old_size * 2;
+	ti->buckets = malloc(ti->size * sizeof(struct tag_chain *));
+	assert(ti->buckets != NULL);
+	for (i = 0; i < ti->size; i++)
+		ti->buckets[i] = NULL;
+	for (i = 0; i < old_size; i++) {
+		for (c = old[i]; c != NULL; c = n) {
+			n = c->next;
+			c->next = ti->buckets[c->hash & (ti->size - 1)];
+			ti->buckets[c->hash & (ti->size - 1)] = c;
+		}
+	}
+	free(old);
+}
+
+/*
+ * Link a message, newer than any already indexed, into its chain.
+ */
+static void
+index_message(struct tag_index *ti, struct message *m)
+{
+	const struct value *tag;
+	struct tag_chain *c;
+	unsigned int hash;
+
+	m->chain = NULL;
+	m->next_tag = NULL;
+	m->prev_tag = NULL;
+	if ((tag = message_tag(m)) == NULL)
+		return;
+	hash = value_hash(tag);
+	if ((c = find_chain(ti, tag, hash)) == NULL) {
+		if (ti->count >= ti->size)
+			grow_index(ti);
+		c = malloc(sizeof(struct tag_chain));
+		assert(c != NULL);
+		c->hash = hash;
+		c->oldest = c->newest = NULL;
+		c->next = ti->buckets[hash & (ti->size - 1)];
+		ti->buckets[hash & (ti->size - 1)] = c;
+		ti->count++;
+	}
+	m->chain = c;
+	m->prev_tag = c->newest;
+	if (c->newest != NULL)
+		c->newest->next_tag = m;
+	else
+		c->oldest = m;
+	c->newest = m;
+}
+
+static void
+unindex_message(struct tag_index *ti, struct message *m)
+{
+	struct tag_chain *c = m->chain, **cp;
+
+	if (c == NULL)
+		return;
+	if (m->prev_tag != NULL)
+		m->prev_tag->next_tag = m->next_tag;
+	else
+		c->oldest = m->next_tag;
+	if (m->next_tag != NULL)
+		m->next_tag->prev_tag = m->prev_tag;
+	else
+		c->newest = m->prev_tag;
+	m->chain = NULL;
+	if (c->oldest != NULL)
+		return;
+
+	for (cp = &ti->buckets[c->hash & (ti->size - 1)]; *cp != c;
+	     cp = &(*cp)->next)
+		;
+	*cp = c->next;
+	free(c);
+	ti->count--;
+}
+
+/*
+ * Index the whole mailbox, the first time it is needed.
+ */
+static struct tag_index *
+get_index(struct process *p)
 {
 	struct message *m;
 
+	if (p->tags != NULL)
+		return p->tags;
+	p->tags = malloc(sizeof(struct tag_index));
+	assert(p->tags != NULL);
+	p->tags->buckets = NULL;
+	p->tags->size = 0;
+	p->tags->count = 0;
+	grow_index(p->tags);
+	for (m = p->tail; m != NULL; m = m->prev)
+		index_message(p->tags, m);
+	return p->tags;
+}
+
+static void
+free_index(struct tag_index *ti)
+{
+	struct tag_chain *c, *n;
+	unsigned int i;
+
+	for (i = 0; i < ti->size; i++) {
+		for (c = ti->buckets[i]; c != NULL; c = n) {
+			n = c->next;
+			free(c);
+		}
+	}
+	free(ti->buckets);
+	free(ti);
+}
+
+/*** mailboxes ***/
+
+/*
+ * Message nodes are not freed when they are received, but kept (up
+ * to a limit) for reuse, so that in the steady state sending and
+ * receiving messages does not allocate.  Each thread keeps spares of
+ * its own, so no locking is needed; in a threaded build, a node can
+ * be taken from one thread's spares and returned to another's.
+ */
+#define MESSAGE_SPARES_MAX	1024
+
+static THREAD_LOCAL struct message *spare_messages = NULL;
+static THREAD_LOCAL unsigned int num_spare_messages = 0;
+
+static struct message *
+message_new(void)
+{
+	struct message *m;
+
+	if ((m = spare_messages) != NULL) {
+		spare_messages = m->next;
+		num_spare_messages--;
+		return m;
+	}
 	m = malloc(sizeof(struct message));
-	value_copy(&m->value, v);
+	assert(m != NULL);
+	return m;
+}
+
+static void
+message_free(struct message *m)
+{
+	if (num_spare_messages >= MESSAGE_SPARES_MAX) {
+		free(m);
+		return;
+	}
+	m->next = spare_messages;
+	spare_messages = m;
+	num_spare_messages++;
+}
+
+void
+process_free_spares(void)
+{
+	struct message *m;
+
+	while ((m = spare_messages) != NULL) {
+		spare_messages = m->next;
+		free(m);
+	}
+	num_spare_messages = 0;
+}
+
+/*
+ * Add the message to the mailbox, as the newest.
+ */
+static void
+link_message(struct process *p, struct message *m)
+{
+	m->chain = NULL;
 	m->prev = NULL;
 	m->next = p->head;
 	if (p->head != NULL)
@@ -39,49 +397,659 @@ process_enqueue(struct process *p, const struct value *v)
 	p->head = m;
 	if (p->tail == NULL)
 		p->tail = m;
+	if (p->tags != NULL)
+		index_message(p->tags, m);
 }
 
-int
-process_dequeue(struct process *p, struct value *v)
+/*
+ * Take the given message out of the mailbox, wherever it is, and
+ * free it, keeping only its value.  If that makes room for processes
+ * waiting to send, wake them.
+ */
+static void
+remove_message(struct process *p, struct message *m, struct value *v)
+{
+	value_copy(v, &m->value);
+
+	if (m->prev != NULL)
+		m->prev->next = m->next;
+	else
+		p->head = m->next;
+	if (m->next != NULL)
+		m->next->prev = m->prev;
+	else
+		p->tail = m->prev;
+	if (p->tags != NULL)
+		unindex_message(p->tags, m);
+
+	message_free(m);
+	ATOMIC_DEC(p->depth);
+	if (ATOMIC_READ(p->senders) != NULL)
+		sched_wake_senders(p);
+}
+
+/*
+ * Count a message for the process, if its mailbox has room for it
+ * (or if force is true); returns false if it does not.  Any number
+ * of threads may do this at once.
+ */
+static int
+reserve(struct process *p, int force)
+{
+	unsigned int capacity = ATOMIC_READ(p->capacity);
+	unsigned int depth;
+
+	if (capacity == 0 || force ||
+	    ATOMIC_READ(p->overflow) == MAILBOX_DROP) {
+		depth = ATOMIC_INC(p->depth);
+	} else {
+#ifdef THREADS
+		do {
+			depth = ATOMIC_READ(p->depth);
+			if (depth >= capacity)
+				return 0;
+		} while (!__sync_bool_compare_and_swap(&p->depth,
+		    depth, depth + 1));
+		depth++;
+#else
+		if (p->depth >= capacity)
+			return 0;
+		depth = ++p->depth;
+#endif
+	}
+	ATOMIC_INC(p->received);
+	if (depth > ATOMIC_READ(p->max_depth))
+		ATOMIC_WRITE(p->max_depth, depth);
+	return 1;
+}
+
+/*
+ * If the process drops its oldest messages when its mailbox is full,
+ * drop as many as it holds too many.  Only the thread running the
+ * process (or sending to it, without THREADS) may do this.
+ */
+static void
+drop_oldest(struct process *p)
+{
+	struct value v;
+
+	if (p->capacity == 0 || p->overflow != MAILBOX_DROP)
+		return;
+	while (ATOMIC_READ(p->depth) > p->capacity && p->tail != NULL) {
+		remove_message(p, p->tail, &v);
+		ATOMIC_INC(p->dropped);
+	}
+}
+
+#ifdef THREADS
+/*
+ * Copy the value into a fragment of its own (unless it is frozen),
+ * push the message onto the process's inbox, and wake the process if
+ * it is blocked.  Any number of threads may post to one process at
+ * once.  (If the process is about to block, sched_put() will see the
+ * message; see there.)
+ */
+static void
+post_message(struct process *p, struct message *m, const struct value *v)
+{
+	struct message *top, *seen = NULL;
+
+	if (!value_is_frozen(v)) {
+		m->fragment = value_heap_new_fragment();
+		assert(m->fragment != NULL);
+		value_heap_copy(m->fragment, &m->value, v);
+	} else {
+		m->fragment = NULL;
+		value_copy(&m->value, v);
+	}
+	do {
+		top = seen;
+		m->next = top;
+		seen = __sync_val_compare_and_swap(&p->inbox, top, m);
+	} while (seen != top);
+	if (ATOMIC_READ(p->sched) == SCHED_BLOCKED)
+		sched_wake(p);
+}
+
+/*
+ * Move every message posted to the process into its mailbox, oldest
+ * first, merging their fragments into its heap, and drop any it has
+ * no room for.  Only the thread running the process (or one which has
+ * stopped all others) may do this.
+ */
+static void
+receive_posted(struct process *p)
+{
+	struct message *m, *next, *oldest = NULL;
+
+	m = __sync_lock_test_and_set(&p->inbox, NULL);
+	for (; m != NULL; m = next) {
+		next = m->next;
+		m->next = oldest;
+		oldest = m;
+	}
+	for (m = oldest; m != NULL; m = next) {
+		next = m->next;
+		if (m->fragment != NULL) {
+			value_heap_merge(p->heap, m->fragment);
+			m->fragment = NULL;
+		}
+		link_message(p, m);
+	}
+	drop_oldest(p);
+}
+
+#define	RECEIVE_POSTED(p)	receive_posted(p)
+#else
+#define	RECEIVE_POSTED(p)	do { } while (0)
+#endif
+
+/*
+ * Put a copy of the value in the process's mailbox, once it has been
+ * counted by reserve().
+ */
+static void
+deliver(struct process *p, const struct value *v)
 {
 	struct message *m;
 
-	m = p->tail;
-	if (m == NULL)
+	m = message_new();
+#ifdef THREADS
+	if (p->heap != NULL) {
+		post_message(p, m, v);
+		return;
+	}
+	m->fragment = NULL;
+#endif
+	LOCK_NATIVE();
+	if (p->heap != NULL) {
+		value_heap_copy(p->heap, &m->value, v);
+		m->heap = NULL;
+	} else {
+		value_copy(&m->value, v);
+		m->heap = value_heap_get_current();
+	}
+	link_message(p, m);
+	drop_oldest(p);
+	if (p->sched == SCHED_BLOCKED)
+		sched_wake(p);
+	UNLOCK_NATIVE();
+}
+
+int
+process_enqueue(struct process *p, const struct value *v)
+{
+	if (ATOMIC_READ(p->done))
+		return 1;	/* dropped */
+	if (!reserve(p, 0)) {
+		if (ATOMIC_READ(p->overflow) == MAILBOX_FAIL)
+			ATOMIC_INC(p->refused);
 		return 0;
-	value_copy(v, &m->value);
+	}
+	deliver(p, v);
+	return 1;
+}
+
+/*** watches ***/
+
+/*
+ * With watch_lock held.
+ */
+static void
+add_watch(struct process *watcher, struct process *watched, int link)
+{
+	struct watch *w;
 
-	/* remove message from queue */
-	assert(m->next == NULL);
-	if (m->prev == NULL)
-		p->head = NULL;
+	w = malloc(sizeof(struct watch));
+	assert(w != NULL);
+	w->watcher = watcher;
+	w->watched = watched;
+	w->link = link;
+	w->prev_watcher = NULL;
+	w->next_watcher = watched->watchers;
+	if (w->next_watcher != NULL)
+		w->next_watcher->prev_watcher = w;
+	watched->watchers = w;
+	w->prev_watching = NULL;
+	w->next_watching = watcher->watching;
+	if (w->next_watching != NULL)
+		w->next_watching->prev_watching = w;
+	watcher->watching = w;
+}
+
+/*
+ * With watch_lock held.
+ */
+static void
+drop_watch(struct watch *w)
+{
+	if (w->prev_watcher != NULL)
+		w->prev_watcher->next_watcher = w->next_watcher;
 	else
-		m->prev->next = NULL;
-	p->tail = m->prev;
+		w->watched->watchers = w->next_watcher;
+	if (w->next_watcher != NULL)
+		w->next_watcher->prev_watcher = w->prev_watcher;
+	if (w->prev_watching != NULL)
+		w->prev_watching->next_watching = w->next_watching;
+	else
+		w->watcher->watching = w->next_watching;
+	if (w->next_watching != NULL)
+		w->next_watching->prev_watching = w->prev_watching;
+	free(w);
+}
+
+/*
+ * Send the watcher a message telling it that the watched process has
+ * ended, for the given reason: <down: p, reason> for a monitor, or
+ * <exit: p, reason> for a link.  It is delivered whether or not the
+ * watcher's mailbox has room.  With watch_lock held.
+ */
+static void
+notify(struct process *watcher, struct process *watched, int link,
+       const struct value *reason)
+{
+	struct value tag, msg, who;
+
+	if (!value_symbol_new(&tag, link ? "exit" : "down", 4) ||
+	    !value_tuple_new(&msg, &tag, 2))
+		return;
+	value_process_set(&who, watched);
+	value_tuple_store(&msg, 0, &who);
+	value_tuple_store(&msg, 1, reason);
+	reserve(watcher, 1);
+	deliver(watcher, &msg);
+}
+
+/*
+ * Watch the process (both ways, if link is true), unless it has
+ * already ended, in which case the watcher is told so at once, with
+ * the reason noproc.
+ */
+static void
+watch(struct process *watcher, struct process *watched, int link)
+{
+	struct value noproc;
+
+	LOCK_WATCH();
+	if (watched->done) {
+		if (value_symbol_new(&noproc, "noproc", 6))
+			notify(watcher, watched, link, &noproc);
+	} else {
+		add_watch(watcher, watched, link);
+		if (link)
+			add_watch(watched, watcher, link);
+	}
+	UNLOCK_WATCH();
+}
 
-	free(m);
+void
+process_monitor(struct process *watcher, struct process *watched)
+{
+	watch(watcher, watched, 0);
+}
+
+void
+process_link(struct process *p, struct process *q)
+{
+	watch(p, q, 1);
+}
+
+void
+process_exit(struct process *p, const struct value *reason)
+{
+	struct value normal;
+	struct watch *w;
 
+	LOCK_WATCH();
+	if (reason == NULL && p->watchers != NULL) {
+		value_symbol_new(&normal, "normal", 6);
+		reason = &normal;
+	}
+	while ((w = p->watchers) != NULL) {
+		notify(w->watcher, p, w->link, reason);
+		drop_watch(w);
+	}
+	while ((w = p->watching) != NULL)
+		drop_watch(w);
+	ATOMIC_WRITE(p->done, 1);
+	UNLOCK_WATCH();
+}
+
+void
+process_set_mailbox(struct process *p, unsigned int capacity, int overflow)
+{
+	assert(overflow >= MAILBOX_BLOCK && overflow <= MAILBOX_FAIL);
+	ATOMIC_WRITE(p->capacity, capacity);
+	ATOMIC_WRITE(p->overflow, overflow);
+	RECEIVE_POSTED(p);
+	drop_oldest(p);
+	if (ATOMIC_READ(p->senders) != NULL)
+		sched_wake_senders(p);
+}
+
+int
+process_has_room(struct process *p)
+{
+	unsigned int capacity = ATOMIC_READ(p->capacity);
+
+	return capacity == 0 || ATOMIC_READ(p->overflow) == MAILBOX_DROP ||
+	    ATOMIC_READ(p->depth) < capacity;
+}
+
+int
+process_stats(struct process *p, struct value *dict)
+{
+	if (!value_dict_new(dict, 13))
+		return 0;
+	value_dict_store_integer(dict, "capacity", ATOMIC_READ(p->capacity));
+	value_dict_store_integer(dict, "policy", ATOMIC_READ(p->overflow));
+	value_dict_store_integer(dict, "depth", ATOMIC_READ(p->depth));
+	value_dict_store_integer(dict, "peak", ATOMIC_READ(p->max_depth));
+	value_dict_store_integer(dict, "received", ATOMIC_READ(p->received));
+	value_dict_store_integer(dict, "dropped", ATOMIC_READ(p->dropped));
+	value_dict_store_integer(dict, "refused", ATOMIC_READ(p->refused));
+	return 1;
+}
+
+int
+process_has_posted(struct process *p)
+{
+#ifdef THREADS
+	return ATOMIC_READ(p->inbox) != NULL;
+#else
+	p = p;
+	return 0;
+#endif
+}
+
+int
+process_dequeue(struct process *p, struct value *v)
+{
+	RECEIVE_POSTED(p);
+	if (p->tail == NULL)
+		return 0;
+	remove_message(p, p->tail, v);
 	return 1;
 }
 
+int
+process_dequeue_tag(struct process *p, const struct value *tag,
+		    struct value *v)
+{
+	struct tag_index *ti;
+	struct tag_chain *c;
+
+	RECEIVE_POSTED(p);
+	ti = get_index(p);
+	if ((c = find_chain(ti, tag, value_hash(tag))) == NULL)
+		return 0;
+	remove_message(p, c->oldest, v);
+	return 1;
+}
+
+int
+process_dequeue_match(struct process *p, const struct value *tag,
+		      const struct value *first, struct value *v)
+{
+	struct tag_index *ti;
+	struct tag_chain *c;
+	struct message *m;
+
+	RECEIVE_POSTED(p);
+	ti = get_index(p);
+	if ((c = find_chain(ti, tag, value_hash(tag))) == NULL)
+		return 0;
+	for (m = c->oldest; m != NULL; m = m->next_tag) {
+		if (value_tuple_get_size(&m->value) > 0 &&
+		    value_equal(value_tuple_fetch(&m->value, 0), first)) {
+			remove_message(p, m, v);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A process with its own heap allocates into it while it runs.
+ * Processes without one allocate into whatever heap their caller
+ * was using.
+ */
 void
 process_run(struct process *p)
 {
+	struct heap *caller_heap;
+
 	assert(p->run != NULL);
+	if (p->heap == NULL) {
+		LOCK_NATIVE();
+		p->run(p);
+		UNLOCK_NATIVE();
+		return;
+	}
+	caller_heap = value_heap_get_current();
+	value_heap_set_current(p->heap);
 	p->run(p);
+	value_heap_set_current(caller_heap);
 }
 
-void
-process_free(struct process *p)
+/*
+ * Free everything the process holds but the process itself.
+ */
+static void
+release(struct process *p)
 {
 	struct message *m, *n;
 
-	/* assert(p->done); */
+	if (p->registration != NULL)
+		registry_unregister(p);
+	if (p->watchers != NULL || p->watching != NULL) {
+		LOCK_WATCH();
+		while (p->watchers != NULL)
+			drop_watch(p->watchers);
+		while (p->watching != NULL)
+			drop_watch(p->watching);
+		UNLOCK_WATCH();
+	}
 	m = p->head;
 	while (m != NULL) {
 		n = m->next;
-		free(m);
+		message_free(m);
 		m = n;
 	}
+	p->head = p->tail = NULL;
+	ATOMIC_WRITE(p->depth, 0);
+#ifdef THREADS
+	for (m = __sync_lock_test_and_set(&p->inbox, NULL); m != NULL; m = n) {
+		n = m->next;
+		if (m->fragment != NULL)
+			value_heap_free(m->fragment);
+		message_free(m);
+	}
+#endif
+	if (p->tags != NULL)
+		free_index(p->tags);
+	p->tags = NULL;
+	if (p->buffer != NULL)
+		stream_free_buffer(p);
+	if (p->heap != NULL)
+		value_heap_free(p->heap);
+	p->heap = NULL;
+	value_copy(&p->aux_value, &VNULL);
+}
+
+static void
+unlink_live(struct process *p)
+{
+	if (p->prev_live != NULL)
+		p->prev_live->next_live = p->next_live;
+	else
+		live_head = p->next_live;
+	if (p->next_live != NULL)
+		p->next_live->prev_live = p->prev_live;
+}
+
+void
+process_free(struct process *p)
+{
+	/* assert(p->done); */
+	assert(p->sched == SCHED_NONE && !p->timer_set);
+	LOCK_LIVE();
+	unlink_live(p);
+	UNLOCK_LIVE();
+
+	release(p);
 	free(p);
 }
+
+void
+process_retire(struct process *p)
+{
+	assert(p->done);
+	assert(p->sched == SCHED_NONE && !p->timer_set);
+	LOCK_LIVE();
+	unlink_live(p);
+	UNLOCK_LIVE();
+
+	release(p);
+
+	LOCK_LIVE();
+	p->referenced = 0;
+	p->prev_live = NULL;
+	p->next_live = ended_head;
+	ended_head = p;
+	UNLOCK_LIVE();
+}
+
+/*
+ * Free the processes which have ended, except (if keep_referenced is
+ * true) those which the last full collection found a value referring
+ * to.  No other thread may be running processes.
+ */
+static void
+free_ended(int keep_referenced)
+{
+	struct process *p, **pp;
+
+	LOCK_LIVE();
+	pp = &ended_head;
+	while ((p = *pp) != NULL) {
+		if (keep_referenced && p->referenced) {
+			p->referenced = 0;
+			pp = &p->next_live;
+			continue;
+		}
+		*pp = p->next_live;
+		release(p);	/* any messages sent to it since */
+		free(p);
+	}
+	UNLOCK_LIVE();
+}
+
+void
+process_free_ended(void)
+{
+	free_ended(0);
+}
+
+void
+process_walk_values(value_visitor visitor)
+{
+	struct process *p;
+	struct message *m;
+
+	LOCK_LIVE();
+	for (p = live_head; p != NULL; p = p->next_live) {
+		if (p->heap != NULL)
+			RECEIVE_POSTED(p);
+		visitor(&p->aux_value);
+		for (m = p->head; m != NULL; m = m->next)
+			visitor(&m->value);
+	}
+	UNLOCK_LIVE();
+}
+
+void
+process_walk(process_visitor visitor)
+{
+	struct process *p;
+
+	LOCK_LIVE();
+	for (p = live_head; p != NULL; p = p->next_live) {
+		if (p->heap != NULL)
+			RECEIVE_POSTED(p);
+		visitor(p);
+	}
+	UNLOCK_LIVE();
+}
+
+void
+process_walk_watching(struct process *p, watch_visitor visitor)
+{
+	struct watch *w;
+
+	LOCK_WATCH();
+	for (w = p->watching; w != NULL; w = w->next_watching)
+		visitor(w->watched, w->link);
+	UNLOCK_WATCH();
+}
+
+static THREAD_LOCAL struct process *gc_process;
+
+/*
+ * The roots of a single process's heap: the process's own values,
+ * and the messages in the mailboxes of any processes without heaps of
+ * their own which were borrowed from it.  Messages those processes
+ * borrowed from any other heap are none of this collection's
+ * business; nor is their aux_value, which belongs to no heap.
+ */
+static void
+walk_process_values(value_visitor visitor)
+{
+	struct process *p;
+	struct message *m;
+
+	visitor(&gc_process->aux_value);
+	for (m = gc_process->head; m != NULL; m = m->next)
+		visitor(&m->value);
+	LOCK_LIVE();
+	LOCK_NATIVE();
+	for (p = live_head; p != NULL; p = p->next_live) {
+		if (p->heap != NULL)
+			continue;
+		for (m = p->head; m != NULL; m = m->next) {
+			if (m->heap == gc_process->heap)
+				visitor(&m->value);
+		}
+	}
+	UNLOCK_NATIVE();
+	UNLOCK_LIVE();
+}
+
+void
+process_gc(struct process *p)
+{
+	if (p->heap == NULL || !value_heap_gc_wanted(p->heap))
+		return;
+	gc_process = p;
+	value_heap_collect(p->heap, walk_process_values);
+	gc_process = NULL;
+}
+
+/*
+ * Note that a value refers to the process.  Called while marking,
+ * perhaps by several threads at once.
+ */
+static void
+mark_process(struct process *p)
+{
+	if (!ATOMIC_READ(p->referenced))
+		ATOMIC_WRITE(p->referenced, 1);
+}
+
+void
+process_gc_all(void)
+{
+	value_gc_set_process_marker(mark_process);
+	value_gc_collect(process_walk_values);
+	free_ended(1);
+}
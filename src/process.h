@@ -9,57 +9,261 @@
 #include "value.h"
 
 struct process;
+struct tag_index;
+struct tag_chain;
+struct registration;
+struct watch;
+struct write_buffer;
 
 typedef void (*runfunc)(struct process *);
+typedef void (*writefunc)(struct process *, const void *, unsigned int);
+typedef void (*flushfunc)(struct process *);
+typedef unsigned int (*readfunc)(struct process *, void *, unsigned int);
+typedef void (*process_visitor)(struct process *);
+typedef void (*watch_visitor)(struct process *, int);
 
 struct process {
-	int		 waiting;
+	unsigned int	 number;	/* in order of creation, from 1 */
+	int		 waiting;	/* blocked until a message arrives */
 	int		 done;
+	int		 sched;		/* SCHED_ state; see sched.h */
+	int		 priority;	/* PRIORITY_ class; see sched.h */
+	unsigned int	 slice;		/* VM instructions per run */
+	unsigned int	 slice_used;	/* of those, in the last run */
+	unsigned long	 latency;	/* target, in microseconds, or 0 */
+	unsigned long	 ready_since;	/* in microseconds */
+	unsigned long	 due;		/* ready_since + latency */
+	int		 timer_set;	/* waiting no later than deadline */
+	int		 timed_out;	/* deadline passed with no message */
+	int		 sleeping;	/* waiting for the deadline alone */
+	unsigned long	 deadline;	/* in milliseconds */
+	unsigned int	 capacity;	/* of mailbox, or 0 for no limit */
+	int		 overflow;	/* MAILBOX_ policy, when it is full */
+	unsigned int	 depth;		/* messages in mailbox and inbox */
+	unsigned int	 max_depth;	/* the most there have been */
+	unsigned long	 received;	/* messages, in all */
+	unsigned long	 dropped;	/* oldest, to make room */
+	unsigned long	 refused;	/* for want of room */
 	runfunc		 run;
+	writefunc	 write;		/* for stream_write(), or NULL */
+	flushfunc	 flush;		/* for stream_flush(), or NULL */
+	struct write_buffer *buffer;	/* stream_write()'s, or NULL */
+	readfunc	 read;		/* for stream_read(), or NULL */
 	void		*aux;
 	struct value	 aux_value;
-	struct message	*head;
-	struct message	*tail;
-	struct process	*next;
+	struct heap	*heap;		/* own heap, or NULL to borrow */
+	struct message	*head;		/* newest message */
+	struct message	*tail;		/* oldest message */
+	struct tag_index *tags;		/* for selective receive, or NULL */
+	struct registration *registration; /* its name, or NULL */
+	struct watch	*watchers;	/* of this process's end */
+	struct watch	*watching;	/* other processes' ends */
+	int		 supervised;	/* restarted if it fails */
+	int		 entry;		/* pc to restart at */
+	unsigned int	 restarts;	/* how many more times */
+#ifdef THREADS
+	struct message	*inbox;		/* posted, newest first; lock-free */
+#endif
+	struct process	*send_to;	/* full process this waits to send to */
+	struct process	*senders;	/* processes waiting to send to this */
+	struct process	*next_sender;
+	struct process	*next;		/* scheduler's queue */
+	struct process	*prev;
+	struct process	*next_timer;	/* scheduler's timing wheel */
+	struct process	*prev_timer;
+	struct process	**timer_slot;	/* holding this, while timer_set */
+	int		 referenced;	/* by a value, once it has ended */
+	struct process	*prev_live;	/* list of all live processes */
+	struct process	*next_live;
 };
 
 struct message {
-	struct message	*next;
-	struct message	*prev;
+	struct message	*next;		/* older */
+	struct message	*prev;		/* newer */
+	struct tag_chain *chain;	/* messages with the same tag, if any */
+	struct message	*next_tag;	/* newer, in that chain */
+	struct message	*prev_tag;	/* older, in that chain */
+#ifdef THREADS
+	struct heap	*fragment;	/* holding value, until received */
+#endif
+	struct heap	*heap;		/* value is borrowed from, or NULL */
 	struct value	 value;
 };
 
+/*
+ * Mailbox capacity.  A process may limit how many messages its
+ * mailbox holds (counting those posted but not yet received), and
+ * choose what happens to a message sent to it when it is full:
+ */
+#define MAILBOX_BLOCK	0	/* the sender waits until there is room */
+#define MAILBOX_DROP	1	/* the oldest message is dropped for it */
+#define MAILBOX_FAIL	2	/* it is refused, and the sender told so */
+
 /* Prototypes */
 
 struct process	*process_new(void);
 
 /*
- * places the value in the process's mailbox.  This is what the VM instruction SEND
- *  does.  SEND also checks if the destination process is currently waiting, (and if
- *  its mailbox is empty?), and if it is, it wakes it up so that it can deal immediately
- *  with the message.  Maybe.  I mean, this behaviour sounds good, but maybe we shouldn't
- *  guarantee it.
+ * places the value in the process's mailbox.  If the process has a
+ * heap of its own, a copy of the value is made in that heap.  This is
+ * what the VM instruction SEND does.  If the destination process is
+ * waiting, it is woken, and the scheduler will run it again (though
+ * not necessarily immediately.)
+ *
+ * In builds with THREADS, the destination may be running in another
+ * thread, so the copy is made in a fragment (see value.h) and posted,
+ * without locking, to the process's inbox; the process moves it into
+ * its mailbox (and its heap) the next time it looks there.
  *
- * We should also prevent side-effecting of that value.  Maybe values can be "owned"...
+ * We should also prevent side-effecting of that value.  Maybe values
+ * can be "owned"...
+ *
+ * Returns false, without sending the value, if the process's mailbox
+ * is full and its policy is MAILBOX_BLOCK (in which case the sender
+ * may wait and try again, if it can; see sched_put()) or MAILBOX_FAIL
+ * (in which case the message is counted as refused.)
  */
-void		 process_enqueue(struct process *, const struct value *);
+int		 process_enqueue(struct process *, const struct value *);
 
 /*
- * retrieves a value from the process's mailbox.  p should be self.  This is what
- * the RECV VM instruction does.  If there is no message, the process should set its
- * waiting flag to true, and yield.
+ * retrieves a value from the process's mailbox.  p should be self.
+ * This is what the RECV VM instruction does.  If there is no message,
+ * it returns false, and the process should set its waiting flag to
+ * true, and yield; it will not be run again until a message arrives
+ * (or its timer, if it set one, expires.)
  */
 int		 process_dequeue(struct process *, struct value *);
 
 /*
- * Let the process p execute for a bit.  Concurrency is cooperative here, so p promises
- * that it will return from this function "in a little while".  For the VM, this is not
- * hard; we return after executing 100 or so instructions.  For native code, it should
- * be carefully written!
+ * Selective receive.  Like process_dequeue, but retrieves the oldest
+ * message which is a tuple with the given tag (and, for _match, whose
+ * first element is equal to the given value), leaving any others in
+ * the mailbox.  This is what RECV_TAG and RECV_MATCH do.
+ *
+ * Messages are indexed by tag (once the process first receives
+ * selectively), so that messages with other tags are never looked
+ * at.  Only symbol and integer tags are indexed; messages with any
+ * other kind of tag can only be received by process_dequeue.
+ */
+int		 process_dequeue_tag(struct process *, const struct value *,
+		    struct value *);
+int		 process_dequeue_match(struct process *, const struct value *,
+		    const struct value *, struct value *);
+
+/*
+ * Let the process p execute for a bit.  Concurrency is cooperative
+ * here, so p promises that it will return from this function "in a
+ * little while".  For the VM, this is not hard; we return after
+ * executing p->slice instructions, and set p->slice_used to the number
+ * actually executed.  For native code, it should be carefully written!
  */
 void		 process_run(struct process *);
 
 void		 process_free(struct process *);
 
+/*
+ * Free everything a process which has ended holds, but keep the
+ * process itself (as ended) for as long as any value may still refer
+ * to it, so that a process (perhaps in another thread) which sends to
+ * it or watches it finds only that it has ended.  A message sent to a
+ * process which has ended is dropped.  The process is freed by the
+ * first process_gc_all() which finds no live value referring to it,
+ * or by process_free_ended().
+ */
+void		 process_retire(struct process *);
+
+/*
+ * Free every process which has ended, whether or not any value still
+ * refers to it; only once no process will run again.
+ */
+void		 process_free_ended(void);
+
+/*
+ * Free the message nodes kept for reuse by the calling thread.  A
+ * thread which has been sending or receiving messages should call
+ * this before it exits.
+ */
+void		 process_free_spares(void);
+
+/*
+ * Watching for the ends of processes.  When a process ends (by
+ * process_exit()), each process monitoring it gets a message
+ * <down: p, reason>, and each process linked to it gets a message
+ * <exit: p, reason>.  These are delivered whether or not there is
+ * room in the mailbox.  Monitoring is one way; a link is both ways.
+ * A process which has already ended, but not yet been freed, is
+ * reported at once, with the reason noproc.
+ */
+void		 process_monitor(struct process *, struct process *);
+void		 process_link(struct process *, struct process *);
+
+/*
+ * End the process, for the given reason (a value in its own heap, or
+ * NULL for the symbol normal), and tell whoever is watching it.
+ */
+void		 process_exit(struct process *, const struct value *);
+
+/*
+ * Limit the process's mailbox to the given number of messages (or
+ * none, if 0), with the given MAILBOX_ policy for when it is full.
+ * Only the process itself may do this.
+ */
+void		 process_set_mailbox(struct process *, unsigned int, int);
+
+/*
+ * Returns true if a message sent to the process now would be
+ * accepted.  May be called from any thread.
+ */
+int		 process_has_room(struct process *);
+
+/*
+ * Set the given value to a new dictionary, mapping symbols to
+ * integers, which describes the process's mailbox: its capacity and
+ * policy, how many messages it holds now, and has held at most, and
+ * how many have been received, dropped and refused.  Returns false if
+ * memory could not be allocated.
+ */
+int		 process_stats(struct process *, struct value *);
+
+/*
+ * Returns true if messages have been posted to the process's inbox
+ * which it has not yet received.  Always false without THREADS.
+ */
+int		 process_has_posted(struct process *);
+
+/*
+ * Apply the visitor to every value held by every live process: its
+ * aux_value and each message in its mailbox.  These are the roots for
+ * garbage collection, which may relocate the values in place.  Any
+ * posted messages are received first, so no other thread may be
+ * running processes at the time.
+ */
+void		 process_walk_values(value_visitor);
+
+/*
+ * Apply the visitor to every live process, as for process_walk_values()
+ * (so, likewise, no other thread may be running processes.)
+ */
+void		 process_walk(process_visitor);
+
+/*
+ * Apply the visitor to every process which the given one watches,
+ * with true if the two are linked, or false if it only monitors it.
+ */
+void		 process_walk_watching(struct process *, watch_visitor);
+
+/*
+ * If the process has a heap of its own, and enough has been allocated
+ * in it, collect it.  Only safe between runs of processes.
+ */
+void		 process_gc(struct process *);
+
+/*
+ * Collect every heap, given the roots of every process, and free the
+ * processes which have ended and which no live value refers to.  No
+ * other thread may be running processes.
+ */
+void		 process_gc_all(void);
+
 #endif /* !__PROCESS_H_ */
 
@@ -0,0 +1,222 @@
+/*
+ * registry.c
+ * Names by which processes may be found.
+ *
+ * Names are kept in an open-addressed hash table of registrations,
+ * each holding a copy of its name and the process which has it (if
+ * any.)  A registration, once made, is never freed or moved; when
+ * its process gives up the name, the process is cleared, and the
+ * registration is used again if the name is taken again.  So a
+ * reader (registry_whereis()) can look names up without locking:
+ * whatever it finds stays valid.  Writers (which are few) take
+ * registry_lock.  When the table grows, the old one is kept, since
+ * a reader may still be looking in it.
+ */
+
+#include "lib.h"
+
+#ifdef THREADS
+#include <pthread.h>
+#endif
+
+#include "process.h"
+#include "value.h"
+
+#include "registry.h"
+
+struct registration {
+	char		*token;
+	unsigned int	 length;
+	unsigned int	 hash;
+	struct process	*process;	/* which has this name, or NULL */
+};
+
+struct table {
+	unsigned int	 mask;		/* number of slots, less one */
+	unsigned int	 used;		/* slots with registrations */
+	struct table	*older;		/* replaced by this one */
+	struct registration *slots[1];	/* more follow */
+};
+
+#define TABLE_MIN	16
+
+static struct table *table = NULL;	/* may be read unlocked */
+
+#ifdef THREADS
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define	LOCK()		pthread_mutex_lock(&registry_lock)
+#define	UNLOCK()	pthread_mutex_unlock(&registry_lock)
+#else
+#define	LOCK()		do { } while (0)
+#define	UNLOCK()	do { } while (0)
+#endif
+
+static int
+same_name(const struct registration *r, unsigned int hash,
+	  const char *token, unsigned int length)
+{
+	unsigned int i;
+
+	if (r->hash != hash || r->length != length)
+		return 0;
+	for (i = 0; i < length; i++) {
+		if (r->token[i] != token[i])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * The registration for the given name in the table, or NULL.
+ */
+static struct registration *
+find(const struct table *t, unsigned int hash,
+     const char *token, unsigned int length)
+{
+	struct registration *r;
+	unsigned int i;
+
+	if (t == NULL)
+		return NULL;
+	for (i = hash & t->mask; (r = ATOMIC_READ(t->slots[i])) != NULL;
+	     i = (i + 1) & t->mask) {
+		if (same_name(r, hash, token, length))
+			return r;
+	}
+	return NULL;
+}
+
+/*
+ * Put the registration in the first free slot for it.  Whatever it
+ * holds must be filled in first, so that readers see all of it.
+ */
+static void
+insert(struct table *t, struct registration *r)
+{
+	unsigned int i;
+
+	for (i = r->hash & t->mask; t->slots[i] != NULL; i = (i + 1) & t->mask)
+		;
+	ATOMIC_WRITE(t->slots[i], r);
+	t->used++;
+}
+
+/*
+ * Make room for one more registration, keeping the table at most
+ * half full.  With registry_lock held.
+ */
+static void
+grow(void)
+{
+	struct table *t;
+	unsigned int size, i;
+
+	if (table != NULL && (table->used + 1) * 2 <= table->mask + 1)
+		return;
+	size = table == NULL ? TABLE_MIN : (table->mask + 1) * 2;
+	t = malloc(sizeof(struct table) +
+	    (size - 1) * sizeof(struct registration *));
+	assert(t != NULL);
+	t->mask = size - 1;
+	t->used = 0;
+	t->older = table;
+	for (i = 0; i < size; i++)
+		t->slots[i] = NULL;
+	if (table != NULL) {
+		for (i = 0; i <= table->mask; i++) {
+			if (table->slots[i] != NULL)
+				insert(t, table->slots[i]);
+		}
+	}
+	ATOMIC_WRITE(table, t);
+}
+
+static struct registration *
+registration_new(unsigned int hash, const char *token, unsigned int length)
+{
+	struct registration *r;
+
+	r = malloc(sizeof(struct registration));
+	assert(r != NULL);
+	r->token = malloc(length + 1);
+	assert(r->token != NULL);
+	memcpy(r->token, token, length);
+	r->token[length] = '\0';
+	r->length = length;
+	r->hash = hash;
+	r->process = NULL;
+	return r;
+}
+
+int
+registry_register(struct process *p, const struct value *name)
+{
+	const char *token = value_symbol_get_token(name);
+	unsigned int length = value_symbol_get_length(name);
+	unsigned int hash = value_hash(name);
+	struct registration *r;
+	int ok = 0;
+
+	LOCK();
+	r = find(table, hash, token, length);
+	if (!ATOMIC_READ(p->done) && p->registration == NULL &&
+	    (r == NULL || r->process == NULL)) {
+		if (r == NULL) {
+			r = registration_new(hash, token, length);
+			grow();
+			insert(table, r);
+		}
+		ATOMIC_WRITE(r->process, p);
+		p->registration = r;
+		ok = 1;
+	}
+	UNLOCK();
+	return ok;
+}
+
+void
+registry_unregister(struct process *p)
+{
+	LOCK();
+	if (p->registration != NULL) {
+		ATOMIC_WRITE(p->registration->process, NULL);
+		p->registration = NULL;
+	}
+	UNLOCK();
+}
+
+void
+registry_replace(struct process *old, struct process *new)
+{
+	LOCK();
+	assert(new->registration == NULL);
+	if (old->registration != NULL) {
+		new->registration = old->registration;
+		old->registration = NULL;
+		ATOMIC_WRITE(new->registration->process, new);
+	}
+	UNLOCK();
+}
+
+struct process *
+registry_whereis(const struct value *name)
+{
+	struct registration *r;
+
+	r = find(ATOMIC_READ(table), value_hash(name),
+	    value_symbol_get_token(name), value_symbol_get_length(name));
+	if (r == NULL)
+		return NULL;
+	return ATOMIC_READ(r->process);
+}
+
+int
+registry_name(struct process *p, struct value *name)
+{
+	struct registration *r = p->registration;
+
+	if (r == NULL)
+		return 0;
+	return value_symbol_new(name, r->token, r->length);
+}
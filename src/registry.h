@@ -0,0 +1,49 @@
+/*
+ * registry.h
+ * Names by which processes may be found.
+ */
+
+#ifndef __REGISTRY_H_
+#define __REGISTRY_H_
+
+struct process;
+struct value;
+
+/*
+ * Each name (a symbol) belongs to at most one process at a time, and
+ * each process has at most one name.  A process's name is given up
+ * when the process ends.
+ */
+
+/*
+ * Give the process the name.  Returns false if the name belongs to
+ * another process, or the process already has one or has ended.
+ */
+int		 registry_register(struct process *, const struct value *);
+
+/*
+ * Give up the process's name, if it has one.
+ */
+void		 registry_unregister(struct process *);
+
+/*
+ * Give the first process's name, if it has one, to the second, which
+ * must have none, in its place.
+ */
+void		 registry_replace(struct process *, struct process *);
+
+/*
+ * Returns the process with the given name, or NULL if there is none.
+ * This takes no locks, so it may be called from any thread, as often
+ * as it likes.
+ */
+struct process	*registry_whereis(const struct value *);
+
+/*
+ * Set the value to the process's name, and return true, if it has
+ * one.  Only the process itself (or whoever holds it, while it is not
+ * running) may do this.
+ */
+int		 registry_name(struct process *, struct value *);
+
+#endif /* !__REGISTRY_H_ */
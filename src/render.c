@@ -58,6 +58,40 @@ render_int(char *buf, unsigned int bufsize, int val)
 
 #define MAX_DIGITS	32
 
+/*
+ * Rendered text is gathered into a buffer, and written to the stream
+ * only when it fills up, or rendering is done; so a stream which is
+ * not a file gets one message per call, not one per character.
+ */
+#define RENDER_BUFFER	256
+
+struct output {
+	struct process	*p;
+	unsigned int	 length;
+	char		 buffer[RENDER_BUFFER];
+};
+
+static void
+flush_output(struct output *o)
+{
+	if (o->length > 0)
+		stream_write(NULL, o->p, o->buffer, o->length);
+	o->length = 0;
+}
+
+static void
+output(struct output *o, const char *data, unsigned int size)
+{
+	if (o->length + size > RENDER_BUFFER)
+		flush_output(o);
+	if (size > RENDER_BUFFER) {
+		stream_write(NULL, o->p, data, size);
+		return;
+	}
+	memcpy(o->buffer + o->length, data, size);
+	o->length += size;
+}
+
 /*
  * Similar to, but different from, C's printf().
  * The size specifier of each field gives the maximum number
@@ -69,14 +103,17 @@ void
 process_render(struct process *p, const char *fmt, ...)
 {
 	unsigned int pos = 0, length;
+	struct output o;
 	va_list args;
 
 	assert(p != NULL);
+	o.p = p;
+	o.length = 0;
 	va_start(args, fmt);
 
 	while (fmt[pos] != '\0') {
 		if (fmt[pos] != '%') {
-			stream_write(NULL, p, &fmt[pos], 1);
+			output(&o, &fmt[pos], 1);
 			pos++;
 			continue;
 		}
@@ -88,32 +125,30 @@ process_render(struct process *p, const char *fmt, ...)
 		/* find formatting code and select formatting */
 		switch (fmt[pos]) {
 			case '%':
-				stream_write(NULL, p, &fmt[pos], 1);
+				output(&o, &fmt[pos], 1);
 				break;
 			case 'c':
 			    {
 				char c = (char)va_arg(args, int);
 
-				stream_write(NULL, p, &c, 1);
+				output(&o, &c, 1);
 				break;
 			    }
 			case 's':
 			    {
 				char *arg = va_arg(args, char *);
 
-				stream_write(NULL, p, arg, strlen(arg));
+				output(&o, arg, strlen(arg));
 				break;
 			    }
 			case 'd': case 'x': /* XXX for now! */
 			    {
 				int val = va_arg(args, int);
 				unsigned int digit_pos;
-				char *digits;
+				char digits[MAX_DIGITS];
 
-				digits = malloc(MAX_DIGITS);
 				digit_pos = render_int(digits, MAX_DIGITS, val);
-				stream_write(NULL, p, (digits + digit_pos), (MAX_DIGITS - digit_pos));
-				free(digits);
+				output(&o, (digits + digit_pos), (MAX_DIGITS - digit_pos));
 
 				break;
 			    }
@@ -124,4 +159,7 @@ process_render(struct process *p, const char *fmt, ...)
 
 		pos++;
 	}
+
+	va_end(args);
+	flush_output(&o);
 }
@@ -9,14 +9,84 @@
 #include "cmdline.h"
 
 #include "process.h"
+#include "sched.h"
 #include "vmproc.h"
 #include "load.h"
+#include "snapshot.h"
+#include "vm.h"
 
 #include "value.h"
+#include "portray.h"
+#include "render.h"
+#include "save.h"
+
+/*
+ * Write a profile of the live values in all heaps to the given stream.
+ * Collect first, so that it shows only what is truly retained.
+ */
+static void
+write_heap_profile(struct process *out)
+{
+	struct value dump;
 
+	process_gc_all();
+	value_profile_dump(&dump);
+	value_save(out, &dump);
+	stream_close(NULL, out);
+}
+
+/*
+ * Run every process, one at a time, until none can run again.
+ */
+static void
+run_serially(void)
+{
+	struct process *curr;	/* current process in our schedule */
+
+	while ((curr = sched_next()) != NULL) {
 #ifdef DEBUG
-#include "render.h"
+		process_render(process_err, "Running process %d\n", curr);
 #endif
+		process_run(curr);
+
+		/*
+		 * Between processes is a safe point: every live value is
+		 * reachable from some process, so we can collect here.
+		 * The process just descheduled has its own heap collected
+		 * if need be; the shared heap, only rarely.
+		 */
+		if (!curr->done)
+			process_gc(curr);
+		if (value_gc_wanted())
+			process_gc_all();
+
+		sched_put(curr);
+	}
+}
+
+/*
+ * If the named option is given, as <min>,<max>, set the shortest and
+ * longest time slices of the given priority class from it.
+ */
+static void
+slices_option(struct value *args, const char *name, int priority)
+{
+	struct value sym, *opt;
+	const char *s;
+	unsigned int len, i;
+
+	value_symbol_new(&sym, name, strlen(name));
+	opt = value_dict_fetch(args, &sym);
+	if (value_is_null(opt))
+		return;
+	s = value_symbol_get_token(opt);
+	len = value_symbol_get_length(opt);
+	for (i = 0; i < len && s[i] != ','; i++)
+		;
+	assert(i < len);
+	sched_set_slices(priority, (unsigned int)k_atoi(s, i),
+	    (unsigned int)k_atoi(s + i + 1, len - i - 1));
+}
 
 static void
 run_main(struct value *args, struct value *result)
@@ -25,41 +95,113 @@ run_main(struct value *args, struct value *result)
         struct value vmfile_sym;
 
         struct value code;      /* code for the virtual machine */
-	struct process *in;	/* file process we will load it from */
-	struct process *first;	/* main process the VM will run in */
-	struct process *curr;	/* current process in our schedule */
-	struct process *next;
-	struct value *vmfile;
+	struct value *vmfile, *gc_compact, *gc_threads, *gc_stats, *heap_profile;
+	struct value *workers, *sched_stats_opt, *restore;
+        struct value gc_compact_sym, gc_threads_sym, gc_stats_sym;
+        struct value heap_profile_sym, workers_sym, sched_stats_sym;
+        struct value restore_sym;
+	struct value stats;
+	struct process *profile_out = NULL;
+	int want_stats = 0, want_sched_stats = 0;
+	unsigned int num_workers = 0;
   
         value_symbol_new(&vmfile_sym, "vmfile", 6);
+        value_symbol_new(&gc_compact_sym, "gc-compact", 10);
+        value_symbol_new(&gc_threads_sym, "gc-threads", 10);
+        value_symbol_new(&gc_stats_sym, "gc-stats", 8);
+        value_symbol_new(&heap_profile_sym, "heap-profile", 12);
+        value_symbol_new(&workers_sym, "workers", 7);
+        value_symbol_new(&sched_stats_sym, "sched-stats", 11);
+        value_symbol_new(&restore_sym, "restore", 7);
 	vmfile = value_dict_fetch(args, &vmfile_sym);
+	gc_compact = value_dict_fetch(args, &gc_compact_sym);
+	gc_threads = value_dict_fetch(args, &gc_threads_sym);
+	gc_stats = value_dict_fetch(args, &gc_stats_sym);
+	heap_profile = value_dict_fetch(args, &heap_profile_sym);
+	workers = value_dict_fetch(args, &workers_sym);
+	sched_stats_opt = value_dict_fetch(args, &sched_stats_sym);
+	restore = value_dict_fetch(args, &restore_sym);
 
-	in = file_open(value_symbol_get_token(vmfile), "r");
-	value_load(&code, in);
-	stream_close(NULL, in);
+	if (!value_is_null(gc_compact)) {
+		value_gc_set_compact_threshold((unsigned int)k_atoi(
+		    value_symbol_get_token(gc_compact),
+		    value_symbol_get_length(gc_compact)));
+	}
+	if (!value_is_null(gc_threads)) {
+		value_gc_set_threads((unsigned int)k_atoi(
+		    value_symbol_get_token(gc_threads),
+		    value_symbol_get_length(gc_threads)));
+	}
 
-        value_vm_new(&vm, &code);
-	curr = first = vmproc_new(&vm);
-	while (first != NULL) {
-#ifdef DEBUG
-		process_render(process_err, "Running process %d\n", curr);
-#endif
-		process_run(curr);
-		next = curr->next;
-		while (next != NULL && next->done) {
-			curr->next = next->next;
-			process_free(next);
-			next = curr->next;
-		}
-		curr = next;
-		if (curr == NULL) {
-			while (first != NULL && first->done) {
-				next = first->next;
-				process_free(first);
-				first = next;
-			}
-			curr = first;
+	/*
+	 * The arguments are not roots of any collection, so take what
+	 * we need from them before the first one.
+	 */
+	if (!value_is_null(gc_stats))
+		want_stats = k_atoi(value_symbol_get_token(gc_stats),
+		    value_symbol_get_length(gc_stats));
+	slices_option(args, "slice-high", PRIORITY_HIGH);
+	slices_option(args, "slice-normal", PRIORITY_NORMAL);
+	slices_option(args, "slice-low", PRIORITY_LOW);
+	if (!value_is_null(restore)) {
+		/*
+		 * Carry on from a snapshot (see the SNAPSHOT instruction)
+		 * instead of starting afresh.
+		 */
+		if (!snapshot_restore(value_symbol_get_token(restore))) {
+			process_render(process_err,
+			    "Could not restore '%s'\n",
+			    value_symbol_get_token(restore));
+			value_integer_set(result, 1);
+			return;
 		}
+	} else if (!value_load_file(&code, value_symbol_get_token(vmfile)) ||
+	    !vm_freeze_literals(&code)) {
+		process_render(process_err, "Could not load '%s'\n",
+		    value_symbol_get_token(vmfile));
+		value_integer_set(result, 1);
+		return;
+	}
+	if (!value_is_null(heap_profile))
+		profile_out = file_open(value_symbol_get_token(heap_profile),
+		    "w");
+	if (!value_is_null(workers))
+		num_workers = (unsigned int)k_atoi(
+		    value_symbol_get_token(workers),
+		    value_symbol_get_length(workers));
+	if (!value_is_null(sched_stats_opt))
+		want_sched_stats = k_atoi(value_symbol_get_token(sched_stats_opt),
+		    value_symbol_get_length(sched_stats_opt));
+	if (value_is_null(restore)) {
+		value_vm_new(&vm, &code);
+		sched_add(vmproc_new(&vm));
+	}
+
+	if (num_workers > 0)
+		sched_run_workers(num_workers);
+	else
+		run_serially();
+
+	/*
+	 * Once nothing will run again, and before the remaining processes
+	 * are freed, is the time to look for values left over.  Any
+	 * process which has ended has been freed already, along with its
+	 * heap, so this shows only what the processes left blocked (and
+	 * the shared heap) retain.
+	 */
+	if (profile_out != NULL)
+		write_heap_profile(profile_out);
+	sched_reap();
+
+	if (want_stats) {
+		value_gc_stats(&stats);
+		value_portray(process_err, &stats);
+		process_render(process_err, "\n");
+	}
+	if (want_sched_stats) {
+		sched_stats(&stats);
+		value_portray(process_err, &stats);
+		process_render(process_err, "\n");
 	}
   
         value_integer_set(result, 0);
@@ -7,6 +7,7 @@
 #include "stream.h"
 
 #include "save.h"
+#include "image.h"
 #include "value.h"
 
 #ifdef DEBUG
@@ -15,74 +16,556 @@
 #include "render.h"
 #endif
 
-int
-value_save(struct process *p, struct value *value)
+/*
+ * Values are encoded into a small buffer, which is written out
+ * whenever it fills, and at the end.
+ */
+#define	SAVE_BUFFER	256
+
+struct saver {
+	struct process	*p;
+	unsigned long	 offset;	/* bytes put so far */
+	unsigned int	 length;
+	unsigned char	 buffer[SAVE_BUFFER];
+	struct seen	*seen;		/* table of seen_size entries */
+	unsigned int	 seen_size;
+	unsigned int	 seen_count;
+	struct string	*strings;	/* table of strings_size entries */
+	unsigned int	 strings_size;
+	unsigned int	 strings_count;	/* symbols put in full so far */
+	unsigned long	*symbols;	/* offset of each, for the trailer */
+	unsigned int	 symbols_size;
+	struct indexed	*indexed;	/* tuples which may have indexes */
+	unsigned int	 indexed_size;
+	unsigned int	 indexed_count;
+	const struct namer *namer;	/* if saving state, else NULL */
+	int		 shared;	/* within a value marked shared */
+	int		 ok;		/* false if memory ran short */
+};
+
+/*
+ * Tuples large enough to be given an index, in the order in which
+ * they began, with the offsets of their indexes (0 if they were not
+ * given one after all.)
+ */
+struct indexed {
+	unsigned long	 start;
+	unsigned long	 index;
+};
+
+/*
+ * Structured values already saved, by identity, with the offsets at
+ * which they were saved, so that later occurrences can refer back to
+ * them.  This keeps shared structure shared, and lets cyclic values
+ * be saved at all.
+ */
+struct seen {
+	PTR_INT		 id;		/* 0 if empty */
+	unsigned long	 offset;
+};
+
+#define	SEEN_INITIAL	256
+
+static unsigned int
+seen_slot(const struct seen *table, unsigned int size, PTR_INT id)
+{
+	unsigned int i;
+
+	i = (unsigned int)((id >> 3) * 2654435761UL) & (size - 1);
+	while (table[i].id != 0 && table[i].id != id)
+		i = (i + 1) & (size - 1);
+	return i;
+}
+
+/*
+ * If the value has been saved before, set the offset at which it was
+ * saved, and return true.
+ */
+static int
+seen_find(const struct saver *s, struct value *value, unsigned long *offset)
+{
+	PTR_INT id = value_get_unique_id(value);
+	unsigned int i;
+
+	i = seen_slot(s->seen, s->seen_size, id);
+	if (s->seen[i].id != id)
+		return 0;
+	*offset = s->seen[i].offset;
+	return 1;
+}
+
+/*
+ * Note that the value is being saved at the current offset.  (If the
+ * table cannot grow, it is not noted, and is simply saved again.)
+ */
+static void
+seen_note(struct saver *s, struct value *value)
+{
+	struct seen *table;
+	PTR_INT id = value_get_unique_id(value);
+	unsigned int i, size;
+
+	if (2 * (s->seen_count + 1) > s->seen_size) {
+		size = 2 * s->seen_size;
+		if ((table = malloc(size * sizeof(struct seen))) == NULL)
+			return;
+		memset(table, 0, size * sizeof(struct seen));
+		for (i = 0; i < s->seen_size; i++) {
+			if (s->seen[i].id != 0)
+				table[seen_slot(table, size, s->seen[i].id)] =
+				    s->seen[i];
+		}
+		free(s->seen);
+		s->seen = table;
+		s->seen_size = size;
+	}
+	i = seen_slot(s->seen, s->seen_size, id);
+	s->seen[i].id = id;
+	s->seen[i].offset = s->offset;
+	s->seen_count++;
+}
+
+/*
+ * Symbols already saved, by content, with the index each was given.
+ * Every symbol put in full is given the next index, and one equal to
+ * it may later be put as just that index.  The tokens are those of
+ * the values being saved, which stay put until saving is done.
+ */
+struct string {
+	const char	*token;		/* NULL if empty */
+	unsigned int	 length;
+	unsigned int	 hash;
+	unsigned long	 index;
+};
+
+#define	STRINGS_INITIAL	256
+
+static unsigned int
+string_slot(const struct string *table, unsigned int size,
+	    const char *token, unsigned int length, unsigned int hash)
+{
+	unsigned int i;
+
+	i = (hash * 2654435761UL) & (size - 1);
+	while (table[i].token != NULL &&
+	    (table[i].hash != hash || table[i].length != length ||
+	     strncmp(table[i].token, token, length) != 0))
+		i = (i + 1) & (size - 1);
+	return i;
+}
+
+/*
+ * If a symbol equal to the given one has been saved before, set the
+ * index it was given, and return true.
+ */
+static int
+string_find(const struct saver *s, struct value *value, unsigned long *index)
+{
+	unsigned int i;
+
+	i = string_slot(s->strings, s->strings_size,
+	    value_symbol_get_token(value), value_symbol_get_length(value),
+	    value_hash(value));
+	if (s->strings[i].token == NULL)
+		return 0;
+	*index = s->strings[i].index;
+	return 1;
+}
+
+/*
+ * Note that the symbol is being put in full, at the current offset,
+ * and so given the next index.  (If the table cannot grow, the symbol
+ * is not noted, but the index is used up all the same.)
+ */
+static void
+string_note(struct saver *s, struct value *value)
+{
+	struct string *table;
+	const char *token = value_symbol_get_token(value);
+	unsigned int length = value_symbol_get_length(value);
+	unsigned int hash = value_hash(value);
+	unsigned long *symbols;
+	unsigned int i, size;
+
+	if (s->strings_count == s->symbols_size) {
+		size = 2 * s->symbols_size;
+		symbols = realloc(s->symbols, size * sizeof(unsigned long));
+		if (symbols == NULL) {
+			s->ok = 0;
+			return;
+		}
+		s->symbols = symbols;
+		s->symbols_size = size;
+	}
+	s->symbols[s->strings_count] = s->offset;
+
+	if (2 * (s->strings_count + 1) > s->strings_size) {
+		size = 2 * s->strings_size;
+		if ((table = malloc(size * sizeof(struct string))) == NULL) {
+			s->strings_count++;
+			return;
+		}
+		memset(table, 0, size * sizeof(struct string));
+		for (i = 0; i < s->strings_size; i++) {
+			if (s->strings[i].token != NULL)
+				table[string_slot(table, size,
+				    s->strings[i].token, s->strings[i].length,
+				    s->strings[i].hash)] = s->strings[i];
+		}
+		free(s->strings);
+		s->strings = table;
+		s->strings_size = size;
+	}
+	i = string_slot(s->strings, s->strings_size, token, length, hash);
+	s->strings[i].token = token;
+	s->strings[i].length = length;
+	s->strings[i].hash = hash;
+	s->strings[i].index = s->strings_count++;
+}
+
+static void
+flush_saver(struct saver *s)
+{
+	if (s->length > 0) {
+		stream_write(NULL, s->p, s->buffer, s->length);
+		s->length = 0;
+	}
+}
+
+static void
+put(struct saver *s, const void *data, unsigned int size)
+{
+	if (s->length + size > SAVE_BUFFER) {
+		flush_saver(s);
+		if (size > SAVE_BUFFER) {
+			stream_write(NULL, s->p, data, size);
+			s->offset += size;
+			return;
+		}
+	}
+	memcpy(s->buffer + s->length, data, size);
+	s->length += size;
+	s->offset += size;
+}
+
+static void
+put_byte(struct saver *s, unsigned char c)
 {
-	unsigned char squeeze = (unsigned char)value->type;
+	if (s->length == SAVE_BUFFER)
+		flush_saver(s);
+	s->buffer[s->length++] = c;
+	s->offset++;
+}
+
+static void
+put_varint(struct saver *s, unsigned long u)
+{
+	while (u >= 0x80) {
+		put_byte(s, (unsigned char)(u & 0x7f) | 0x80);
+		u >>= 7;
+	}
+	put_byte(s, (unsigned char)u);
+}
+
+static void
+put_integer(struct saver *s, long n)
+{
+	if (n < 0)
+		put_varint(s, ((~(unsigned long)n) << 1) | 1);
+	else
+		put_varint(s, (unsigned long)n << 1);
+}
+
+static void save(struct saver *, struct value *);
+
+/*
+ * Reserve a place, in the order in which tuples begin, for one which
+ * may be given an index.  Returns the place, or -1 if there is none.
+ */
+static int
+note_indexed(struct saver *s, unsigned long start)
+{
+	struct indexed *indexed;
+	unsigned int size;
+
+	if (s->indexed_count == s->indexed_size) {
+		size = s->indexed_size == 0 ? 16 : 2 * s->indexed_size;
+		indexed = realloc(s->indexed, size * sizeof(struct indexed));
+		if (indexed == NULL)
+			return -1;
+		s->indexed = indexed;
+		s->indexed_size = size;
+	}
+	s->indexed[s->indexed_count].start = start;
+	s->indexed[s->indexed_count].index = 0;
+	return (int)s->indexed_count++;
+}
+
+/*
+ * Put the values of a tuple which began at the given offset, and if
+ * there are enough of them, its index.  Only once they are all put is
+ * it known whether they are large enough to be worth indexing, and
+ * how wide the entries must be.  The state of a running program is
+ * never indexed, since it is never loaded bit by bit.
+ */
+static void
+save_values(struct saver *s, struct value *value, unsigned long start,
+	    unsigned int length)
+{
+	unsigned long *at = NULL, first, back;
+	unsigned int i, j, width = 0;
+	int n = -1;
+
+	if (length >= IMAGE_INDEX_MIN && s->namer == NULL &&
+	    (at = malloc(length * sizeof(unsigned long))) != NULL &&
+	    (n = note_indexed(s, start)) < 0) {
+		free(at);
+		at = NULL;
+	}
+
+	first = s->offset;
+	for (i = 0; i < length; i++) {
+		if (at != NULL)
+			at[i] = s->offset;
+		save(s, value_tuple_fetch(value, i));
+	}
+	if (length < IMAGE_INDEX_MIN)
+		return;
+
+	if (at != NULL) {
+		back = s->offset - first;
+		for (width = 1; width < sizeof(unsigned long) &&
+		    (back >> (8 * width)) != 0; width++)
+			;
+		if (back < (unsigned long)IMAGE_INDEX_COST * width * length)
+			width = 0;
+	}
+	put_byte(s, (unsigned char)width);
+	if (width > 0) {
+		s->indexed[n].index = s->offset - 1;
+		for (i = 0; i < length; i++) {
+			back = s->indexed[n].index - at[i];
+			for (j = 0; j < width; j++) {
+				put_byte(s, (unsigned char)(back & 0xff));
+				back >>= 8;
+			}
+		}
+	}
+	free(at);
+}
+
+static void
+save(struct saver *s, struct value *value)
+{
+	struct value *tag, name;
+	unsigned int length;
+	unsigned long start = s->offset, offset, index;
 
 #ifdef DEBUG
-	process_render(process_err, "(save:%s ", type_name_table[(int)squeeze]);
-        if (value->type == VALUE_SYMBOL) {
-            process_render(process_err, "[%d] ", value_symbol_get_length(value));
-        }
+	process_render(process_err, "(save:%s ", type_name_table[value->type]);
+	if (value->type == VALUE_SYMBOL) {
+		process_render(process_err, "[%d] ", value_symbol_get_length(value));
+	}
 	value_portray(process_err, value);
 	process_render(process_err, ")\n");
 #endif
 
-	stream_write(NULL, p, &squeeze, sizeof(squeeze));
-
-	if ((value->type & VALUE_STRUCTURED) == 0) {
-		stream_write(NULL, p, &value->value, sizeof(value->value));
-	} else {
-		unsigned int length, i;
-
-		switch (value->type) {
-		case VALUE_SYMBOL:
-		    {
-			const char *token = value_symbol_get_token(value);
-			length = value_symbol_get_length(value);
-			stream_write(NULL, p, &length, sizeof(length));
-			stream_write(NULL, p, token, sizeof(char) * length);
-			break;
-		    }
-		case VALUE_TUPLE:
-		    {
-                        struct value *tag = value_tuple_get_tag(value);
-			value_save(p, tag);
-                        /* XXX should eventually dispatch to a handler based on tag. */
-                        if (value_equal(tag, &tag_dict)) {
-                          	struct value dict_iter;
-                                struct value *key;
-
-                                value_dict_new_iter(&dict_iter, value);
-
-                                length = value_dict_get_layer_size(value);
-                                stream_write(NULL, p, &length, sizeof(length));
-                                length = value_dict_get_length(value);
-                                stream_write(NULL, p, &length, sizeof(length));
-                          
-                                key = value_dict_iter_get_current_key(&dict_iter);
-                                while (!value_is_null(key)) {
-                                        value_save(p, key);
-                                        value_save(p, value_dict_fetch(value, key)); /* XXX not so good; use iter */
-                                        value_dict_iter_advance(&dict_iter);
-                                        key = value_dict_iter_get_current_key(&dict_iter);
-                                }
-                        } else {
-                                length = value_tuple_get_size(value);
-                                stream_write(NULL, p, &length, sizeof(length));
-                                for (i = 0; i < length; i++) {
-                                        value_save(p, value_tuple_fetch(value, i));
-                                }
-                        }
-			break;
-		    }
-		default:
-			assert(value->type == VALUE_SYMBOL ||
-			       value->type == VALUE_TUPLE);
-			break;
+	/*
+	 * A symbol equal to one saved before is put as its index in
+	 * the table of strings, not as a reference to the very same
+	 * value; so every occurrence of it, wherever it came from, is
+	 * shared.
+	 */
+	if (value->type == VALUE_SYMBOL && string_find(s, value, &index)) {
+		put_byte(s, IMAGE_STRING);
+		put_varint(s, index);
+		return;
+	}
+
+	/*
+	 * Refer back to a value saved before.
+	 */
+	if (value->type & VALUE_STRUCTURED) {
+		if (value->type != VALUE_SYMBOL &&
+		    seen_find(s, value, &offset)) {
+			put_byte(s, IMAGE_REF);
+			put_varint(s, offset);
+			return;
+		} else if (s->namer != NULL && !s->shared &&
+		    value_is_shared(value)) {
+			/*
+			 * Everything within a shared value is shared,
+			 * too, so only the outermost need be marked.
+			 */
+			put_byte(s, value_is_frozen(value) ?
+			    IMAGE_FROZEN : IMAGE_SHARED);
+			s->shared = 1;
+			save(s, value);
+			s->shared = 0;
+			return;
+		} else if (value->type != VALUE_SYMBOL) {
+			seen_note(s, value);
 		}
 	}
 
-	return 1;
+	switch (value->type) {
+	case VALUE_NULL:
+		put_byte(s, IMAGE_NULL);
+		break;
+	case VALUE_INTEGER:
+		put_byte(s, IMAGE_INTEGER);
+		put_integer(s, value_get_integer(value));
+		break;
+	case VALUE_BOOLEAN:
+		put_byte(s, IMAGE_BOOLEAN);
+		put_byte(s, value_get_boolean(value) ? 1 : 0);
+		break;
+	case VALUE_PROCESS:
+		put_byte(s, IMAGE_PROCESS);
+		if (s->namer != NULL && s->namer->process != NULL)
+			s->namer->process(value_get_process(value), &name);
+		else
+			value_copy(&name, &VNULL);
+		save(s, &name);
+		break;
+	case VALUE_LABEL:
+		put_byte(s, IMAGE_LABEL);
+		if (s->namer != NULL && s->namer->label != NULL)
+			s->namer->label(value_get_label(value), &name);
+		else
+			value_copy(&name, &VNULL);
+		save(s, &name);
+		break;
+	case VALUE_SYMBOL:
+		length = value_symbol_get_length(value);
+		string_note(s, value);
+		put_byte(s, IMAGE_SYMBOL);
+		put_varint(s, length);
+		put(s, value_symbol_get_token(value), length);
+		break;
+	case VALUE_TUPLE:
+		tag = value_tuple_get_tag(value);
+		/* XXX should eventually dispatch to a handler based on tag. */
+		if (value_equal(tag, &tag_dict)) {
+			struct value dict_iter;
+			struct value *key;
+
+			put_byte(s, IMAGE_DICT);
+			put_varint(s, value_dict_get_layer_size(value));
+			put_varint(s, value_dict_get_length(value));
+
+			value_dict_new_iter(&dict_iter, value);
+			key = value_dict_iter_get_current_key(&dict_iter);
+			while (!value_is_null(key)) {
+				save(s, key);
+				save(s, value_dict_fetch(value, key)); /* XXX not so good; use iter */
+				value_dict_iter_advance(&dict_iter);
+				key = value_dict_iter_get_current_key(&dict_iter);
+			}
+		} else {
+			put_byte(s, IMAGE_TUPLE);
+			save(s, tag);
+			length = value_tuple_get_size(value);
+			put_varint(s, length);
+			save_values(s, value, start, length);
+		}
+		break;
+	default:
+		assert(value->type == VALUE_SYMBOL ||
+		       value->type == VALUE_TUPLE);
+		break;
+	}
+}
+
+/*
+ * Put the trailer: where to find each symbol, and each index.
+ */
+static void
+put_trailer(struct saver *s)
+{
+	unsigned long trailer = s->offset, last;
+	unsigned int i, count;
+
+	put_varint(s, s->strings_count);
+	for (i = 0, last = 0; i < s->strings_count; i++) {
+		put_varint(s, s->symbols[i] - last);
+		last = s->symbols[i];
+	}
+
+	for (i = 0, count = 0; i < s->indexed_count; i++) {
+		if (s->indexed[i].index != 0)
+			count++;
+	}
+	put_varint(s, count);
+	for (i = 0, last = 0; i < s->indexed_count; i++) {
+		if (s->indexed[i].index == 0)
+			continue;
+		put_varint(s, s->indexed[i].start - last);
+		put_varint(s, s->indexed[i].index - s->indexed[i].start);
+		last = s->indexed[i].start;
+	}
+
+	for (i = 0; i < IMAGE_TRAILER_SIZE; i++) {
+		put_byte(s, (unsigned char)(trailer & 0xff));
+		trailer >>= 8;
+	}
+}
+
+static int
+save_image(struct process *p, struct value *value, const struct namer *namer)
+{
+	struct saver s;
+
+	s.p = p;
+	s.offset = 0;
+	s.length = 0;
+	s.seen_size = SEEN_INITIAL;
+	s.seen_count = 0;
+	if ((s.seen = malloc(s.seen_size * sizeof(struct seen))) == NULL)
+		return 0;
+	memset(s.seen, 0, s.seen_size * sizeof(struct seen));
+	s.strings_size = STRINGS_INITIAL;
+	s.strings_count = 0;
+	if ((s.strings = malloc(s.strings_size * sizeof(struct string))) == NULL) {
+		free(s.seen);
+		return 0;
+	}
+	memset(s.strings, 0, s.strings_size * sizeof(struct string));
+	s.symbols_size = STRINGS_INITIAL;
+	if ((s.symbols = malloc(s.symbols_size * sizeof(unsigned long))) == NULL) {
+		free(s.seen);
+		free(s.strings);
+		return 0;
+	}
+	s.indexed = NULL;
+	s.indexed_size = 0;
+	s.indexed_count = 0;
+	s.namer = namer;
+	s.shared = 0;
+	s.ok = 1;
+
+	put(&s, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+	put_byte(&s, IMAGE_VERSION);
+	save(&s, value);
+	put_trailer(&s);
+	flush_saver(&s);
+	free(s.seen);
+	free(s.strings);
+	free(s.symbols);
+	free(s.indexed);
+
+	return s.ok;
+}
+
+int
+value_save(struct process *p, struct value *value)
+{
+	return save_image(p, value, NULL);
+}
+
+int
+value_save_state(struct process *p, struct value *value,
+		 const struct namer *namer)
+{
+	return save_image(p, value, namer);
 }
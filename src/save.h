@@ -6,9 +6,32 @@
 #ifndef __SAVE_H_
 #define __SAVE_H_
 
+#include "value.h"
+
 struct process;
-struct value;
 
+/*
+ * Write the value to the stream as an image (see image.h.)
+ */
 int		 value_save(struct process *, struct value *);
 
+/*
+ * How to name the processes and labels in the state of a running
+ * program: each function sets the given value to the name of the
+ * given process or label.  Either may be NULL, to name them all null.
+ */
+struct namer {
+	void	(*process)(struct process *, struct value *);
+	void	(*label)(clabel, struct value *);
+};
+
+/*
+ * Like value_save(), but name processes and labels with the namer,
+ * and mark the values which are in the shared heap, or frozen, so
+ * that value_load_state() can put them back there.  The names are
+ * made in the current heap.
+ */
+int		 value_save_state(struct process *, struct value *,
+		    const struct namer *);
+
 #endif /* !__SAVE_H_ */
@@ -26,6 +26,7 @@ enum token_type {
 struct scanner {
         struct reporter *reporter;
 	struct process	*input;		/* file process from which we are scanning */
+	struct reader	*reader;	/* reading ahead from input */
 	const char	*filename;	/* name of file scanning from */
 	char		*token;		/* text content of token we just scanned */
 	enum token_type	 token_type;	/* type of token that was scanned */
@@ -55,6 +56,7 @@ scanner_new(struct reporter *r)
         sc->reporter = r;
 	sc->filename = NULL;
 	sc->input = NULL;
+	sc->reader = NULL;
 	sc->putback_buf = malloc(PUTBACK_SIZE * sizeof(char));
 	sc->putback_pos = 0;
 
@@ -90,6 +92,11 @@ scanner_open(struct scanner *sc, const char *filename)
 		    "Can't open '%s' for reading", filename);
 		return 0;
 	}
+	if ((sc->reader = reader_new(sc->input)) == NULL) {
+		stream_close(NULL, sc->input);
+		sc->input = NULL;
+		return 0;
+	}
 	scanner_reset(sc);
 	return 1;
 }
@@ -102,6 +109,10 @@ scanner_attach(struct scanner *sc, struct process *p, const char *filename)
 {
 	sc->filename = filename;
 	sc->input = p;
+	if ((sc->reader = reader_new(sc->input)) == NULL) {
+		sc->input = NULL;
+		return 0;
+	}
 	scanner_reset(sc);
 	return 1;
 }
@@ -112,6 +123,10 @@ scanner_close(struct scanner *sc)
 	if (sc->filename != NULL) {
 		sc->filename = NULL;
 	}
+	if (sc->reader != NULL) {
+		reader_free(sc->reader);
+		sc->reader = NULL;
+	}
 	if (sc->input != NULL) {
 		stream_close(NULL, sc->input);
 		sc->input = NULL; /* ? */
@@ -130,7 +145,7 @@ scan_char(struct scanner *sc, char *x)
 	if (sc->putback_pos > 0) {
 		*x = sc->putback_buf[sc->putback_pos--];
 	} else {
-		stream_read(NULL, sc->input, x, sizeof(char));
+		reader_read(sc->reader, x, sizeof(char));
 	}
 
 	if (*x == '\n') {
@@ -148,7 +163,7 @@ scan_char(struct scanner *sc, char *x)
 static void
 putback(struct scanner *sc, char x)
 {
-	if (stream_is_at_end(NULL, sc->input))
+	if (reader_at_end(sc->reader))
 		return;
 
 	/* do a 'ungetc' */
@@ -172,7 +187,7 @@ real_scan(struct scanner *sc)
 
 	sc->token[0] = '\0';
 	sc->token_length = 0;
-	if (stream_is_at_end(NULL, sc->input)) {
+	if (reader_at_end(sc->reader)) {
 		sc->token_type = TOKEN_EOF;
 		return;
 	}
@@ -182,7 +197,7 @@ real_scan(struct scanner *sc)
 	/* Skip whitespace. */
 
 top:
-	while (k_isspace(x) && !stream_is_at_end(NULL, sc->input)) {
+	while (k_isspace(x) && !reader_at_end(sc->reader)) {
 		scan_char(sc, &x);
 	}
 
@@ -191,7 +206,7 @@ top:
 	if (x == '/') {
 		scan_char(sc, &x);
 		if (x == '/') {
-			while (x != '\n' && !stream_is_at_end(NULL, sc->input)) {
+			while (x != '\n' && !reader_at_end(sc->reader)) {
 				scan_char(sc, &x);
 			}
 			goto top;
@@ -202,7 +217,7 @@ top:
 		}
 	}
 
-	if (stream_is_at_end(NULL, sc->input)) {
+	if (reader_at_end(sc->reader)) {
 		sc->token[0] = '\0';
 		sc->token_type = TOKEN_EOF;
 		return;
@@ -213,7 +228,7 @@ top:
 	 * digit (not a sign or decimal point.)
 	 */
 	if (k_isdigit(x)) {
-		while ((k_isdigit(x) || x == '.') && !stream_is_at_end(NULL, sc->input)) {
+		while ((k_isdigit(x) || x == '.') && !reader_at_end(sc->reader)) {
 			sc->token[i++] = x;
 			sc->token_length++;
 			scan_char(sc, &x);
@@ -229,7 +244,7 @@ top:
 	 */
 	if (x == '"') {
 		scan_char(sc, &x);
-		while (x != '"' && !stream_is_at_end(NULL, sc->input) && i < 255) {
+		while (x != '"' && !reader_at_end(sc->reader) && i < 255) {
 			sc->token[i++] = x;
 			sc->token_length++;
 			scan_char(sc, &x);
@@ -243,7 +258,7 @@ top:
 	 * Scan alphanumeric ("bareword") tokens.
 	 */
 	if (k_isalpha(x) || x == '_') {
-		while ((k_isalpha(x) || k_isdigit(x) || x == '_') && !stream_is_at_end(NULL, sc->input)) {
+		while ((k_isalpha(x) || k_isdigit(x) || x == '_') && !reader_at_end(sc->reader)) {
 			sc->token[i++] = x;
 			sc->token_length++;
 			scan_char(sc, &x);
@@ -261,7 +276,7 @@ top:
 		sc->token[i++] = x;
 		sc->token_length++;
 		scan_char(sc, &x);
-		if (x == '=' && !stream_is_at_end(NULL, sc->input)) {
+		if (x == '=' && !reader_at_end(sc->reader)) {
 			sc->token[i++] = x;
 			sc->token_length++;
 			scan_char(sc, &x);
@@ -307,7 +322,7 @@ scanner_scanline(struct scanner *sc)
 	char x;
 
 	scan_char(sc, &x);
-	while (x != '\n' && !stream_is_at_end(NULL, sc->input)) {
+	while (x != '\n' && !reader_at_end(sc->reader)) {
 		scan_char(sc, &x);
 	}
 	real_scan(sc);
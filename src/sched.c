@@ -0,0 +1,1249 @@
+/*
+ * sched.c
+ * Scheduling of processes.
+ *
+ * Ready processes are kept in first-in, first-out queues, and
+ * blocked ones in a set of their own, all doubly-linked through
+ * the processes themselves, so that every operation here takes
+ * constant time.  Blocked processes are never looked at until a
+ * message wakes them, so idle processes cost nothing.
+ *
+ * A blocked process may also have a timer, which wakes it if no
+ * message has arrived by its deadline (or, if it is sleeping, only
+ * then.)  Timers are kept in a hierarchical timing wheel, so that
+ * setting, cancelling and firing one takes constant time, however
+ * many are set.  When nothing is ready, the scheduler sleeps until
+ * the wheel next needs attention.
+ *
+ * Ready processes wait in one queue for each priority class, and
+ * the highest class goes first; but a process which has waited too
+ * long goes ahead of any which has waited less, whatever its class,
+ * so that no class is starved.  Processes which have declared a
+ * latency target wait in a binary heap of their own, ordered by
+ * deadline (the time they became ready, plus the target), ahead of
+ * all; adding one to it, or taking the earliest, takes time
+ * logarithmic in how many are waiting there.
+ *
+ * Each process runs for a time slice, measured in VM instructions,
+ * which adapts to how it behaves: a process which uses all of its
+ * slice gets a longer one next time, up to the maximum for its
+ * priority class, so that busy processes are not switched needlessly
+ * often; but the more processes are waiting in the same ready queue,
+ * the lower that maximum, so that each of them gets its turn sooner.
+ *
+ * In builds with THREADS, processes may instead be run by a pool of
+ * worker threads (see sched_run_workers() below.)
+ */
+
+/*
+ * On POSIX systems, use the monotonic clock, and really sleep.
+ */
+#if defined(__unix__) && !defined(STANDALONE) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "lib.h"
+
+#ifndef STANDALONE
+#include <time.h>
+#endif
+
+#ifdef THREADS
+#include <pthread.h>
+#endif
+
+#include "process.h"
+#include "value.h"
+
+#include "sched.h"
+
+struct queue {
+	struct process	*head;
+	struct process	*tail;
+};
+
+/*
+ * A ready queue: a heap of processes with latency targets, earliest
+ * deadline at the top, followed by one queue for each priority class
+ * (so q[DEADLINE_QUEUE] is unused.)
+ */
+#define DEADLINE_QUEUE	0
+#define NUM_QUEUES	(1 + PRIORITY_CLASSES)
+
+struct runq {
+	struct process	**due;		/* heap, by due then ready_since */
+	unsigned int	 due_count;
+	unsigned int	 due_size;
+	struct queue	 q[NUM_QUEUES];
+	unsigned int	 length;	/* in all; may be read unlocked */
+};
+
+/*
+ * A process which has been ready for this many microseconds goes
+ * ahead of any which has been ready for less.
+ */
+#define STARVE_US	20000
+
+static struct runq ready;
+static struct queue blocked = { NULL, NULL };
+
+/*
+ * The timing wheel is WHEEL_LEVELS wheels of WHEEL_SLOTS slots, each
+ * slot a list of processes.  A slot of the first wheel holds the
+ * timers which expire in one millisecond; a slot of each later wheel
+ * spans a whole turn of the wheel before it.  A timer goes into the
+ * first wheel in which its deadline is less than a turn away, and
+ * when the time covered by a slot of a later wheel is reached, its
+ * timers are moved into earlier wheels.  Deadlines further away than
+ * the last wheel reaches wait in its furthest slot, and are placed
+ * again when that is reached.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+#define WHEEL_REACH	((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - \
+			 (1UL << (WHEEL_BITS * (WHEEL_LEVELS - 1))))
+
+static struct process *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static unsigned long wheel_now = 0;	/* timers up to here have fired */
+static unsigned int num_timers = 0;	/* may be read unlocked */
+
+/*
+ * Time slices, in VM instructions, for each priority class.
+ */
+struct slices {
+	unsigned int	 min;
+	unsigned int	 max;
+};
+
+static struct slices slices[PRIORITY_CLASSES] = {
+	{ 50, 200 },		/* PRIORITY_HIGH */
+	{ 100, 2000 },		/* PRIORITY_NORMAL */
+	{ 1000, 20000 }		/* PRIORITY_LOW */
+};
+
+/*
+ * With more than this many processes in a ready queue, the maximum
+ * slice is reduced in proportion.
+ */
+#define SLICE_CROWD	4
+
+/*
+ * What the scheduler has done.  A switch is one run of a process; a
+ * preemption is a switch at which the process used all of its slice.
+ * The times processes spent ready before they ran are counted for
+ * each ready queue, in buckets of under 10us, 100us, and so on up to
+ * 1s, and more.
+ */
+#define WAIT_BUCKETS	7
+
+struct counts {
+	unsigned long	 switches;
+	unsigned long	 preemptions;
+	unsigned long	 instructions;
+	unsigned long	 waits[NUM_QUEUES][WAIT_BUCKETS];
+	unsigned long	 missed;	/* deadlines */
+};
+
+static struct counts counts;
+static int started = 0;
+static unsigned long start_ms;
+
+#ifdef THREADS
+/*
+ * Each worker thread has ready queues of its own, to which it
+ * returns the processes it has run and adds those it spawns or
+ * wakes, so that a process tends to stay with one thread (and its
+ * heap in one processor's cache.)  Whatever is ready when the
+ * workers start goes to the first.  A worker with nothing in its
+ * queues steals from the back of some other worker's, lowest class
+ * first.  Only the owner and thieves touch a worker's queues, each
+ * only briefly, so its lock is seldom contended.
+ *
+ * sched_lock guards everything else: the blocked set, the timing wheel,
+ * and the state of the workers as a whole.
+ * Idle workers wait on sched_cond.  It is never held while a process
+ * runs, and it is taken before any worker's lock, never after.
+ */
+struct worker {
+	pthread_t	 thread;
+	unsigned int	 id;
+	pthread_mutex_t	 lock;		/* guards rq */
+	struct runq	 rq;
+	struct counts	 counts;	/* owner's only */
+};
+
+static struct worker *workers = NULL;
+static unsigned int num_workers = 0;
+static THREAD_LOCAL struct worker *current_worker = NULL;
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond;
+static unsigned int idle_workers = 0;	/* waiting for something to run */
+static unsigned int parked_workers = 0;	/* stopped for a collection */
+static int stopping = 0;		/* a full collection is under way */
+static int finished = 0;		/* nothing can ever run again */
+
+#define	LOCK()		pthread_mutex_lock(&sched_lock)
+#define	UNLOCK()	pthread_mutex_unlock(&sched_lock)
+#else
+#define	LOCK()		do { } while (0)
+#define	UNLOCK()	do { } while (0)
+#endif
+
+/*
+ * Without a POSIX clock, time is measured by clock() (which counts
+ * only while we are busy) plus the time we would have slept (which
+ * we skip over instead.)  Standalone, only the latter is available.
+ */
+#ifndef _POSIX_C_SOURCE
+static unsigned long skipped = 0;
+#endif
+
+/*
+ * Milliseconds since some fixed point in the past.
+ */
+static unsigned long
+clock_ms(void)
+{
+#ifdef _POSIX_C_SOURCE
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 +
+	    (unsigned long)ts.tv_nsec / 1000000;
+#elif !defined(STANDALONE)
+	return (unsigned long)((double)clock() * 1000.0 / CLOCKS_PER_SEC) +
+	    skipped;
+#else
+	return skipped;
+#endif
+}
+
+/*
+ * Microseconds since some fixed point in the past, for measuring
+ * short waits.
+ */
+static unsigned long
+clock_us(void)
+{
+#ifdef _POSIX_C_SOURCE
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 +
+	    (unsigned long)ts.tv_nsec / 1000;
+#elif !defined(STANDALONE)
+	return (unsigned long)((double)clock() * 1000000.0 / CLOCKS_PER_SEC) +
+	    skipped * 1000;
+#else
+	return skipped * 1000;
+#endif
+}
+
+/*
+ * Wait until the given time.
+ */
+static void
+idle_until(unsigned long deadline)
+{
+	unsigned long now = clock_ms();
+#ifdef _POSIX_C_SOURCE
+	struct timespec ts;
+
+	if ((long)(deadline - now) <= 0)
+		return;
+	ts.tv_sec = (time_t)((deadline - now) / 1000);
+	ts.tv_nsec = (long)((deadline - now) % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+#else
+	if ((long)(deadline - now) > 0)
+		skipped += deadline - now;
+#endif
+}
+
+static void
+queue_append(struct queue *q, struct process *p)
+{
+	p->next = NULL;
+	p->prev = q->tail;
+	if (q->tail != NULL)
+		q->tail->next = p;
+	else
+		q->head = p;
+	q->tail = p;
+}
+
+static void
+queue_remove(struct queue *q, struct process *p)
+{
+	if (p->prev != NULL)
+		p->prev->next = p->next;
+	else
+		q->head = p->next;
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	else
+		q->tail = p->prev;
+	p->next = NULL;
+	p->prev = NULL;
+}
+
+/*
+ * True if process p should run before q, by deadline; or, if their
+ * deadlines are the same, by how long they have been ready.
+ */
+static int
+due_before(const struct process *p, const struct process *q)
+{
+	if (p->due != q->due)
+		return (long)(p->due - q->due) < 0;
+	return (long)(p->ready_since - q->ready_since) < 0;
+}
+
+/*
+ * Add the process to the deadline heap.
+ */
+static void
+due_push(struct runq *rq, struct process *p)
+{
+	unsigned int i, parent;
+
+	if (rq->due_count == rq->due_size) {
+		rq->due_size = rq->due_size == 0 ? 16 : rq->due_size * 2;
+		rq->due = realloc(rq->due,
+		    rq->due_size * sizeof(struct process *));
+		assert(rq->due != NULL);
+	}
+	for (i = rq->due_count++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!due_before(p, rq->due[parent]))
+			break;
+		rq->due[i] = rq->due[parent];
+	}
+	rq->due[i] = p;
+}
+
+/*
+ * Take the process with the earliest deadline from the heap; or (if
+ * thief is true) the last in it, which is a leaf, and so one which
+ * can wait at least as long as the process above it.
+ */
+static struct process *
+due_take(struct runq *rq, int thief)
+{
+	struct process *p, *last;
+	unsigned int i, child;
+
+	last = rq->due[--rq->due_count];
+	if (thief || rq->due_count == 0)
+		return last;
+	p = rq->due[0];
+	for (i = 0; (child = 2 * i + 1) < rq->due_count; i = child) {
+		if (child + 1 < rq->due_count &&
+		    due_before(rq->due[child + 1], rq->due[child]))
+			child++;
+		if (!due_before(rq->due[child], last))
+			break;
+		rq->due[i] = rq->due[child];
+	}
+	rq->due[i] = last;
+	return p;
+}
+
+/*
+ * The counts of the calling thread.
+ */
+static struct counts *
+here(void)
+{
+#ifdef THREADS
+	if (current_worker != NULL)
+		return &current_worker->counts;
+#endif
+	return &counts;
+}
+
+/*
+ * Add the process to the ready queue.  Returns its new length.
+ */
+static unsigned int
+runq_push(struct runq *rq, struct process *p)
+{
+	p->ready_since = clock_us();
+	if (p->latency > 0) {
+		p->due = p->ready_since + p->latency;
+		due_push(rq, p);
+	} else {
+		queue_append(&rq->q[1 + p->priority], p);
+	}
+	ATOMIC_WRITE(rq->length, rq->length + 1);
+	return rq->length;
+}
+
+/*
+ * Take the next process to run from the ready queue, or (if thief is
+ * true) the one which can best wait, from the back of the lowest
+ * class.  Returns NULL if it is empty.
+ */
+static struct process *
+runq_take(struct runq *rq, int thief)
+{
+	struct counts *c = here();
+	struct process *p;
+	unsigned long now, wait, bound;
+	unsigned int i, j;
+
+	if (rq->length == 0)
+		return NULL;
+	now = clock_us();
+	if (thief) {
+		for (i = NUM_QUEUES - 1; i > DEADLINE_QUEUE &&
+		    rq->q[i].tail == NULL; i--)
+			;
+	} else {
+		for (i = DEADLINE_QUEUE + 1; i < NUM_QUEUES &&
+		    rq->q[i].head == NULL; i++)
+			;
+		if (rq->due_count > 0)
+			i = DEADLINE_QUEUE;
+		for (j = i + 1; j < NUM_QUEUES; j++) {
+			p = rq->q[j].head;
+			if (p != NULL && now - p->ready_since >= STARVE_US &&
+			    (long)(p->ready_since - (i == DEADLINE_QUEUE ?
+			    rq->due[0] : rq->q[i].head)->ready_since) < 0)
+				i = j;
+		}
+	}
+	if (i == DEADLINE_QUEUE) {
+		p = due_take(rq, thief);
+	} else {
+		p = thief ? rq->q[i].tail : rq->q[i].head;
+		queue_remove(&rq->q[i], p);
+	}
+	ATOMIC_WRITE(rq->length, rq->length - 1);
+
+	wait = now - p->ready_since;
+	for (j = 0, bound = 10; j < WAIT_BUCKETS - 1 && wait >= bound; j++)
+		bound *= 10;
+	c->waits[i][j]++;
+	if (i == DEADLINE_QUEUE && (long)(now - p->due) > 0)
+		c->missed++;
+	return p;
+}
+
+#ifdef THREADS
+/*
+ * Add the process to the worker's ready queue.  Returns its length.
+ */
+static unsigned int
+worker_push(struct worker *w, struct process *p)
+{
+	unsigned int length;
+
+	pthread_mutex_lock(&w->lock);
+	length = runq_push(&w->rq, p);
+	pthread_mutex_unlock(&w->lock);
+	return length;
+}
+
+/*
+ * Take a process from the worker's ready queue (as a thief, if thief
+ * is true), or NULL if it is empty.
+ */
+static struct process *
+worker_take(struct worker *w, int thief)
+{
+	struct process *p;
+
+	if (ATOMIC_READ(w->rq.length) == 0)
+		return NULL;
+	pthread_mutex_lock(&w->lock);
+	p = runq_take(&w->rq, thief);
+	pthread_mutex_unlock(&w->lock);
+	return p;
+}
+
+static int
+any_ready(void)
+{
+	unsigned int i, n = ATOMIC_READ(num_workers);
+
+	for (i = 0; i < n; i++) {
+		if (ATOMIC_READ(workers[i].rq.length) > 0)
+			return 1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Put the process at the end of a ready queue: this worker's own, on
+ * a worker thread, or else the shared one.  With sched_lock held.
+ */
+static void
+make_ready(struct process *p)
+{
+	ATOMIC_WRITE(p->sched, SCHED_READY);
+#ifdef THREADS
+	if (current_worker != NULL) {
+		worker_push(current_worker, p);
+		if (ATOMIC_READ(idle_workers) > 0)
+			pthread_cond_signal(&sched_cond);
+		return;
+	}
+#endif
+	runq_push(&ready, p);
+}
+
+/*
+ * With sched_lock held.  A process which is not blocked is left
+ * alone: it may be running, in another thread.  So is one which is
+ * sleeping, until its timer expires, and one which is waiting to send,
+ * until there is room (see wake_senders().)
+ */
+static void
+wake(struct process *p)
+{
+	if (ATOMIC_READ(p->sched) != SCHED_BLOCKED ||
+	    (p->sleeping && !p->timed_out) || p->send_to != NULL)
+		return;
+	p->waiting = 0;
+	queue_remove(&blocked, p);
+	make_ready(p);
+}
+
+/*
+ * Wake every process waiting to send to the given one.  They try
+ * again, and any for which there is still no room wait again.  With
+ * sched_lock held.
+ */
+static void
+wake_senders(struct process *p)
+{
+	struct process *s;
+
+	while ((s = p->senders) != NULL) {
+		ATOMIC_WRITE(p->senders, s->next_sender);
+		s->next_sender = NULL;
+		s->send_to = NULL;
+		wake(s);
+	}
+}
+
+/*
+ * Put the process into the slot of the timing wheel for its deadline.
+ * With sched_lock held.
+ */
+static void
+wheel_insert(struct process *p)
+{
+	unsigned long d = p->deadline;
+	struct process **slot;
+	int shift, level;
+
+	if ((long)(d - wheel_now) <= 0)
+		d = wheel_now + 1;
+	else if (d - wheel_now >= WHEEL_REACH)
+		d = wheel_now + WHEEL_REACH - 1;
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		shift = WHEEL_BITS * level;
+		if ((d >> shift) - (wheel_now >> shift) < WHEEL_SLOTS)
+			break;
+	}
+	shift = WHEEL_BITS * level;
+	slot = &wheel[level][(d >> shift) & (WHEEL_SLOTS - 1)];
+
+	p->timer_slot = slot;
+	p->prev_timer = NULL;
+	p->next_timer = *slot;
+	if (*slot != NULL)
+		(*slot)->prev_timer = p;
+	*slot = p;
+}
+
+static void
+wheel_remove(struct process *p)
+{
+	if (p->prev_timer != NULL)
+		p->prev_timer->next_timer = p->next_timer;
+	else
+		*p->timer_slot = p->next_timer;
+	if (p->next_timer != NULL)
+		p->next_timer->prev_timer = p->prev_timer;
+	p->next_timer = NULL;
+	p->prev_timer = NULL;
+	p->timer_slot = NULL;
+}
+
+/*
+ * The time at which the timing wheel next needs attention: when the
+ * timers in the earliest occupied slot of the first wheel expire, or
+ * the time covered by that of a later wheel is reached, whichever is
+ * sooner.  Only the slots after the current one of each wheel can be
+ * occupied.  With sched_lock held, and some timer set.
+ */
+static unsigned long
+wheel_next(void)
+{
+	unsigned long base, t, next = 0;
+	int shift, level, i, found = 0;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_BITS * level;
+		base = wheel_now >> shift;
+		for (i = 1; i < WHEEL_SLOTS; i++) {
+			if (wheel[level][(base + i) & (WHEEL_SLOTS - 1)] != NULL)
+				break;
+		}
+		if (i == WHEEL_SLOTS)
+			continue;
+		t = (base + i) << shift;
+		if (!found || (long)(t - next) < 0)
+			next = t;
+		found = 1;
+	}
+	assert(found);
+	return next;
+}
+
+static void
+set_timer(struct process *p, unsigned long ms)
+{
+	unsigned long now = clock_ms();
+
+	assert(!p->timer_set);
+	if (num_timers == 0)
+		ATOMIC_WRITE(wheel_now, now);
+	p->timer_set = 1;
+	p->timed_out = 0;
+	p->deadline = now + ms;
+	wheel_insert(p);
+	ATOMIC_WRITE(num_timers, num_timers + 1);
+}
+
+static void
+cancel_timer(struct process *p)
+{
+	p->timed_out = 0;
+	if (!p->timer_set)
+		return;
+	p->timer_set = 0;
+	wheel_remove(p);
+	ATOMIC_WRITE(num_timers, num_timers - 1);
+}
+
+/*
+ * Wake every process whose timer has expired by the given time,
+ * moving timers into earlier wheels as their slots are reached.
+ * With sched_lock held.
+ */
+static void
+fire_timers(unsigned long now)
+{
+	struct process *p, **slot;
+	unsigned long t;
+	int shift, level;
+
+	while (num_timers > 0 && (long)((t = wheel_next()) - now) <= 0) {
+		ATOMIC_WRITE(wheel_now, t);
+		for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+			shift = WHEEL_BITS * level;
+			if ((t & ((1UL << shift) - 1)) != 0)
+				continue;
+			slot = &wheel[level][(t >> shift) & (WHEEL_SLOTS - 1)];
+			while ((p = *slot) != NULL) {
+				wheel_remove(p);
+				wheel_insert(p);
+			}
+		}
+		slot = &wheel[0][t & (WHEEL_SLOTS - 1)];
+		while ((p = *slot) != NULL) {
+			cancel_timer(p);
+			p->timed_out = 1;
+			wake(p);
+		}
+	}
+	/*
+	 * Nothing happens between the last slot reached and now, so
+	 * every timer left is still in the right slot.
+	 */
+	if ((long)(now - wheel_now) > 0)
+		ATOMIC_WRITE(wheel_now, now);
+}
+
+#ifdef THREADS
+/*
+ * Returns true if some timer may have expired since timers were last
+ * fired.  May be called unlocked.
+ */
+static int
+timers_due(void)
+{
+	return ATOMIC_READ(num_timers) > 0 &&
+	    (long)(clock_ms() - ATOMIC_READ(wheel_now)) > 0;
+}
+#endif
+
+/*
+ * Adjust the process's slice, given how much of it was used, and
+ * count the switch.  Only the thread which ran the process, and has
+ * yet to put it back, may do this.
+ */
+static void
+account(struct process *p)
+{
+	struct counts *c = here();
+	unsigned int max, length = ready.length;
+
+#ifdef THREADS
+	if (current_worker != NULL)
+		length = ATOMIC_READ(current_worker->rq.length);
+#endif
+	c->switches++;
+	c->instructions += p->slice_used;
+	if (p->slice_used < p->slice)
+		return;
+	c->preemptions++;
+
+	max = slices[p->priority].max;
+	if (length > SLICE_CROWD)
+		max = (unsigned int)((unsigned long)max * SLICE_CROWD / length);
+	if (p->slice < max / 2)
+		p->slice *= 2;
+	else
+		p->slice = max;
+	if (p->slice < slices[p->priority].min)
+		p->slice = slices[p->priority].min;
+}
+
+void
+sched_add(struct process *p)
+{
+	assert(p->sched == SCHED_NONE);
+	p->slice = slices[p->priority].min;
+	LOCK();
+	if (!started) {
+		started = 1;
+		start_ms = clock_ms();
+	}
+	make_ready(p);
+	UNLOCK();
+}
+
+struct process *
+sched_next(void)
+{
+	struct process *p;
+
+	LOCK();
+	if (num_timers > 0)
+		fire_timers(clock_ms());
+	while (ready.length == 0 && num_timers > 0) {
+		idle_until(wheel_next());
+		fire_timers(clock_ms());
+	}
+
+	if ((p = runq_take(&ready, 0)) != NULL)
+		ATOMIC_WRITE(p->sched, SCHED_RUNNING);
+	UNLOCK();
+
+	return p;
+}
+
+void
+sched_put(struct process *p)
+{
+	assert(p->sched == SCHED_RUNNING);
+	account(p);
+	if (p->done) {
+		/*
+		 * A sender which saw it full may be about to wait for
+		 * it; either it waits before this, and is woken here,
+		 * or after, and sees that it is done (see below.)
+		 */
+		LOCK();
+		wake_senders(p);
+		UNLOCK();
+		ATOMIC_WRITE(p->sched, SCHED_NONE);
+		process_retire(p);
+		return;
+	}
+#ifdef THREADS
+	/*
+	 * A process which is not waiting goes straight back to this
+	 * worker's queue.  If that leaves work to spare, let an idle
+	 * worker know, so that it can steal some.
+	 */
+	if (current_worker != NULL && !p->waiting) {
+		ATOMIC_WRITE(p->sched, SCHED_READY);
+		if (worker_push(current_worker, p) > 1 &&
+		    ATOMIC_READ(idle_workers) > 0) {
+			LOCK();
+			pthread_cond_signal(&sched_cond);
+			UNLOCK();
+		}
+		return;
+	}
+#endif
+	LOCK();
+	if (p->waiting) {
+		ATOMIC_WRITE(p->sched, SCHED_BLOCKED);
+		queue_append(&blocked, p);
+		if (p->send_to != NULL) {
+			/*
+			 * Likewise, the process it waits to send to may
+			 * have made room, or ended, since it looked; if
+			 * it does so after this point, it sees this one
+			 * waiting.
+			 */
+			p->next_sender = p->send_to->senders;
+			ATOMIC_WRITE(p->send_to->senders, p);
+			if (process_has_room(p->send_to) ||
+			    ATOMIC_READ(p->send_to->done))
+				wake_senders(p->send_to);
+		} else if (process_has_posted(p) || p->timed_out) {
+			/*
+			 * A message may have been posted to the process
+			 * since it last looked, by a sender which saw that
+			 * it was not yet blocked; or its timer may have
+			 * fired likewise.  Any sender after this point sees
+			 * that it is, and wakes it.
+			 */
+			wake(p);
+		}
+	} else {
+		make_ready(p);
+	}
+	UNLOCK();
+}
+
+void
+sched_wake(struct process *p)
+{
+	LOCK();
+	wake(p);
+	UNLOCK();
+}
+
+void
+sched_wake_senders(struct process *p)
+{
+	LOCK();
+	wake_senders(p);
+	UNLOCK();
+}
+
+void
+sched_set_timer(struct process *p, unsigned long ms)
+{
+	LOCK();
+	set_timer(p, ms);
+	UNLOCK();
+}
+
+void
+sched_cancel_timer(struct process *p)
+{
+	LOCK();
+	cancel_timer(p);
+	UNLOCK();
+}
+
+int
+sched_timeout(struct process *p, unsigned long ms)
+{
+	int expired;
+
+	LOCK();
+	if ((expired = p->timed_out))
+		p->timed_out = 0;
+	else if (!p->timer_set)
+		set_timer(p, ms);
+	UNLOCK();
+	return expired;
+}
+
+void
+sched_set_slices(int priority, unsigned int min, unsigned int max)
+{
+	assert(priority >= 0 && priority < PRIORITY_CLASSES);
+	assert(min >= 2 && min <= max);
+	slices[priority].min = min;
+	slices[priority].max = max;
+}
+
+void
+sched_set_latency(struct process *p, unsigned long ms)
+{
+	p->latency = ms * 1000;
+}
+
+void
+sched_set_priority(struct process *p, int priority)
+{
+	assert(priority >= 0 && priority < PRIORITY_CLASSES);
+	p->priority = priority;
+	if (p->slice < slices[priority].min)
+		p->slice = slices[priority].min;
+	if (p->slice > slices[priority].max)
+		p->slice = slices[priority].max;
+}
+
+static const char *queue_names[NUM_QUEUES] = {
+	"waits-deadline", "waits-high", "waits-normal", "waits-low"
+};
+
+/*
+ * Statistics include switches made by worker threads only once they
+ * have all stopped.
+ */
+int
+sched_stats(struct value *dict)
+{
+	unsigned long elapsed = started ? clock_ms() - start_ms : 0;
+	struct value key, tag, hist;
+	unsigned int i, j;
+
+	if (!value_dict_new(dict, 31) ||
+	    !value_symbol_new(&tag, "waits", 5))
+		return 0;
+	for (i = 0; i < NUM_QUEUES; i++) {
+		if (!value_tuple_new(&hist, &tag, WAIT_BUCKETS) ||
+		    !value_symbol_new(&key, queue_names[i],
+		    strlen(queue_names[i])))
+			return 0;
+		for (j = 0; j < WAIT_BUCKETS; j++)
+			value_tuple_store_integer(&hist, j,
+			    (int)counts.waits[i][j]);
+		value_dict_store(dict, &key, &hist);
+	}
+	value_dict_store_integer(dict, "missed-deadlines", counts.missed);
+	value_dict_store_integer(dict, "switches", counts.switches);
+	value_dict_store_integer(dict, "preemptions", counts.preemptions);
+	value_dict_store_integer(dict, "instructions", counts.instructions);
+	value_dict_store_integer(dict, "mean-slice", counts.switches == 0 ? 0 :
+	    counts.instructions / counts.switches);
+	value_dict_store_integer(dict, "elapsed-ms", elapsed);
+	value_dict_store_integer(dict, "switches-per-second", elapsed == 0 ? 0 :
+	    (unsigned long)((double)counts.switches * 1000.0 / elapsed));
+	return 1;
+}
+
+unsigned long
+sched_timer_left(struct process *p)
+{
+	unsigned long now = clock_ms();
+
+	assert(p->timer_set);
+	return (long)(p->deadline - now) > 0 ? p->deadline - now : 0;
+}
+
+static void
+walk_runq(const struct runq *rq, process_visitor visitor)
+{
+	struct process *p;
+	unsigned int i;
+
+	for (i = 0; i < rq->due_count; i++)
+		visitor(rq->due[i]);
+	for (i = DEADLINE_QUEUE + 1; i < NUM_QUEUES; i++) {
+		for (p = rq->q[i].head; p != NULL; p = p->next)
+			visitor(p);
+	}
+}
+
+void
+sched_walk(process_visitor visitor)
+{
+#ifdef THREADS
+	unsigned int i;
+
+	for (i = 0; i < ATOMIC_READ(num_workers); i++)
+		walk_runq(&workers[i].rq, visitor);
+#endif
+	walk_runq(&ready, visitor);
+}
+
+int
+sched_has_ready(void)
+{
+#ifdef THREADS
+	if (any_ready())
+		return 1;
+#endif
+	return ATOMIC_READ(ready.length) != 0;
+}
+
+void
+sched_reap(void)
+{
+	struct process *p;
+
+	while ((p = blocked.head) != NULL) {
+		queue_remove(&blocked, p);
+		ATOMIC_WRITE(p->sched, SCHED_NONE);
+		process_free(p);
+	}
+	process_free_ended();
+}
+
+#ifdef THREADS
+static void
+add_counts(struct counts *to, const struct counts *from)
+{
+	unsigned int i, j;
+
+	to->switches += from->switches;
+	to->preemptions += from->preemptions;
+	to->instructions += from->instructions;
+	for (i = 0; i < NUM_QUEUES; i++)
+		for (j = 0; j < WAIT_BUCKETS; j++)
+			to->waits[i][j] += from->waits[i][j];
+	to->missed += from->missed;
+}
+
+/*
+ * Wait, with sched_lock held, until the given time, or until woken.
+ */
+static void
+wait_until(unsigned long deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(deadline / 1000);
+	ts.tv_nsec = (long)(deadline % 1000) * 1000000;
+	pthread_cond_timedwait(&sched_cond, &sched_lock, &ts);
+}
+
+/*
+ * Stop, with sched_lock held, until the full collection under way
+ * is finished.
+ */
+static void
+park(void)
+{
+	parked_workers++;
+	pthread_cond_broadcast(&sched_cond);
+	while (stopping)
+		pthread_cond_wait(&sched_cond, &sched_lock);
+	parked_workers--;
+}
+
+/*
+ * Take a process to run: from this worker's queue, or else another
+ * worker's.  If there is none, wait until there is; or
+ * return NULL, once every worker is idle and no timer is set, since
+ * then nothing can ever run again.
+ */
+static struct process *
+worker_next(struct worker *w)
+{
+	struct process *p;
+	unsigned int i, n;
+	int done;
+
+	for (;;) {
+		if (ATOMIC_READ(stopping)) {
+			LOCK();
+			park();
+			UNLOCK();
+		}
+		if (timers_due()) {
+			LOCK();
+			fire_timers(clock_ms());
+			UNLOCK();
+		}
+
+		if ((p = worker_take(w, 0)) != NULL)
+			break;
+		n = ATOMIC_READ(num_workers);
+		for (i = 1; i < n && p == NULL; i++)
+			p = worker_take(&workers[(w->id + i) % n], 1);
+		if (p != NULL)
+			break;
+
+		LOCK();
+		__sync_add_and_fetch(&idle_workers, 1);
+		if (stopping)
+			pthread_cond_broadcast(&sched_cond);
+		for (;;) {
+			if (finished)
+				break;
+			if (!stopping) {
+				if (num_timers > 0)
+					fire_timers(clock_ms());
+				if (any_ready())
+					break;
+				if (idle_workers == ATOMIC_READ(num_workers) &&
+				    num_timers == 0) {
+					finished = 1;
+					pthread_cond_broadcast(&sched_cond);
+					break;
+				}
+			}
+			if (!stopping && num_timers > 0)
+				wait_until(wheel_next());
+			else
+				pthread_cond_wait(&sched_cond, &sched_lock);
+		}
+		__sync_sub_and_fetch(&idle_workers, 1);
+		done = finished;
+		UNLOCK();
+		if (done)
+			return NULL;
+	}
+
+	ATOMIC_WRITE(p->sched, SCHED_RUNNING);
+	return p;
+}
+
+int
+sched_stop_world(void)
+{
+	if (current_worker == NULL)
+		return 1;
+	LOCK();
+	if (stopping) {
+		UNLOCK();
+		return 0;
+	}
+	ATOMIC_WRITE(stopping, 1);
+	while (parked_workers + idle_workers < ATOMIC_READ(num_workers) - 1)
+		pthread_cond_wait(&sched_cond, &sched_lock);
+	UNLOCK();
+	return 1;
+}
+
+void
+sched_start_world(void)
+{
+	if (current_worker == NULL)
+		return;
+	LOCK();
+	ATOMIC_WRITE(stopping, 0);
+	pthread_cond_broadcast(&sched_cond);
+	UNLOCK();
+}
+
+/*
+ * Collect every heap, once every other worker has stopped between
+ * processes (or is idle.)  If another worker is already collecting
+ * (or stopping them for some other reason), stop for it instead.
+ */
+static void
+collect_all(void)
+{
+	if (!sched_stop_world()) {
+		LOCK();
+		park();
+		UNLOCK();
+		return;
+	}
+	process_gc_all();
+	sched_start_world();
+}
+
+/*
+ * Between processes is a safe point, just as it is for run: the
+ * process just run has its own heap collected if need be, and every
+ * heap, rarely.
+ */
+static void *
+worker_run(void *arg)
+{
+	struct process *p;
+
+	current_worker = arg;
+	while ((p = worker_next(current_worker)) != NULL) {
+		process_run(p);
+		if (!p->done)
+			process_gc(p);
+		if (value_gc_wanted())
+			collect_all();
+		sched_put(p);
+	}
+	process_free_spares();
+	current_worker = NULL;
+	return NULL;
+}
+
+void
+sched_run_workers(unsigned int n)
+{
+	pthread_condattr_t attr;
+	unsigned int i;
+
+	if (n < 1)
+		n = 1;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	workers = malloc(n * sizeof(struct worker));
+	assert(workers != NULL);
+	memset(workers, 0, n * sizeof(struct worker));
+	for (i = 0; i < n; i++) {
+		workers[i].id = i;
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	workers[0].rq = ready;
+	memset(&ready, 0, sizeof(ready));
+
+	/*
+	 * The calling thread is worker 0.  If a thread cannot be
+	 * started, we simply make do with fewer.
+	 */
+	finished = 0;
+	LOCK();
+	ATOMIC_WRITE(num_workers, 1);
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_run,
+		    &workers[i]) != 0)
+			break;
+		__sync_add_and_fetch(&num_workers, 1);
+	}
+	UNLOCK();
+	worker_run(&workers[0]);
+	for (i = 1; i < num_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < n; i++) {
+		add_counts(&counts, &workers[i].counts);
+		free(workers[i].rq.due);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+	free(workers);
+	workers = NULL;
+	ATOMIC_WRITE(num_workers, 0);
+	pthread_cond_destroy(&sched_cond);
+}
+#else
+int
+sched_stop_world(void)
+{
+	return 1;
+}
+
+void
+sched_start_world(void)
+{
+}
+
+void
+sched_run_workers(unsigned int n)
+{
+	struct process *p;
+
+	n = n;
+	while ((p = sched_next()) != NULL) {
+		process_run(p);
+		if (!p->done)
+			process_gc(p);
+		if (value_gc_wanted())
+			process_gc_all();
+		sched_put(p);
+	}
+}
+#endif
@@ -0,0 +1,180 @@
+/*
+ * sched.h
+ * Scheduling of processes.
+ */
+
+#ifndef __SCHED_H_
+#define __SCHED_H_
+
+struct process;
+struct value;
+
+/*
+ * Where a process is, as far as the scheduler is concerned.  A
+ * scheduled process is always in exactly one of these places.
+ * Processes which are only ever run directly by their callers (such
+ * as streams) are never scheduled, and stay SCHED_NONE.
+ */
+#define SCHED_NONE	0	/* not scheduled (or no longer) */
+#define SCHED_READY	1	/* in the ready queue */
+#define SCHED_RUNNING	2	/* taken from the ready queue, running */
+#define SCHED_BLOCKED	3	/* waiting for a message */
+
+/*
+ * Priority classes.  Each class has a ready queue of its own, and
+ * bounds the time slice of its processes: the number of VM
+ * instructions each may execute before another gets a turn.  Short
+ * slices favour latency, long ones throughput.  Ready processes of a
+ * higher class run first, unless one of a lower class has waited
+ * much longer.  New processes are PRIORITY_NORMAL.
+ */
+#define PRIORITY_HIGH		0
+#define PRIORITY_NORMAL		1
+#define PRIORITY_LOW		2
+#define PRIORITY_CLASSES	3
+
+/* Prototypes */
+
+/*
+ * Add a new process to the end of the ready queue.
+ */
+void		 sched_add(struct process *);
+
+/*
+ * Take the process at the front of the ready queue, to be run.  If
+ * none is ready, but some timer is set, wait for it to expire first.
+ * Returns NULL if no process is ready, or ever can be.
+ */
+struct process	*sched_next(void);
+
+/*
+ * Put back a process which was taken by sched_next() and has now
+ * run: if it is done, it is freed; if it is waiting, it joins the
+ * blocked set, and is not run again until it is woken; otherwise it
+ * goes to the end of the ready queue.  A process which is waiting
+ * with send_to set is waiting for room in that process's mailbox,
+ * and is woken (only) once there is some.
+ */
+void		 sched_put(struct process *);
+
+/*
+ * A message has arrived for the process: if it is blocked (and not
+ * sleeping), it is no longer waiting, and is moved to a ready queue.
+ * A process which is not blocked is left alone (sched_put() looks for
+ * messages which arrive while a process runs.)
+ */
+void		 sched_wake(struct process *);
+
+/*
+ * The process has made room in its mailbox: wake every process which
+ * is waiting to send to it (see sched_put().)
+ */
+void		 sched_wake_senders(struct process *);
+
+/*
+ * Arrange for the process to be woken, with its timed_out flag set,
+ * once the given number of milliseconds have passed, unless the timer
+ * is cancelled first.  Only one timer may be set at a time.  A process
+ * which is waiting with its sleeping flag set is woken by its timer
+ * alone, not by messages.
+ */
+void		 sched_set_timer(struct process *, unsigned long);
+
+/*
+ * Cancel the process's timer, if it has one, and clear timed_out.
+ */
+void		 sched_cancel_timer(struct process *);
+
+/*
+ * For a process about to wait no longer than the given number of
+ * milliseconds: if its timer has expired, clear timed_out and return
+ * true; otherwise set the timer (unless it is already set) and return
+ * false.
+ */
+int		 sched_timeout(struct process *, unsigned long);
+
+/*
+ * Set the shortest and longest time slice, in VM instructions, of the
+ * given priority class.  Should be done before any process is added.
+ */
+void		 sched_set_slices(int, unsigned int, unsigned int);
+
+/*
+ * Move the process into the given priority class.  Only the process
+ * itself (or whoever holds it, while it is not scheduled) may do this.
+ */
+void		 sched_set_priority(struct process *, int);
+
+/*
+ * Give the process a latency target, in milliseconds, or none (0.)
+ * Whenever a process with a target becomes ready, it is due to run
+ * within that time; such processes run ahead of all others, earliest
+ * deadline first.  Only the process itself (or whoever holds it,
+ * while it is not scheduled) may do this.
+ */
+void		 sched_set_latency(struct process *, unsigned long);
+
+/*
+ * Set the given value to a new dictionary, mapping symbols to
+ * integers, which describes the scheduler's work so far: switches
+ * (runs of processes), preemptions (switches at which the process
+ * had used all of its slice), instructions executed, the mean slice,
+ * and the elapsed time and switches per second since the first
+ * process was added.  It also maps waits-deadline, waits-high,
+ * waits-normal and waits-low to histograms of how long processes
+ * waited in each ready queue: tuples counting waits of under 10us,
+ * under 100us, and so on up to under 1s, and longer; and
+ * missed-deadlines to the number of processes with latency targets
+ * which waited longer than that.  Returns false if memory could not
+ * be allocated.
+ */
+int		 sched_stats(struct value *);
+
+/*
+ * Returns the number of milliseconds until the process's timer (which
+ * must be set) expires, or 0 if it has.
+ */
+unsigned long	 sched_timer_left(struct process *);
+
+/*
+ * Apply the visitor to every ready process, in the order in which
+ * they would run (were none to arrive or leave meanwhile.)  Only safe
+ * when no other thread is running processes.
+ */
+void		 sched_walk(void (*)(struct process *));
+
+/*
+ * Returns true if some process is in a ready queue: the shared one,
+ * or (while worker threads are running) any worker's.
+ */
+int		 sched_has_ready(void);
+
+/*
+ * Free every blocked process, and every process which has ended.
+ * Once nothing is ready, nothing can ever wake them.
+ */
+void		 sched_reap(void);
+
+/*
+ * Run processes until none is ready, or ever can be, collecting
+ * garbage between them.  In builds with THREADS, they are run by the
+ * given number of worker threads (the caller being one), M:N; a full
+ * collection stops every worker between processes.  Otherwise they
+ * are run one at a time, as by sched_next() and sched_put().
+ */
+void		 sched_run_workers(unsigned int);
+
+/*
+ * Stop every other worker between processes (or idle), for something
+ * which must see every process at rest, as a full collection must.
+ * May be called by a worker while it runs a process.  Returns false,
+ * having stopped nothing, if some other worker is already stopping
+ * them; the caller should then put back its process and try again
+ * later (the worker then stops for the other.)  Without workers
+ * running, there is nothing to stop.  Once done, the caller starts
+ * them again with sched_start_world().
+ */
+int		 sched_stop_world(void);
+void		 sched_start_world(void);
+
+#endif /* !__SCHED_H_ */
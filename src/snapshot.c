@@ -0,0 +1,530 @@
+/*
+ * snapshot.c
+ * Saving and restoring the state of a running program.
+ *
+ * A snapshot is an image (see image.h) of a single tuple, with an
+ * entry for each VM process, in the order in which they would run:
+ *
+ *   <snapshot: <process: p, vm, messages, priority, latency, timer,
+ *     timed-out, capacity, overflow, supervised, entry, restarts,
+ *     name, watching>, ...>
+ *
+ * where p is the process itself; messages is a tuple of the messages
+ * in its mailbox, oldest first; latency is in milliseconds; timer is
+ * the milliseconds left before its timer expires, or null; name is
+ * the name it registered, or null; and watching is a tuple of
+ * <watch: q, link> for each process q it watches.  A link is recorded
+ * by whichever of the two processes comes first.
+ *
+ * In the image, each VM process is named by its place in the snapshot,
+ * and each open file by <file: number, locator, mode, position>, so
+ * that references to them, wherever they are, are restored.  Other
+ * processes (and those which have finished) are restored as null.
+ * Labels, in a build with DIRECT_THREADING, are named by their opcodes,
+ * and restored as such, to be converted again; so a snapshot taken by
+ * one build can be restored by another.
+ *
+ * A process which was waiting is restored ready, and does again what
+ * it was waiting to do (receive, send or sleep), which makes it wait
+ * again, if it still must.
+ */
+
+#include "lib.h"
+
+#include "process.h"
+#include "sched.h"
+#include "registry.h"
+#include "file.h"
+#include "stream.h"
+#include "vmproc.h"
+#include "vm.h"
+
+#include "value.h"
+#include "save.h"
+#include "load.h"
+
+#include "snapshot.h"
+
+/*
+ * The processes in the snapshot, by number, with their names, and
+ * (while saving) a hash table which finds the number of each.
+ */
+struct known {
+	struct process	*p;	/* NULL if empty */
+	unsigned int	 number;
+};
+
+static struct process **procs = NULL;
+static struct value *names = NULL;
+static unsigned int num_procs = 0;
+static unsigned int procs_size = 0;
+static struct known *known = NULL;
+static unsigned int known_size = 0;
+
+#define	PROCS_INITIAL	64
+
+static unsigned int
+known_slot(const struct known *table, unsigned int size, struct process *p)
+{
+	unsigned int i;
+
+	i = (unsigned int)(((PTR_INT)p >> 3) * 2654435761UL) & (size - 1);
+	while (table[i].p != NULL && table[i].p != p)
+		i = (i + 1) & (size - 1);
+	return i;
+}
+
+/*
+ * Make room for processes numbered up to n.  Returns false if memory
+ * could not be allocated.
+ */
+static int
+grow(unsigned int n)
+{
+	struct process **p;
+	struct value *v;
+	unsigned int size, i;
+
+	if (n < procs_size)
+		return 1;
+	size = procs_size == 0 ? PROCS_INITIAL : procs_size;
+	while (size <= n)
+		size *= 2;
+	if ((p = realloc(procs, size * sizeof(struct process *))) == NULL)
+		return 0;
+	procs = p;
+	if ((v = realloc(names, size * sizeof(struct value))) == NULL)
+		return 0;
+	names = v;
+	for (i = procs_size; i < size; i++) {
+		procs[i] = NULL;
+		value_copy(&names[i], &VNULL);
+	}
+	procs_size = size;
+	return 1;
+}
+
+/*
+ * Returns the number of the process, or -1 if it is not in the
+ * snapshot.
+ */
+static int
+number(struct process *p)
+{
+	unsigned int i;
+
+	if (known_size == 0)
+		return -1;
+	i = known_slot(known, known_size, p);
+	return known[i].p == p ? (int)known[i].number : -1;
+}
+
+/*
+ * Give the process the next number, unless it has one.  Returns false
+ * if memory could not be allocated.
+ */
+static int
+add(struct process *p)
+{
+	struct known *table;
+	unsigned int i, size;
+
+	if (number(p) >= 0)
+		return 1;
+	if (!grow(num_procs))
+		return 0;
+	if (2 * (num_procs + 1) > known_size) {
+		size = known_size == 0 ? 2 * PROCS_INITIAL : 2 * known_size;
+		if ((table = malloc(size * sizeof(struct known))) == NULL)
+			return 0;
+		memset(table, 0, size * sizeof(struct known));
+		for (i = 0; i < known_size; i++) {
+			if (known[i].p != NULL)
+				table[known_slot(table, size, known[i].p)] =
+				    known[i];
+		}
+		free(known);
+		known = table;
+		known_size = size;
+	}
+	i = known_slot(known, known_size, p);
+	known[i].p = p;
+	known[i].number = num_procs;
+	procs[num_procs] = p;
+	value_integer_set(&names[num_procs], (int)num_procs);
+	num_procs++;
+	return 1;
+}
+
+static void
+forget_all(void)
+{
+	free(procs);
+	free(names);
+	free(known);
+	procs = NULL;
+	names = NULL;
+	known = NULL;
+	num_procs = procs_size = known_size = 0;
+}
+
+/*** saving ***/
+
+static int failed;
+
+static void
+add_vm(struct process *p)
+{
+	if (p->heap != NULL && !p->done && !add(p))
+		failed = 1;
+}
+
+static void
+add_file(struct process *p)
+{
+	struct value tag, val;
+	const char *locator, *mode;
+	long position;
+	unsigned int n;
+
+	if (!file_describe(p, &locator, &mode, &position))
+		return;
+	n = num_procs;
+	if (!add(p) || !value_symbol_new(&tag, "file", 4) ||
+	    !value_tuple_new(&names[n], &tag, 4)) {
+		failed = 1;
+		return;
+	}
+	value_tuple_store_integer(&names[n], 0, (int)n);
+	if (!value_symbol_new(&val, locator, strlen(locator))) {
+		failed = 1;
+		return;
+	}
+	value_tuple_store(&names[n], 1, &val);
+	if (!value_symbol_new(&val, mode, strlen(mode))) {
+		failed = 1;
+		return;
+	}
+	value_tuple_store(&names[n], 2, &val);
+	value_tuple_store_integer(&names[n], 3, (int)position);
+}
+
+static void
+name_process(struct process *p, struct value *name)
+{
+	int n;
+
+	if ((n = number(p)) < 0)
+		value_copy(name, &VNULL);
+	else
+		value_copy(name, &names[n]);
+}
+
+#ifdef DIRECT_THREADING
+static void
+name_label(clabel label, struct value *name)
+{
+	value_integer_set(name, vm_label_opcode(label));
+}
+#endif
+
+static const struct namer namer = {
+	name_process,
+#ifdef DIRECT_THREADING
+	name_label
+#else
+	NULL
+#endif
+};
+
+/*
+ * The watches of the process being described, and how many of them
+ * have been recorded so far; or, if watches is null, only counted.
+ */
+static struct process *watcher;
+static struct value *watches;
+static unsigned int num_watches;
+
+static void
+record_watch(struct process *watched, int link)
+{
+	struct value tag, w, who;
+
+	if (number(watched) < 0 ||
+	    (link && number(watched) < number(watcher)))
+		return;
+	if (watches != NULL) {
+		if (!value_symbol_new(&tag, "watch", 5) ||
+		    !value_tuple_new(&w, &tag, 2)) {
+			failed = 1;
+			return;
+		}
+		value_process_set(&who, watched);
+		value_tuple_store(&w, 0, &who);
+		value_tuple_store(&w, 1, link ? &VTRUE : &VFALSE);
+		value_tuple_store(watches, num_watches, &w);
+	}
+	num_watches++;
+}
+
+#define	ENTRY_SIZE	14
+
+/*
+ * Set the entry to a description of the VM process.
+ */
+static int
+describe(struct process *p, struct value *entry)
+{
+	struct value tag, val, list;
+	struct message *m;
+	unsigned int i;
+
+	if (!value_symbol_new(&tag, "process", 7) ||
+	    !value_tuple_new(entry, &tag, ENTRY_SIZE))
+		return 0;
+	value_process_set(&val, p);
+	value_tuple_store(entry, 0, &val);
+	value_tuple_store(entry, 1, &p->aux_value);
+
+	for (i = 0, m = p->tail; m != NULL; m = m->prev)
+		i++;
+	if (!value_symbol_new(&tag, "messages", 8) ||
+	    !value_tuple_new(&list, &tag, i))
+		return 0;
+	for (i = 0, m = p->tail; m != NULL; m = m->prev)
+		value_tuple_store(&list, i++, &m->value);
+	value_tuple_store(entry, 2, &list);
+
+	value_tuple_store_integer(entry, 3, p->priority);
+	value_tuple_store_integer(entry, 4, (int)(p->latency / 1000));
+	if (p->timer_set)
+		value_tuple_store_integer(entry, 5, (int)sched_timer_left(p));
+	value_tuple_store(entry, 6, p->timed_out ? &VTRUE : &VFALSE);
+	value_tuple_store_integer(entry, 7, (int)p->capacity);
+	value_tuple_store_integer(entry, 8, p->overflow);
+	value_tuple_store(entry, 9, p->supervised ? &VTRUE : &VFALSE);
+	value_tuple_store_integer(entry, 10, p->entry);
+	value_tuple_store_integer(entry, 11, (int)p->restarts);
+	if (registry_name(p, &val))
+		value_tuple_store(entry, 12, &val);
+
+	watcher = p;
+	watches = NULL;
+	num_watches = 0;
+	process_walk_watching(p, record_watch);
+	if (!value_symbol_new(&tag, "watching", 8) ||
+	    !value_tuple_new(&list, &tag, num_watches))
+		return 0;
+	watches = &list;
+	num_watches = 0;
+	process_walk_watching(p, record_watch);
+	watches = NULL;
+	value_tuple_store(entry, 13, &list);
+
+	return !failed;
+}
+
+int
+snapshot_save(struct process *self, struct process *out)
+{
+	struct heap *heap, *temp;
+	struct value tag, snapshot, entry;
+	unsigned int i, count;
+	int ok = 0;
+
+	if ((temp = value_heap_new()) == NULL)
+		return 0;
+	heap = value_heap_get_current();
+	value_heap_set_current(temp);
+	failed = 0;
+
+	/*
+	 * Ready processes first, in order, then the one taking the
+	 * snapshot (which would go to the back of the queue after
+	 * this), then the rest, which are waiting.
+	 */
+	sched_walk(add_vm);
+	add_vm(self);
+	process_walk(add_vm);
+	count = num_procs;
+	process_walk(add_file);
+
+	if (!failed && value_symbol_new(&tag, "snapshot", 8) &&
+	    value_tuple_new(&snapshot, &tag, count)) {
+		for (i = 0; i < count && describe(procs[i], &entry); i++)
+			value_tuple_store(&snapshot, i, &entry);
+		if (i == count && value_save_state(out, &snapshot, &namer)) {
+			stream_flush(self, out);
+			ok = 1;
+		}
+	}
+
+	forget_all();
+	value_heap_set_current(heap);
+	value_heap_free(temp);
+	return ok;
+}
+
+/*** restoring ***/
+
+static int
+symbol_is(const struct value *v, const char *s)
+{
+	return v->type == VALUE_SYMBOL &&
+	    value_symbol_get_length(v) == strlen(s) &&
+	    strncmp(value_symbol_get_token(v), s, strlen(s)) == 0;
+}
+
+/*
+ * Returns the process with the given name, making it if it has not
+ * been made yet.
+ */
+static struct process *
+find_process(const struct value *name)
+{
+	const struct value *v = name;
+	struct value *locator, *mode;
+	int n;
+
+	if (value_is_tuple(name)) {
+		if (!symbol_is(value_tuple_get_tag(name), "file") ||
+		    value_tuple_get_size(name) != 4)
+			return NULL;
+		v = value_tuple_fetch(name, 0);
+	}
+	if (v->type != VALUE_INTEGER || (n = value_get_integer(v)) < 0 ||
+	    !grow((unsigned int)n))
+		return NULL;
+	if (procs[n] != NULL)
+		return procs[n];
+
+	if (v == name) {
+		procs[n] = vmproc_alloc();
+	} else {
+		locator = value_tuple_fetch(name, 1);
+		mode = value_tuple_fetch(name, 2);
+		if (locator->type != VALUE_SYMBOL ||
+		    mode->type != VALUE_SYMBOL ||
+		    value_tuple_fetch(name, 3)->type != VALUE_INTEGER)
+			return NULL;
+		procs[n] = file_reopen(value_symbol_get_token(locator),
+		    value_symbol_get_token(mode),
+		    value_tuple_fetch_integer(name, 3));
+	}
+	return procs[n];
+}
+
+/*
+ * Returns the VM process which the entry describes, if it is one.
+ */
+static struct process *
+entry_process(const struct value *entry)
+{
+	struct value *v;
+
+	if (!value_is_tuple(entry) || value_tuple_get_size(entry) != ENTRY_SIZE)
+		return NULL;
+	v = value_tuple_fetch(entry, 0);
+	if (v->type != VALUE_PROCESS || value_get_process(v)->heap == NULL ||
+	    !value_is_tuple(value_tuple_fetch(entry, 1)) ||
+	    !value_is_tuple(value_tuple_fetch(entry, 2)) ||
+	    !value_is_tuple(value_tuple_fetch(entry, 13)))
+		return NULL;
+	return value_get_process(v);
+}
+
+static void
+restore(struct process *p, struct value *entry)
+{
+	struct value *messages, *timer, *name;
+	unsigned int i;
+
+	value_heap_copy(p->heap, &p->aux_value, value_tuple_fetch(entry, 1));
+	value_tuple_store(&p->aux_value, VM_IS_DIRECT, &VFALSE);
+	vm_prepare(&p->aux_value);
+
+	messages = value_tuple_fetch(entry, 2);
+	for (i = 0; i < value_tuple_get_size(messages); i++)
+		process_enqueue(p, value_tuple_fetch(messages, i));
+
+	sched_set_priority(p, value_tuple_fetch_integer(entry, 3));
+	sched_set_latency(p, (unsigned long)value_tuple_fetch_integer(entry, 4));
+	timer = value_tuple_fetch(entry, 5);
+	if (timer->type == VALUE_INTEGER)
+		sched_set_timer(p, (unsigned long)value_get_integer(timer));
+	p->timed_out = value_get_boolean(value_tuple_fetch(entry, 6));
+	process_set_mailbox(p,
+	    (unsigned int)value_tuple_fetch_integer(entry, 7),
+	    value_tuple_fetch_integer(entry, 8));
+	p->supervised = value_get_boolean(value_tuple_fetch(entry, 9));
+	p->entry = value_tuple_fetch_integer(entry, 10);
+	p->restarts = (unsigned int)value_tuple_fetch_integer(entry, 11);
+	name = value_tuple_fetch(entry, 12);
+	if (name->type == VALUE_SYMBOL)
+		registry_register(p, name);
+}
+
+static void
+restore_watches(struct process *p, struct value *entry)
+{
+	struct value *watching, *w, *who;
+	unsigned int i;
+
+	watching = value_tuple_fetch(entry, 13);
+	for (i = 0; i < value_tuple_get_size(watching); i++) {
+		w = value_tuple_fetch(watching, i);
+		if (!value_is_tuple(w) || value_tuple_get_size(w) != 2)
+			continue;
+		who = value_tuple_fetch(w, 0);
+		if (who->type != VALUE_PROCESS)
+			continue;
+		if (value_get_boolean(value_tuple_fetch(w, 1)))
+			process_link(p, value_get_process(who));
+		else
+			process_monitor(p, value_get_process(who));
+	}
+}
+
+int
+snapshot_restore(const char *locator)
+{
+	struct heap *heap, *temp;
+	struct value snapshot, *entry;
+	unsigned int i, count;
+	int ok = 0;
+
+	if ((temp = value_heap_new()) == NULL)
+		return 0;
+	heap = value_heap_get_current();
+	value_heap_set_current(temp);
+
+	if (value_load_state(&snapshot, locator, find_process) &&
+	    value_is_tuple(&snapshot) &&
+	    symbol_is(value_tuple_get_tag(&snapshot), "snapshot")) {
+		count = value_tuple_get_size(&snapshot);
+		for (i = 0; i < count; i++) {
+			if (entry_process(value_tuple_fetch(&snapshot, i)) ==
+			    NULL)
+				break;
+		}
+		ok = i == count;
+	}
+	if (ok) {
+		for (i = 0; i < count; i++) {
+			entry = value_tuple_fetch(&snapshot, i);
+			restore(entry_process(entry), entry);
+		}
+		for (i = 0; i < count; i++) {
+			entry = value_tuple_fetch(&snapshot, i);
+			restore_watches(entry_process(entry), entry);
+		}
+		for (i = 0; i < count; i++)
+			sched_add(entry_process(value_tuple_fetch(&snapshot,
+			    i)));
+	}
+
+	forget_all();
+	value_heap_set_current(heap);
+	value_heap_free(temp);
+	return ok;
+}
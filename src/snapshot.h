@@ -0,0 +1,27 @@
+/*
+ * snapshot.h
+ * Saving and restoring the state of a running program.
+ */
+
+#ifndef __SNAPSHOT_H_
+#define __SNAPSHOT_H_
+
+struct process;
+
+/*
+ * Write the state of every process to the stream: its virtual machine
+ * and mailbox, and how it is scheduled, named and watched.  The first
+ * process, which takes the snapshot, must have saved its registers in
+ * its virtual machine, and no other may be running (see
+ * sched_stop_world().)  Returns false if memory could not be allocated.
+ */
+int		 snapshot_save(struct process *, struct process *);
+
+/*
+ * Make the processes saved in the named file again, and schedule them
+ * to carry on where they left off.  Returns false if the snapshot
+ * could not be loaded.
+ */
+int		 snapshot_restore(const char *);
+
+#endif /* !__SNAPSHOT_H_ */
@@ -5,39 +5,81 @@
 
 #include "lib.h"
 
+#ifdef THREADS
+#include <pthread.h>
+#endif
+
 #include "process.h"
 
 #include "stream.h"
 
+/*
+ * Writes to a stream which cannot take them directly are gathered
+ * here until they are sent on (see stream_write().)  Writers in
+ * different threads may share a stream, so with THREADS each buffer
+ * has a lock.
+ */
+#define WRITE_BUFFER	4096
+
+struct write_buffer {
+#ifdef THREADS
+	pthread_mutex_t	 lock;
+#endif
+	unsigned int	 length;
+	char		 data[WRITE_BUFFER];
+};
+
+#ifdef THREADS
+#define	LOCK_BUFFER(b)		pthread_mutex_lock(&(b)->lock)
+#define	UNLOCK_BUFFER(b)	pthread_mutex_unlock(&(b)->lock)
+#else
+#define	LOCK_BUFFER(b)		do { } while (0)
+#define	UNLOCK_BUFFER(b)	do { } while (0)
+#endif
+
+/*
+ * Where a read receiver puts what it receives.
+ */
+struct read_result {
+	char		*buffer;
+	unsigned int	 size;
+	unsigned int	 length;	/* received */
+};
+
 static void
 read_receiver_run(struct process *self)
 {
+	struct read_result *rr;
 	struct value msg;
 	const char *token;
-	int length;
-	int i;
+	unsigned int length;
+	unsigned int i;
 
 	assert(self != NULL);
 	assert(self->aux != NULL);
+	rr = (struct read_result *)self->aux;
 
 	while (process_dequeue(self, &msg)) {
 		token = value_symbol_get_token(&msg);
 		length = value_symbol_get_length(&msg);
+		if (length > rr->size)
+			length = rr->size;
 		for (i = 0; i < length; i++) {
-			((char *)self->aux)[i] = token[i];
+			rr->buffer[i] = token[i];
 		}
+		rr->length = length;
 		/* XXX assert the queue is empty? */
 	}
 }
 
 static struct process *
-read_receiver_new(void *buffer)
+read_receiver_new(struct read_result *rr)
 {
 	struct process *p;
 
 	p = process_new();
 	p->run = read_receiver_run;
-	p->aux = buffer;
+	p->aux = rr;
 
 	return p;
 }
@@ -68,28 +110,151 @@ eof_receiver_new(int *result)
 	return p;
 }
 
+static void
+send_write(struct process *p, const void *data, unsigned int size)
+{
+	struct value msg, tag;
+
+	value_symbol_new(&tag, "write", 5);
+	value_tuple_new(&msg, &tag, 1);
+	value_symbol_new(value_tuple_fetch(&msg, 0), data, size);
+	process_enqueue(p, &msg);
+	process_run(p);
+}
+
+/*
+ * The stream's write buffer, made on first use, or NULL if there is
+ * no memory for one.
+ */
+static struct write_buffer *
+buffer_of(struct process *p)
+{
+	struct write_buffer *b;
+
+	if ((b = ATOMIC_READ(p->buffer)) != NULL)
+		return b;
+	if ((b = malloc(sizeof(struct write_buffer))) == NULL)
+		return NULL;
+	b->length = 0;
+#ifdef THREADS
+	pthread_mutex_init(&b->lock, NULL);
+	if (!__sync_bool_compare_and_swap(&p->buffer, NULL, b)) {
+		pthread_mutex_destroy(&b->lock);
+		free(b);
+		b = ATOMIC_READ(p->buffer);
+	}
+#else
+	p->buffer = b;
+#endif
+	return b;
+}
+
+/*
+ * Send on whatever the stream has buffered.  With its buffer locked.
+ */
+static void
+drain(struct process *p, struct write_buffer *b)
+{
+	if (b->length == 0)
+		return;
+	send_write(p, b->data, b->length);
+	b->length = 0;
+}
+
 void
 stream_write(struct process *self, struct process *p, const void *data, unsigned int size)
+{
+	struct write_buffer *b;
+	const char *bytes = data;
+	unsigned int i;
+
+	self = self;
+
+	if (p->write != NULL) {
+		p->write(p, data, size);
+		return;
+	}
+	if ((b = buffer_of(p)) == NULL) {
+		send_write(p, data, size);
+		return;
+	}
+	LOCK_BUFFER(b);
+	if (b->length + size > WRITE_BUFFER)
+		drain(p, b);
+	if (size >= WRITE_BUFFER) {
+		send_write(p, data, size);
+	} else {
+		memcpy(b->data + b->length, data, size);
+		b->length += size;
+		for (i = 0; i < size && bytes[i] != '\n'; i++)
+			;
+		if (i < size)
+			drain(p, b);
+	}
+	UNLOCK_BUFFER(b);
+}
+
+/*
+ * Send on whatever the stream has buffered, if it has a buffer.
+ */
+static void
+flush_buffer(struct process *p)
+{
+	struct write_buffer *b;
+
+	if ((b = ATOMIC_READ(p->buffer)) == NULL)
+		return;
+	LOCK_BUFFER(b);
+	drain(p, b);
+	UNLOCK_BUFFER(b);
+}
+
+void
+stream_flush(struct process *self, struct process *p)
 {
 	struct value msg, tag;
 
 	self = self;
 
-	value_symbol_new(&tag, "write", 5);
-	value_tuple_new(&msg, &tag, 1);
-	value_symbol_new(value_tuple_fetch(&msg, 0), data, size);
+	if (p->flush != NULL) {
+		p->flush(p);
+		return;
+	}
+	flush_buffer(p);
+	value_symbol_new(&tag, "flush", 5);
+	value_tuple_new(&msg, &tag, 0);
 	process_enqueue(p, &msg);
 	process_run(p);
 }
 
 void
+stream_free_buffer(struct process *p)
+{
+	struct write_buffer *b = p->buffer;
+
+	if (b == NULL)
+		return;
+#ifdef THREADS
+	pthread_mutex_destroy(&b->lock);
+#endif
+	free(b);
+	p->buffer = NULL;
+}
+
+unsigned int
 stream_read(struct process *self, struct process *p, void *buffer, unsigned int size)
 {
 	struct value msg, tag;
 	struct process *receiver;
+	struct read_result rr;
 
 	if (self == NULL) {
-		receiver = read_receiver_new(buffer);
+		if (p->read != NULL)
+			return p->read(p, buffer, size);
+		rr.buffer = buffer;
+		rr.size = size;
+		rr.length = 0;
+		receiver = read_receiver_new(&rr);
 	} else {
 		receiver = self;
 	}
@@ -102,11 +267,12 @@ stream_read(struct process *self, struct process *p, void *buffer, unsigned int
 	process_run(p);
 
 	if (receiver == self) {
-		return;
+		return 0;
 	}
 
 	process_run(receiver);
 	process_free(receiver);
+	return rr.length;
 }
 
 int
@@ -145,8 +311,84 @@ stream_close(struct process *self, struct process *p)
 
 	self = self;
 
+	flush_buffer(p);
 	value_symbol_new(&tag, "close", 5);
 	value_tuple_new(&msg, &tag, 0);
 	process_enqueue(p, &msg);
 	process_run(p);
 }
+
+/*** readers ***/
+
+#define READER_BUFFER	8192
+
+struct reader {
+	struct process	*p;
+	unsigned int	 pos;		/* of the next byte in buffer */
+	unsigned int	 length;	/* of what is in buffer */
+	int		 at_end;
+	char		 buffer[READER_BUFFER];
+};
+
+struct reader *
+reader_new(struct process *p)
+{
+	struct reader *r;
+
+	if ((r = malloc(sizeof(struct reader))) == NULL)
+		return NULL;
+	r->p = p;
+	r->pos = 0;
+	r->length = 0;
+	r->at_end = 0;
+	return r;
+}
+
+void
+reader_free(struct reader *r)
+{
+	free(r);
+}
+
+unsigned int
+reader_read(struct reader *r, void *buffer, unsigned int size)
+{
+	char *dest = buffer;
+	unsigned int done = 0, n;
+
+	while (done < size) {
+		if (r->pos == r->length) {
+			/*
+			 * Large reads go straight to the caller's buffer.
+			 */
+			if (size - done >= READER_BUFFER) {
+				n = stream_read(NULL, r->p, dest + done,
+				    size - done);
+				done += n;
+				if (n == 0)
+					break;
+				continue;
+			}
+			r->pos = 0;
+			r->length = stream_read(NULL, r->p, r->buffer,
+			    READER_BUFFER);
+			if (r->length == 0)
+				break;
+		}
+		n = r->length - r->pos;
+		if (n > size - done)
+			n = size - done;
+		memcpy(dest + done, r->buffer + r->pos, n);
+		r->pos += n;
+		done += n;
+	}
+	if (done < size)
+		r->at_end = 1;
+	return done;
+}
+
+int
+reader_at_end(struct reader *r)
+{
+	return r->at_end;
+}
@@ -16,17 +16,39 @@ struct process;
 
 /*
  * Send a message of the form <write: data-in-symbol-form> to the stream.
+ * A native stream which can take the data directly (such as a file)
+ * does so instead, without any message being allocated; it may buffer
+ * it, until it is flushed or closed.  Writes to any other stream are
+ * gathered in a buffer of the stream's, and sent as one message when
+ * a newline is written, when the buffer fills, or when the stream is
+ * flushed or closed.
  */
 void		 stream_write(struct process *, struct process *, const void *, unsigned int);
 
+/*
+ * Send a message of the form <flush:> to the stream: anything it has
+ * buffered is written out, after anything buffered for it.  Again, a
+ * native stream which can do so directly does.
+ */
+void		 stream_flush(struct process *, struct process *);
+
+/*
+ * Free the stream's write buffer, dropping whatever is in it, as when
+ * the stream's process is freed.
+ */
+void		 stream_free_buffer(struct process *);
+
 /*
  * Send a message of the form <read: receiver, length> to the stream.
  * If self was given, it will be used as the receiver, and it will receive
- * a response message in the form of a symbol.
+ * a response message in the form of a symbol (shorter than asked for,
+ * if the stream had no more.)
  * If self is NULL, a provisional pseudo-receiver process will be supplied
- * by this function, and data will be returned in the void *.
+ * by this function, data will be returned in the void *, and the number
+ * of bytes will be returned by the function; or a native stream which
+ * can give data directly (such as a file) does so, without messages.
  */
-void		 stream_read(struct process *, struct process *, void *, unsigned int);
+unsigned int	 stream_read(struct process *, struct process *, void *, unsigned int);
 
 /*
  * Send a message of the form <eof: receiver> to the stream.
@@ -38,8 +60,31 @@ void		 stream_read(struct process *, struct process *, void *, unsigned int);
 int		 stream_is_at_end(struct process *, struct process *);
 
 /*
- * Send a message of the form <close:> to the stream.
- */ 
+ * Send a message of the form <close:> to the stream, after anything
+ * buffered for it.
+ */
 void		 stream_close(struct process *, struct process *);
 
+/*
+ * Readers.  A reader reads from a stream in large blocks, and hands
+ * out what it has read in pieces of any size, so that reading a byte
+ * at a time does not cost a message each time.  Since it reads ahead,
+ * nothing else should read from the stream while it is in use.
+ */
+struct reader;
+
+struct reader	*reader_new(struct process *);
+void		 reader_free(struct reader *);
+
+/*
+ * Copy up to the given number of bytes into the buffer, returning how
+ * many there were.  A short count means the stream has no more.
+ */
+unsigned int	 reader_read(struct reader *, void *, unsigned int);
+
+/*
+ * Returns true once a read has come up short, as feof() does.
+ */
+int		 reader_at_end(struct reader *);
+
 #endif /* !__FILE_H_ */
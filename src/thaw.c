@@ -36,11 +36,14 @@ thaw_main(struct value *args, struct value *result)
 	r = reporter_new("Thawing", NULL, 1);
 
 	/*
-	 * Read in.
+	 * Read in.  The values of large tuples are only read as they
+	 * are written out.
 	 */
-	p = file_open(value_symbol_get_token(binfile), "r");
-	value_load(&term, p);
-	stream_close(NULL, p);
+	if (!value_load_lazily(&term, value_symbol_get_token(binfile))) {
+		report(r, REPORT_ERROR, "Could not load '%s'",
+		    value_symbol_get_token(binfile));
+		value_copy(&term, &VNULL);
+	}
 
 	/*
 	 * Write out.
@@ -5,6 +5,15 @@
 
 #include "lib.h"
 
+#ifdef THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef STANDALONE
+#include <time.h>
+#endif
+
 #include "value.h"
 
 #ifdef DEBUG
@@ -20,10 +29,84 @@
 struct structured_value {
 	unsigned char		 admin;		/* ADMIN_ flags */
 	struct structured_value	*next;
+#ifdef HEAP_PROFILE
+	int			 site_pc;	/* allocation site */
+	unsigned int		 site_process;	/* by number */
+#endif
 };
 
 #define	ADMIN_FREE		1	/* on the free list */
 #define	ADMIN_MARKED		2	/* marked, during gc */
+#define	ADMIN_TUPLE		4	/* is a tuple (otherwise a symbol) */
+#define	ADMIN_ARENA		8	/* lives in the compaction arena */
+#define	ADMIN_FORWARDED		16	/* relocated; next is new address */
+#define	ADMIN_SHARED		32	/* lives in the shared heap */
+#define	ADMIN_FROZEN		64	/* may not be changed; also shared */
+#define	ADMIN_LAZY		128	/* a lazy tuple; also frozen */
+
+/*
+ * Statistics on allocation, kept since startup.  Values copied
+ * between heaps count as allocations, too.  Each heap counts its
+ * own, so that threads allocating into different heaps never contend
+ * for them; a freed heap's counts are added to retired_allocation.
+ */
+struct allocation {
+	unsigned long		 objects;
+	unsigned long		 bytes;
+	unsigned long		 tuples;
+	unsigned long		 symbols;
+	unsigned long		 dict_layers;
+};
+
+/*
+ * A heap is a set of structured values which are collected together.
+ * Each VM process has its own heap, and there is one shared heap,
+ * which holds whatever is allocated outside of any process (such as
+ * loaded code) along with large symbols.  Values in the shared heap
+ * never refer to values in a process's heap, and no process's heap
+ * refers to values in another's; so a process's heap can be collected
+ * using only that process's roots.
+ */
+struct heap {
+	struct structured_value	*sv_head;	/* list of all values */
+	unsigned char		 admin;		/* ADMIN_ bits of all values */
+
+	/*
+	 * Accounting used to decide when a collection is worthwhile:
+	 * bytes held by all structured values which have not yet been
+	 * swept, and bytes allocated since the last collection.
+	 */
+	unsigned long		 bytes;
+	unsigned long		 objects;
+	unsigned long		 bytes_since;
+	unsigned long		 trigger;
+	unsigned long		 min_trigger;
+
+	/*
+	 * The compaction arena.  There is at most one per heap; each
+	 * compaction moves every live structured value into a fresh
+	 * arena and frees the old one.  Dead objects inside the arena
+	 * are not freed individually, but their space is counted in
+	 * arena_dead.
+	 */
+	char			*arena;
+	unsigned long		 arena_size;
+	unsigned long		 arena_dead;
+
+	struct allocation	 allocated;
+
+	struct heap		*prev;		/* list of process heaps */
+	struct heap		*next;
+};
+
+#define SHARED_MIN_TRIGGER	(1024 * 1024)
+#define LOCAL_MIN_TRIGGER	(256 * 1024)
+
+/*
+ * Symbols at least this long are allocated in the shared heap, so
+ * that they are never copied when sent between processes.
+ */
+#define SHARED_SYMBOL_MIN	256
 
 struct value VNULL = { VALUE_NULL, { 0 } };
 
@@ -52,10 +135,56 @@ const char *type_name_table[] = {
 };
 #endif
 
+static struct heap shared_heap = {
+	NULL, ADMIN_SHARED, 0, 0, 0,
+	SHARED_MIN_TRIGGER, SHARED_MIN_TRIGGER,
+	NULL, 0, 0, { 0, 0, 0, 0, 0 }, NULL, NULL
+};
+static struct heap *local_heaps = NULL;
+static struct allocation retired_allocation = { 0, 0, 0, 0, 0 };
+
+/*
+ * The heap into which new structured values are allocated (by this
+ * thread, if there are several.)
+ */
+static THREAD_LOCAL struct heap *current_heap = &shared_heap;
+
+#ifdef HEAP_PROFILE
+/*
+ * The allocation site recorded in every structured value allocated.
+ */
+static THREAD_LOCAL unsigned int site_process = 0;
+static THREAD_LOCAL int site_pc = SITE_NATIVE;
+#endif
+
 /*
- * List of structured values; used for sweep phase of GC.
+ * With several threads, the shared heap is guarded by shared_lock,
+ * and the list of local heaps by heaps_lock.  Every other heap
+ * belongs to one thread at a time, and each thread may collect its
+ * own heap while others collect theirs, so long as it holds
+ * collect_lock for reading; whatever looks at every heap (a full
+ * collection, the statistics, the heap profile) holds it for writing.
+ * stats_lock guards the statistics on collections.
  */
-static struct structured_value *sv_head = NULL;
+#ifdef THREADS
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t collect_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t freeze_lock = PTHREAD_MUTEX_INITIALIZER;
+#define	LOCK(m)		pthread_mutex_lock(&(m))
+#define	UNLOCK(m)	pthread_mutex_unlock(&(m))
+#define	RDLOCK(m)	pthread_rwlock_rdlock(&(m))
+#define	WRLOCK(m)	pthread_rwlock_wrlock(&(m))
+#define	RWUNLOCK(m)	pthread_rwlock_unlock(&(m))
+#else
+#define	LOCK(m)		do { } while (0)
+#define	UNLOCK(m)	do { } while (0)
+#define	RDLOCK(m)	do { } while (0)
+#define	WRLOCK(m)	do { } while (0)
+#define	RWUNLOCK(m)	do { } while (0)
+#endif
 
 /*** unstructured values ***/
 
@@ -91,14 +220,33 @@ value_label_set(struct value *v, clabel l)
 
 /*
  * Initialize a structured value by link it up into the
- * garbage-collection list.
+ * garbage-collection list of the given heap.
  */
 static void
-structured_value_init(struct structured_value *sv)
+structured_value_init(struct heap *h, struct structured_value *sv,
+		      unsigned char kind, unsigned int bytes)
 {
-	sv->admin = 0;
-	sv->next = sv_head;
-	sv_head = sv;
+	if (h == &shared_heap)
+		LOCK(shared_lock);
+	sv->admin = kind | h->admin;
+	sv->next = h->sv_head;
+	h->sv_head = sv;
+#ifdef HEAP_PROFILE
+	sv->site_pc = site_pc;
+	sv->site_process = site_process;
+#endif
+	h->objects++;
+	h->bytes += bytes;
+	h->bytes_since += bytes;
+
+	h->allocated.objects++;
+	h->allocated.bytes += bytes;
+	if (kind & ADMIN_TUPLE)
+		h->allocated.tuples++;
+	else
+		h->allocated.symbols++;
+	if (h == &shared_heap)
+		UNLOCK(shared_lock);
 }
 
 /***** symbols *****/
@@ -119,7 +267,7 @@ value_symbol_new(struct value *v, const char *token, unsigned int len)
 	buffer = value_symbol_new_buffer(v, len);
 	if (buffer == NULL)
 		return 0;
-	strncpy(buffer, token, len);
+	memcpy(buffer, token, len);
 
 	return 1;
 }
@@ -139,7 +287,9 @@ value_symbol_new_buffer(struct value *v, unsigned int len)
 
 	v->type = VALUE_SYMBOL;
 	v->value.structured = (struct structured_value *)sym;
-	structured_value_init((struct structured_value *)sym);
+	structured_value_init(len >= SHARED_SYMBOL_MIN ?
+	    &shared_heap : current_heap, (struct structured_value *)sym, 0,
+	    sizeof(struct symbol) + len + 1);
 
 	return (char *)(sym + 1);
 }
@@ -177,8 +327,26 @@ struct tuple {
 	struct value		tag;
 	unsigned int		size;	/* in # of values contained */
 	/* struct value		vector[]; */
+	/* struct lazy		lazy; */	/* if ADMIN_LAZY */
+};
+
+/*
+ * A lazy tuple is followed by the source of its elements, and a bit
+ * for each element, set once that element has been loaded.  Until
+ * then, the element is null.
+ */
+struct lazy {
+	struct lazy_source	*source;
+	unsigned long		 where;
+	/* unsigned char	 loaded[]; */
 };
 
+#define	LAZY_OF(t) \
+	((struct lazy *)((struct value *)((t) + 1) + (t)->size))
+#define	LAZY_LOADED(l)	((unsigned char *)((l) + 1))
+#define	LAZY_BYTES(size) \
+	(sizeof(struct lazy) + ((size) + 7) / 8)
+
 int
 value_tuple_new(struct value *v, struct value *tag, unsigned int size)
 {
@@ -196,11 +364,51 @@ value_tuple_new(struct value *v, struct value *tag, unsigned int size)
 
 	v->type = VALUE_TUPLE;
 	v->value.structured = (struct structured_value *)tuple;
-	structured_value_init((struct structured_value *)tuple);
+	structured_value_init(current_heap, (struct structured_value *)tuple,
+	    ADMIN_TUPLE, bytes);
+
+	return 1;
+}
+
+int
+value_tuple_new_lazy(struct value *v, struct value *tag, unsigned int size,
+		     struct lazy_source *source, unsigned long where)
+{
+	struct tuple *tuple;
+	struct lazy *lazy;
+
+	unsigned int bytes = sizeof(struct tuple) +
+			     sizeof(struct value) * size + LAZY_BYTES(size);
+
+	if ((tuple = malloc(bytes)) == NULL)
+		return 0;
+
+	memset(tuple, 0, bytes);
+	if (!value_freeze(&tuple->tag, tag)) {
+		free(tuple);
+		return 0;
+	}
+	tuple->size = size;
+	lazy = LAZY_OF(tuple);
+	lazy->source = source;
+	lazy->where = where;
+	ATOMIC_INC(source->refs);
+
+	v->type = VALUE_TUPLE;
+	v->value.structured = (struct structured_value *)tuple;
+	structured_value_init(&shared_heap, (struct structured_value *)tuple,
+	    ADMIN_TUPLE | ADMIN_LAZY | ADMIN_FROZEN, bytes);
 
 	return 1;
 }
 
+void
+value_lazy_release(struct lazy_source *source)
+{
+	if (ATOMIC_DEC(source->refs) == 0)
+		source->release(source);
+}
+
 int
 value_is_tuple(const struct value *v)
 {
@@ -229,49 +437,110 @@ value_tuple_get_size(const struct value *v)
 	return t->size;
 }
 
+/*
+ * Load the element of the lazy tuple.  Its elements are loaded into
+ * the shared heap, where it is, and frozen, as it is.  Loading is not
+ * done under the lock, since it may fetch from other lazy tuples; if
+ * two threads load the same element at once, the first to finish wins.
+ * An element which cannot be loaded (the image is damaged, or memory
+ * is short) is left null.
+ */
+static void
+lazy_resolve(struct tuple *t, unsigned int at)
+{
+	struct lazy *l = LAZY_OF(t);
+	struct heap *heap = current_heap;
+	struct value v;
+
+	current_heap = &shared_heap;
+	if (!l->source->load(l->source, l->where, at, &v) ||
+	    !value_freeze(&v, &v))
+		value_copy(&v, &VNULL);
+	current_heap = heap;
+
+	LOCK(lazy_lock);
+	if (!(LAZY_LOADED(l)[at / 8] & (1 << (at % 8)))) {
+		value_copy((struct value *)(t + 1) + at, &v);
+		ATOMIC_WRITE(LAZY_LOADED(l)[at / 8],
+		    LAZY_LOADED(l)[at / 8] | (1 << (at % 8)));
+	}
+	UNLOCK(lazy_lock);
+}
+
 struct value *
 value_tuple_fetch(const struct value *v, unsigned int at)
 {
 	struct tuple *t = value_get_tuple(v);
 	assert(at < t->size);
+	if ((t->sv.admin & ADMIN_LAZY) &&
+	    !(ATOMIC_READ(LAZY_LOADED(LAZY_OF(t))[at / 8]) & (1 << (at % 8))))
+		lazy_resolve(t, at);
 	return (struct value *)(t + 1) + at;
 }
 
-void
+static int heap_copy(struct heap *, struct value *, const struct value *);
+
+/*
+ * A frozen tuple may not be stored into at all; nothing is stored
+ * into one.  Processes can reach no shared tuple which is not frozen
+ * (literals in the code are frozen when it is loaded), but the runtime
+ * can make one, and a shared tuple may not refer into a process's
+ * heap; so storing a process's structured value into one promotes
+ * (copies) that value into the shared heap first.  If there is not
+ * enough memory for the copy, nothing is stored, since the original
+ * could be freed by the next collection of its heap while the shared
+ * tuple still referred to it.
+ */
+int
 value_tuple_store(struct value *v, unsigned int at, const struct value *src)
 {
-	struct value *dst = value_tuple_fetch(v, at);
+	struct value *dst;
+	struct value copy;
 
+	if (ATOMIC_READ(v->value.structured->admin) & ADMIN_FROZEN)
+		return 0;
+	if ((v->value.structured->admin & ADMIN_SHARED) &&
+	    (src->type & VALUE_STRUCTURED) &&
+	    !(src->value.structured->admin & ADMIN_SHARED)) {
+		if (!heap_copy(&shared_heap, &copy, src))
+			return 0;
+		src = &copy;
+	}
+	dst = value_tuple_fetch(v, at);
 	value_copy(dst, src);
+	return 1;
 }
 
 int
 value_tuple_fetch_integer(const struct value *v, unsigned int at)
 {
-	struct tuple *t = value_get_tuple(v);
-	assert(at < t->size);
-	assert(((struct value *)(t + 1) + at)->type == VALUE_INTEGER);
-	return ((struct value *)(t + 1) + at)->value.integer;
+	struct value *e = value_tuple_fetch(v, at);
+	assert(e->type == VALUE_INTEGER);
+	return e->value.integer;
 }
 
 clabel
 value_tuple_fetch_label(const struct value *v, unsigned int at)
 {
-	struct tuple *t = value_get_tuple(v);
-	assert(at < t->size);
-	assert(((struct value *)(t + 1) + at)->type == VALUE_LABEL);
-	return ((struct value *)(t + 1) + at)->value.label;
+	struct value *e = value_tuple_fetch(v, at);
+	assert(e->type == VALUE_LABEL);
+	return e->value.label;
 }
 
 /*
  * Convenience method to directly store an integer in a tuple.
+ * Returns false, storing nothing, if the tuple is frozen.
  */
-void
+int
 value_tuple_store_integer(struct value *v, unsigned int at, int src)
 {
-	struct value *dst = value_tuple_fetch(v, at);
+	struct value *dst;
 
+	if (ATOMIC_READ(v->value.structured->admin) & ADMIN_FROZEN)
+		return 0;
+	dst = value_tuple_fetch(v, at);
 	value_integer_set(dst, src);
+	return 1;
 }
 
 /*** ACCESSORS ***/
@@ -417,7 +686,7 @@ value_ar_xfer(struct value *from, struct value *to, int count)
 /*
  * Compute the hash value of the given value.
  */
-static unsigned int
+unsigned int
 value_hash(const struct value *v)
 {
 	switch (v->type) {
@@ -460,6 +729,11 @@ value_dict_new(struct value *table, unsigned int layer_size)
 			     layer_size + LAYER_HEADER_SIZE)) {
 		return 0;
 	}
+	if (current_heap == &shared_heap)
+		LOCK(shared_lock);
+	current_heap->allocated.dict_layers++;
+	if (current_heap == &shared_heap)
+		UNLOCK(shared_lock);
 
 	value_tuple_store_integer(table, LAYER_USAGE, 0);
 	value_tuple_store(table, LAYER_NEXT, &VNULL);
@@ -497,7 +771,7 @@ value_dict_fetch(const struct value *dict, const struct value *key)
 	return value_fetch_hash(dict, key, value_hash);
 }
 
-static void
+static int
 value_store_hash(struct value *dict, struct value *key, struct value *value,
 		 unsigned int (*hash_fn)(const struct value *))
 {
@@ -512,6 +786,10 @@ value_store_hash(struct value *dict, struct value *key, struct value *value,
 
 	slot += LAYER_HEADER_SIZE; /* skip over administrivia in tuple */
 
+	/* Every layer of a frozen dictionary is frozen with it. */
+	if (value_is_frozen(dict))
+		return 0;
+
 	for (;;) {
 		struct value *v = value_tuple_fetch(layer, slot);
 		if (value_is_null(v)) {
@@ -551,8 +829,13 @@ value_store_hash(struct value *dict, struct value *key, struct value *value,
 		}
 	}
 
-	value_tuple_store(layer, slot, key);
-	value_tuple_store(layer, slot + 1, value);
+	/*
+	 * The value goes in first, so that if it cannot (for want of
+	 * memory to copy it into a shared dictionary) nothing has.
+	 */
+	if (!value_tuple_store(layer, slot + 1, value) ||
+	    !value_tuple_store(layer, slot, key))
+		return 0;
 
 	if (delta != 0) {
 		usage = value_tuple_fetch_integer(layer, LAYER_USAGE);
@@ -571,13 +854,35 @@ value_store_hash(struct value *dict, struct value *key, struct value *value,
 			value_tuple_store_integer(layer, LAYER_USAGE, usage);
 		}
 	}
+
+	return 1;
 }
 
-void
+/*
+ * Returns false if the dictionary is frozen, or if it is shared and a
+ * copy of the key or value could not be made for it; in either case
+ * the key is not stored.
+ */
+int
 value_dict_store(struct value *dict, struct value *key, struct value *value)
 {
 	assert(value_is_tuple(dict));
-	value_store_hash(dict, key, value, value_hash);
+	return value_store_hash(dict, key, value, value_hash);
+}
+
+/*
+ * Convenience method to associate an integer with a symbol key, as
+ * statistics do.
+ */
+int
+value_dict_store_integer(struct value *dict, const char *name, int n)
+{
+	struct value key, val;
+
+	if (!value_symbol_new(&key, name, strlen(name)))
+		return 0;
+	value_integer_set(&val, n);
+	return value_dict_store(dict, &key, &val);
 }
 
 unsigned int
@@ -818,6 +1123,10 @@ enum comparison
 value_compare(const struct value *a, const struct value *b)
 {
 	struct value d;
+
+	/* Only tuples can be cyclic; don't allocate for anything else. */
+	if (a->type != VALUE_TUPLE || b->type != VALUE_TUPLE)
+		return value_compare_nodups(a, b, &VNULL);
 	value_dict_new(&d, 31);
 	return value_compare_nodups(a, b, &d);
 }
@@ -835,57 +1144,170 @@ value_equal(const struct value *a, const struct value *b)
  * a real meat-and-potatoes mark-and-sweep.
  *
  * This is not particularly sophisticated; I'm more concerned with
- * correctness than performance here.
+ * correctness than performance here.  The one concession is an
+ * optional compacting mode, for long-running VMs whose structured
+ * values have become scattered all over the C heap.
+ */
+
+/*
+ * All objects in the arena are allocated on this boundary.
+ */
+#define ARENA_ALIGN(n) \
+	(((n) + sizeof(void *) - 1) & ~((unsigned long)sizeof(void *) - 1))
+
+static unsigned int gc_threads = 1;
+static unsigned int compact_threshold = 0;	/* percent; 0 = off */
+static unsigned long compact_min_bytes = 64 * 1024;
+static unsigned int gc_fragmentation = 0;	/* as of last collection */
+
+/*
+ * ADMIN_ bits of values which this thread's collection leaves alone:
+ * when collecting a single process's heap, the shared heap.
+ */
+static THREAD_LOCAL unsigned char mark_skip = 0;
+
+/*
+ * Statistics on collection, kept since startup, with stats_lock held.
+ */
+static unsigned long local_collections = 0;
+static unsigned long full_collections = 0;
+static unsigned long compactions = 0;
+static unsigned long freed_objects = 0;
+static unsigned long freed_bytes = 0;
+static unsigned long pause_us = 0;		/* total */
+static unsigned long max_pause_us = 0;
+
+/*
+ * Statistics gathered by this thread's mark phase.
+ */
+static THREAD_LOCAL unsigned long mark_objects;
+static THREAD_LOCAL unsigned long mark_bytes;		/* in arena units */
+static THREAD_LOCAL unsigned long mark_scattered_bytes;	/* not in arena */
+static THREAD_LOCAL unsigned long mark_arena_bytes;	/* in arena */
+
+/*
+ * Stack of tuples which have been marked, but whose contents
+ * have not yet been scanned.  Copying between heaps borrows it,
+ * and may happen in several threads at once.
+ */
+static void (*process_marker)(struct process *) = NULL;
+
+static THREAD_LOCAL struct structured_value **mark_stack = NULL;
+static THREAD_LOCAL unsigned int mark_stack_size = 0;
+static THREAD_LOCAL unsigned int mark_stack_top = 0;
+
+static unsigned int
+sv_bytes(const struct structured_value *sv)
+{
+	if (sv->admin & ADMIN_LAZY) {
+		return sizeof(struct tuple) +
+		    sizeof(struct value) * ((const struct tuple *)sv)->size +
+		    LAZY_BYTES(((const struct tuple *)sv)->size);
+	}
+	if (sv->admin & ADMIN_TUPLE) {
+		return sizeof(struct tuple) +
+		    sizeof(struct value) * ((const struct tuple *)sv)->size;
+	}
+	return sizeof(struct symbol) + ((const struct symbol *)sv)->length + 1;
+}
+
+static void
+mark_push(struct structured_value *sv)
+{
+	if (mark_stack_top == mark_stack_size) {
+		mark_stack_size = mark_stack_size == 0 ? 256 : mark_stack_size * 2;
+		mark_stack = realloc(mark_stack,
+		    mark_stack_size * sizeof(struct structured_value *));
+		assert(mark_stack != NULL);
+	}
+	mark_stack[mark_stack_top++] = sv;
+}
+
+/*
+ * Mark a single value, if it is structured and not yet marked.
+ * Tuples are pushed onto the mark stack to have their contents
+ * marked later; this keeps long chains of tuples from exhausting
+ * the C stack.
  */
+static void
+mark_value(struct value *v)
+{
+	struct structured_value *sv;
+	unsigned int bytes;
+
+	if (!(v->type & VALUE_STRUCTURED)) {
+		if (v->type == VALUE_PROCESS && process_marker != NULL)
+			process_marker(v->value.process);
+		return;
+	}
+	sv = v->value.structured;
+	if (sv->admin & (ADMIN_MARKED | mark_skip))
+		return;
+	sv->admin |= ADMIN_MARKED;
+
+	bytes = sv_bytes(sv);
+	mark_objects++;
+	mark_bytes += ARENA_ALIGN(bytes);
+	if (sv->admin & ADMIN_ARENA)
+		mark_arena_bytes += bytes;
+	else
+		mark_scattered_bytes += bytes;
+
+	if (sv->admin & ADMIN_TUPLE)
+		mark_push(sv);
+}
 
 static void
-mark_tuple(struct value *v)
+mark_drain(void)
 {
-	struct value *k;
+	struct tuple *t;
+	struct value *slots;
 	unsigned int i;
 
-	assert(value_is_tuple(v));
-	for (i = 0; i < value_tuple_get_size(v); i++) {
-		k = value_tuple_fetch(v, i);
-		/*
-		 * If the contained value is also structured,
-		 * and it hasn't been marked yet, mark it too.
-		 */
-		if (k->type & VALUE_STRUCTURED) {
-			struct structured_value *sv = k->value.structured;
-			if (k->type == VALUE_TUPLE &&
-			    (!(sv->admin & ADMIN_MARKED))) {
-				/*
-				 * It can contain other values and
-				 * it hasn't been marked yet, so
-				 * recursively mark its contents.
-				 */
-				mark_tuple(k);
-			} else {
-				sv->admin |= ADMIN_MARKED;
-			}
-		}
+	while (mark_stack_top > 0) {
+		t = (struct tuple *)mark_stack[--mark_stack_top];
+		mark_value(&t->tag);
+		slots = (struct value *)(t + 1);
+		for (i = 0; i < t->size; i++)
+			mark_value(&slots[i]);
 	}
 }
 
+static void
+mark_roots(value_walker walker)
+{
+	mark_objects = 0;
+	mark_bytes = 0;
+	mark_scattered_bytes = 0;
+	mark_arena_bytes = 0;
+
+	walker(mark_value);
+	mark_drain();
+}
+
 /*
- * Public interface to garbage collector.
+ * Free a dead structured value which is not in an arena.  A lazy
+ * tuple lets go of its source, too.
  */
+static void
+free_sv(struct structured_value *sv)
+{
+	if (sv->admin & ADMIN_LAZY)
+		value_lazy_release(LAZY_OF((struct tuple *)sv)->source);
+	free(sv);
+}
 
-void
-value_gc(struct value *root)
+/*
+ * Free every unmarked structured value in the heap, and clear the
+ * mark on the remainder.
+ */
+static void
+sweep(struct heap *h)
 {
 	struct structured_value *sv, *sv_next, *temp_sv_head = NULL;
+	unsigned int bytes;
 
-	/*
-	 * Mark...
-	 */
-	mark_tuple(root);
-
-	/*
-	 * ...and sweep
-	 */
-	for (sv = sv_head; sv != NULL; sv = sv_next) {
+	for (sv = h->sv_head; sv != NULL; sv = sv_next) {
 		sv_next = sv->next;
 		if (sv->admin & ADMIN_MARKED) {
 			sv->admin &= ~ADMIN_MARKED;
@@ -897,10 +1319,1548 @@ value_gc(struct value *root)
 			 * Not much special knowledge is required to
 			 * free a structured value block, so we just
 			 * (un-abstractedly) inline the process here.
+			 * Those in the arena are reclaimed only when
+			 * the whole arena is.
 			 */
-			free(sv);
+			bytes = sv_bytes(sv);
+			h->bytes -= bytes;
+			h->objects--;
+			if (sv->admin & ADMIN_ARENA)
+				h->arena_dead += bytes;
+			else
+				free_sv(sv);
+		}
+	}
+
+	h->sv_head = temp_sv_head;
+}
+
+#ifdef THREADS
+
+/*
+ * Parallel marking and sweeping.
+ *
+ * Each marking thread keeps a private stack of tuples to scan.  When
+ * that grows deep, the older half is published to the thread's deque,
+ * from which idle threads may steal.  Roots are handed out from a
+ * shared index, so no thread is stuck with all of a lopsided root set.
+ * Mark bits are set atomically; all other admin bits are left alone
+ * while marking, so this is the only contended write.
+ *
+ * The collecting thread is worker 0.  The others are threads which
+ * are started the first time they are needed, and then wait between
+ * collections for more work.  Heaps too small to be worth waking
+ * them for are collected by the collecting thread alone.
+ */
+
+#define MARK_PUBLISH	64	/* private stack depth at which to share */
+#define PMARK_MIN	8192	/* fewest values worth marking in parallel */
+#define PSWEEP_MIN	4096	/* fewest values per worker worth sweeping */
+
+struct mark_worker {
+	pthread_t			 thread;
+	unsigned int			 id;
+	int				 started;	/* thread is running */
+	unsigned long			 generation;	/* of work seen */
+	unsigned char			 skip;		/* mark_skip */
+
+	struct structured_value		**stack;	/* private */
+	unsigned int			 stack_top;
+	unsigned int			 stack_size;
+
+	pthread_mutex_t			 lock;		/* guards deque */
+	struct structured_value		**deque;
+	unsigned int			 deque_bot;
+	unsigned int			 deque_top;
+	unsigned int			 deque_size;
+	unsigned int			 deque_count;	/* read unlocked */
+
+	unsigned long			 objects;
+	unsigned long			 bytes;
+	unsigned long			 scattered_bytes;
+	unsigned long			 arena_bytes;
+
+	struct structured_value		*segment;	/* to sweep */
+	unsigned long			 segment_length;
+	struct structured_value		*survivors;
+	struct structured_value		*survivors_tail;
+	unsigned long			 freed_objects;
+	unsigned long			 freed_bytes;
+	unsigned long			 dead_arena_bytes;
+};
+
+/*
+ * Only one collection at a time may use the marking threads; another
+ * which finds them busy (with pool_lock taken) marks on its own.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct mark_worker *workers = NULL;
+static unsigned int num_workers = 0;
+
+/*
+ * Handing work to the waiting threads: each new piece of work is a
+ * new pool_generation, with pool_fn to run (or NULL, telling them to
+ * exit), and pool_pending counts the threads yet to finish it.
+ */
+static pthread_mutex_t pool_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long pool_generation = 0;
+static unsigned int pool_started = 0;
+static unsigned int pool_pending;
+static void *(*pool_fn)(void *);
+static unsigned int running_workers;
+static unsigned int idle_workers;
+
+static struct value **roots = NULL;
+static unsigned long roots_size = 0;
+static unsigned long num_roots;
+static unsigned long next_root;
+
+static void
+collect_root(struct value *v)
+{
+	if (num_roots == roots_size) {
+		roots_size = roots_size == 0 ? 64 : roots_size * 2;
+		roots = realloc(roots, roots_size * sizeof(struct value *));
+		assert(roots != NULL);
+	}
+	roots[num_roots++] = v;
+}
+
+static void
+pmark_push(struct mark_worker *w, struct structured_value *sv)
+{
+	unsigned int i, half;
+
+	if (w->stack_top == w->stack_size) {
+		w->stack_size = w->stack_size == 0 ? 256 : w->stack_size * 2;
+		w->stack = realloc(w->stack,
+		    w->stack_size * sizeof(struct structured_value *));
+		assert(w->stack != NULL);
+	}
+	w->stack[w->stack_top++] = sv;
+
+	if (w->stack_top < 2 * MARK_PUBLISH || ATOMIC_READ(w->deque_count) > 0)
+		return;
+
+	/*
+	 * Our deque has run dry and we have plenty; share the older
+	 * half of our private stack.
+	 */
+	half = w->stack_top / 2;
+	pthread_mutex_lock(&w->lock);
+	if (w->deque_top + half > w->deque_size) {
+		w->deque_size = w->deque_top + half + 256;
+		w->deque = realloc(w->deque,
+		    w->deque_size * sizeof(struct structured_value *));
+		assert(w->deque != NULL);
+	}
+	for (i = 0; i < half; i++)
+		w->deque[w->deque_top++] = w->stack[i];
+	__sync_add_and_fetch(&w->deque_count, half);
+	pthread_mutex_unlock(&w->lock);
+	for (i = half; i < w->stack_top; i++)
+		w->stack[i - half] = w->stack[i];
+	w->stack_top -= half;
+}
+
+static struct structured_value *
+pmark_pop(struct mark_worker *w)
+{
+	struct structured_value *sv = NULL;
+
+	if (w->stack_top > 0)
+		return w->stack[--w->stack_top];
+
+	if (ATOMIC_READ(w->deque_count) == 0)
+		return NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->deque_top > w->deque_bot) {
+		sv = w->deque[--w->deque_top];
+		__sync_sub_and_fetch(&w->deque_count, 1);
+	}
+	if (w->deque_top == w->deque_bot)
+		w->deque_top = w->deque_bot = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	return sv;
+}
+
+/*
+ * Take half of the oldest work from some other thread's deque.
+ */
+static int
+pmark_steal(struct mark_worker *w)
+{
+	struct mark_worker *victim;
+	unsigned int i, n, count;
+
+	for (i = 1; i < num_workers; i++) {
+		victim = &workers[(w->id + i) % num_workers];
+		if (ATOMIC_READ(victim->deque_count) == 0)
+			continue;
+		pthread_mutex_lock(&victim->lock);
+		count = victim->deque_top - victim->deque_bot;
+		count = (count + 1) / 2;
+		for (n = 0; n < count; n++) {
+			pmark_push(w, victim->deque[victim->deque_bot++]);
 		}
+		__sync_sub_and_fetch(&victim->deque_count, count);
+		if (victim->deque_top == victim->deque_bot)
+			victim->deque_top = victim->deque_bot = 0;
+		pthread_mutex_unlock(&victim->lock);
+		if (count > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+pmark_any_work(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_workers; i++) {
+		if (ATOMIC_READ(workers[i].deque_count) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+pmark_value(struct mark_worker *w, struct value *v)
+{
+	struct structured_value *sv;
+	unsigned int bytes;
+
+	if (!(v->type & VALUE_STRUCTURED)) {
+		if (v->type == VALUE_PROCESS && process_marker != NULL)
+			process_marker(v->value.process);
+		return;
+	}
+	sv = v->value.structured;
+	/*
+	 * The unlocked test is only a shortcut; at worst it sends us
+	 * on to the atomic test, which decides who marks it.
+	 */
+	if (sv->admin & (ADMIN_MARKED | w->skip))
+		return;
+	if (__sync_fetch_and_or(&sv->admin, ADMIN_MARKED) & ADMIN_MARKED)
+		return;
+
+	bytes = sv_bytes(sv);
+	w->objects++;
+	w->bytes += ARENA_ALIGN(bytes);
+	if (sv->admin & ADMIN_ARENA)
+		w->arena_bytes += bytes;
+	else
+		w->scattered_bytes += bytes;
+
+	if (sv->admin & ADMIN_TUPLE)
+		pmark_push(w, sv);
+}
+
+static void
+pmark_drain(struct mark_worker *w)
+{
+	struct structured_value *sv;
+	struct tuple *t;
+	struct value *slots;
+	unsigned int i;
+
+	while ((sv = pmark_pop(w)) != NULL) {
+		t = (struct tuple *)sv;
+		pmark_value(w, &t->tag);
+		slots = (struct value *)(t + 1);
+		for (i = 0; i < t->size; i++)
+			pmark_value(w, &slots[i]);
+	}
+}
+
+static void *
+pmark_run(void *arg)
+{
+	struct mark_worker *w = arg;
+	unsigned long r;
+
+	for (;;) {
+		r = __sync_fetch_and_add(&next_root, 1);
+		if (r >= num_roots)
+			break;
+		pmark_value(w, roots[r]);
+		pmark_drain(w);
 	}
 
-	sv_head = temp_sv_head;
+	for (;;) {
+		pmark_drain(w);
+		if (pmark_steal(w))
+			continue;
+
+		/*
+		 * Nothing to do.  We are finished when every running
+		 * thread is in this state at once.
+		 */
+		__sync_add_and_fetch(&idle_workers, 1);
+		for (;;) {
+			if (ATOMIC_READ(idle_workers) ==
+			    ATOMIC_READ(running_workers))
+				return NULL;
+			if (pmark_any_work()) {
+				__sync_sub_and_fetch(&idle_workers, 1);
+				break;
+			}
+			sched_yield();
+		}
+	}
+}
+
+/*
+ * Sweep one segment of the structured value list, building a list
+ * of the survivors.
+ */
+static void *
+psweep_run(void *arg)
+{
+	struct mark_worker *w = arg;
+	struct structured_value *sv, *sv_next;
+	unsigned long n;
+	unsigned int bytes;
+
+	w->survivors = w->survivors_tail = NULL;
+	w->freed_objects = w->freed_bytes = w->dead_arena_bytes = 0;
+
+	for (sv = w->segment, n = 0; n < w->segment_length; sv = sv_next, n++) {
+		sv_next = sv->next;
+		if (sv->admin & ADMIN_MARKED) {
+			sv->admin &= ~ADMIN_MARKED;
+			sv->next = NULL;
+			if (w->survivors_tail == NULL)
+				w->survivors = sv;
+			else
+				w->survivors_tail->next = sv;
+			w->survivors_tail = sv;
+		} else {
+			bytes = sv_bytes(sv);
+			w->freed_objects++;
+			w->freed_bytes += bytes;
+			if (sv->admin & ADMIN_ARENA)
+				w->dead_arena_bytes += bytes;
+			else
+				free_sv(sv);
+		}
+	}
+
+	return NULL;
+}
+
+static void *
+pool_run(void *arg)
+{
+	struct mark_worker *w = arg;
+	void *(*fn)(void *);
+
+	pthread_mutex_lock(&pool_wait_lock);
+	for (;;) {
+		while (pool_generation == w->generation)
+			pthread_cond_wait(&pool_cond, &pool_wait_lock);
+		w->generation = pool_generation;
+		if ((fn = pool_fn) == NULL)
+			break;
+		pthread_mutex_unlock(&pool_wait_lock);
+		fn(w);
+		pthread_mutex_lock(&pool_wait_lock);
+		if (--pool_pending == 0)
+			pthread_cond_signal(&pool_done_cond);
+	}
+	pthread_mutex_unlock(&pool_wait_lock);
+	return NULL;
+}
+
+/*
+ * Run the given function on every worker, the calling thread being
+ * worker 0, and wait for them all to finish.  A worker whose thread
+ * could not be started has its share done by the calling thread
+ * afterwards when share_alone is set; otherwise it is simply left out
+ * (its work will be stolen or handed out elsewhere.)
+ */
+static void
+run_workers(void *(*fn)(void *), int share_alone)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool_wait_lock);
+	running_workers = 1 + pool_started;
+	pool_pending = pool_started;
+	pool_fn = fn;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_wait_lock);
+
+	fn(&workers[0]);
+
+	pthread_mutex_lock(&pool_wait_lock);
+	while (pool_pending > 0)
+		pthread_cond_wait(&pool_done_cond, &pool_wait_lock);
+	pthread_mutex_unlock(&pool_wait_lock);
+
+	for (i = 1; share_alone && i < num_workers; i++) {
+		if (!workers[i].started)
+			fn(&workers[i]);
+	}
+}
+
+/*
+ * Tell the threads to exit, and wait until they have.
+ */
+static void
+pool_stop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool_wait_lock);
+	pool_fn = NULL;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_wait_lock);
+	for (i = 1; i < num_workers; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+	pool_started = 0;
+}
+
+/*
+ * Make gc_threads workers, starting threads for all but the first,
+ * unless they are already there.
+ */
+static void
+workers_init(void)
+{
+	unsigned int i;
+
+	if (num_workers == gc_threads)
+		return;
+	pool_stop();
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_destroy(&workers[i].lock);
+		free(workers[i].stack);
+		free(workers[i].deque);
+	}
+	num_workers = gc_threads;
+	workers = realloc(workers, num_workers * sizeof(struct mark_worker));
+	assert(workers != NULL);
+	memset(workers, 0, num_workers * sizeof(struct mark_worker));
+	for (i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		workers[i].generation = pool_generation;
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	for (i = 1; i < num_workers; i++) {
+		workers[i].started = pthread_create(&workers[i].thread, NULL,
+		    pool_run, &workers[i]) == 0;
+		if (workers[i].started)
+			pool_started++;
+	}
+}
+
+static void
+pmark_roots(value_walker walker)
+{
+	unsigned int i;
+
+	workers_init();
+	num_roots = 0;
+	walker(collect_root);
+	next_root = 0;
+	idle_workers = 0;
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].skip = mark_skip;
+		workers[i].objects = workers[i].bytes = 0;
+		workers[i].scattered_bytes = workers[i].arena_bytes = 0;
+	}
+
+	run_workers(pmark_run, 0);
+
+	mark_objects = 0;
+	mark_bytes = 0;
+	mark_scattered_bytes = 0;
+	mark_arena_bytes = 0;
+	for (i = 0; i < num_workers; i++) {
+		mark_objects += workers[i].objects;
+		mark_bytes += workers[i].bytes;
+		mark_scattered_bytes += workers[i].scattered_bytes;
+		mark_arena_bytes += workers[i].arena_bytes;
+	}
+}
+
+/*
+ * Cut the heap's structured value list into one segment per worker,
+ * sweep the segments in parallel, then splice the survivors back
+ * together.  Heaps too small to be worth the threads are swept here.
+ */
+static void
+psweep(struct heap *h)
+{
+	struct structured_value *sv = h->sv_head, *tail = NULL;
+	unsigned long length = h->objects / num_workers + 1;
+	unsigned long n;
+	unsigned int i;
+
+	if (length < PSWEEP_MIN) {
+		sweep(h);
+		return;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].segment = sv;
+		for (n = 0; n < length && sv != NULL; n++)
+			sv = sv->next;
+		workers[i].segment_length = n;
+	}
+	assert(sv == NULL);
+
+	run_workers(psweep_run, 1);
+
+	h->sv_head = NULL;
+	for (i = 0; i < num_workers; i++) {
+		h->objects -= workers[i].freed_objects;
+		h->bytes -= workers[i].freed_bytes;
+		h->arena_dead += workers[i].dead_arena_bytes;
+		if (workers[i].survivors == NULL)
+			continue;
+		if (tail == NULL)
+			h->sv_head = workers[i].survivors;
+		else
+			tail->next = workers[i].survivors;
+		tail = workers[i].survivors_tail;
+	}
+}
+
+#endif /* THREADS */
+
+/*
+ * Mark everything reachable from the walker's roots, given how many
+ * values the heaps being collected hold: in parallel, if there are
+ * threads for it and enough values to be worth it, and no other
+ * collection is using the threads, in which case this returns true,
+ * and the caller sweeps in parallel too (with psweep()) before letting
+ * them go with pool_release().
+ */
+static int
+mark_all(value_walker walker, unsigned long objects)
+{
+#ifdef THREADS
+	if (gc_threads > 1 && objects >= PMARK_MIN &&
+	    pthread_mutex_trylock(&pool_lock) == 0) {
+		pmark_roots(walker);
+		return 1;
+	}
+#endif
+	(void)objects;
+	mark_roots(walker);
+	return 0;
+}
+
+static void
+sweep_heap(struct heap *h, int parallel)
+{
+#ifdef THREADS
+	if (parallel) {
+		psweep(h);
+		return;
+	}
+#endif
+	(void)parallel;
+	sweep(h);
+}
+
+static void
+pool_release(int parallel)
+{
+#ifdef THREADS
+	if (parallel)
+		pthread_mutex_unlock(&pool_lock);
+#endif
+	(void)parallel;
+}
+
+/*
+ * Fragmentation of a heap, as a percentage: how much of the memory
+ * it holds is either scattered in individual blocks, or is dead
+ * space inside its arena.  Only meaningful right after marking.
+ */
+static unsigned int
+fragmentation(const struct heap *h)
+{
+	unsigned long held = mark_scattered_bytes + h->arena_size;
+	unsigned long wasted = mark_scattered_bytes +
+			       (h->arena_size - mark_arena_bytes);
+
+	if (held == 0)
+		return 0;
+	return (unsigned int)((wasted * 100) / held);
+}
+
+/*
+ * State of this thread's compaction in progress.
+ */
+static THREAD_LOCAL struct heap *to_heap;
+static THREAD_LOCAL char *to_space;
+static THREAD_LOCAL unsigned long to_used;
+static THREAD_LOCAL struct structured_value *to_tail;
+
+/*
+ * Copy the structured value referred to by v into to-space, if
+ * it has not already been, and update v to refer to the copy.
+ */
+static void
+relocate_value(struct value *v)
+{
+	struct structured_value *sv, *nsv;
+	unsigned int bytes;
+
+	if (!(v->type & VALUE_STRUCTURED))
+		return;
+	sv = v->value.structured;
+	if (sv->admin & mark_skip)
+		return;
+	if (!(sv->admin & ADMIN_FORWARDED)) {
+		assert(sv->admin & ADMIN_MARKED);
+		bytes = sv_bytes(sv);
+		nsv = (struct structured_value *)(to_space + to_used);
+		to_used += ARENA_ALIGN(bytes);
+		memcpy(nsv, sv, bytes);
+		nsv->admin = (sv->admin & ~ADMIN_MARKED) | ADMIN_ARENA;
+		nsv->next = NULL;
+		if (to_tail == NULL)
+			to_heap->sv_head = nsv;
+		else
+			to_tail->next = nsv;
+		to_tail = nsv;
+
+		sv->admin |= ADMIN_FORWARDED;
+		sv->next = nsv;
+	}
+	v->value.structured = sv->next;
+}
+
+/*
+ * Relocate all marked structured values in the heap into a new
+ * arena, in breadth-first (Cheney) order, so that tuples end up
+ * near the tuples they refer to.  Unmarked values are freed as in
+ * sweep().  Only the values in this heap may be reachable from the
+ * roots, other than those skipped by the collection.
+ */
+static void
+compact(struct heap *h, value_walker walker)
+{
+	struct structured_value **old;
+	struct structured_value *sv, *sv_next;
+	unsigned long n = 0, scan;
+	struct tuple *t;
+	struct value *slots;
+	unsigned int i;
+
+	old = malloc(sizeof(struct structured_value *) * (mark_objects + 1));
+	to_space = malloc(mark_bytes + 1);
+	if (old == NULL || to_space == NULL) {
+		/* Not enough memory to compact; an ordinary sweep will do. */
+		free(old);
+		free(to_space);
+		sweep(h);
+		return;
+	}
+
+	/*
+	 * Free the dead, and remember the living (whose 'next'
+	 * links are about to be used as forwarding addresses.)
+	 */
+	for (sv = h->sv_head; sv != NULL; sv = sv_next) {
+		sv_next = sv->next;
+		if (sv->admin & ADMIN_MARKED) {
+			old[n++] = sv;
+		} else if (!(sv->admin & ADMIN_ARENA)) {
+			free(sv);
+		}
+	}
+	assert(n == mark_objects);
+
+	h->sv_head = NULL;
+	to_heap = h;
+	to_used = 0;
+	to_tail = NULL;
+
+	walker(relocate_value);
+	for (scan = 0; scan < to_used; ) {
+		sv = (struct structured_value *)(to_space + scan);
+		if (sv->admin & ADMIN_TUPLE) {
+			t = (struct tuple *)sv;
+			relocate_value(&t->tag);
+			slots = (struct value *)(t + 1);
+			for (i = 0; i < t->size; i++)
+				relocate_value(&slots[i]);
+		}
+		scan += ARENA_ALIGN(sv_bytes(sv));
+	}
+	assert(to_used == mark_bytes);
+
+	while (n > 0) {
+		sv = old[--n];
+		if (!(sv->admin & ADMIN_ARENA))
+			free(sv);
+	}
+	free(old);
+	free(h->arena);
+
+	h->arena = to_space;
+	h->arena_size = mark_bytes;
+	h->arena_dead = 0;
+	h->bytes = mark_scattered_bytes + mark_arena_bytes;
+	h->objects = mark_objects;
+}
+
+/*
+ * Let the heap grow to about twice its live size before
+ * collecting it again.
+ */
+static void
+reset_trigger(struct heap *h)
+{
+	h->bytes_since = 0;
+	h->trigger = h->bytes > h->min_trigger ? h->bytes : h->min_trigger;
+}
+
+/*
+ * Copying values between heaps.  Each value copied is forwarded to
+ * its copy (just as during compaction) so that shared structure and
+ * cycles are preserved; the forwarding is undone once the copy is
+ * complete.  Values in the shared heap are never copied.  Copies
+ * made when freezing are marked with copy_admin, and when freezing,
+ * values in the shared heap are frozen where they are instead.
+ */
+struct forwarding {
+	struct structured_value	*sv;
+	struct structured_value	*next;
+};
+
+static THREAD_LOCAL struct forwarding *forwarded = NULL;
+static THREAD_LOCAL unsigned long forwarded_size = 0;
+static THREAD_LOCAL unsigned long forwarded_top = 0;
+static THREAD_LOCAL unsigned char copy_admin = 0;
+
+static int
+copy_value(struct heap *h, struct value *v)
+{
+	struct structured_value *sv, *nsv;
+	unsigned int bytes;
+
+	if (!(v->type & VALUE_STRUCTURED))
+		return 1;
+	sv = v->value.structured;
+	if (sv->admin & ADMIN_SHARED) {
+		if ((copy_admin & ADMIN_FROZEN) &&
+		    !(sv->admin & ADMIN_FROZEN)) {
+			ATOMIC_WRITE(sv->admin, sv->admin | ADMIN_FROZEN);
+			if (sv->admin & ADMIN_TUPLE)
+				mark_push(sv);
+		}
+		return 1;
+	}
+	if (!(sv->admin & ADMIN_FORWARDED)) {
+		if (forwarded_top == forwarded_size) {
+			forwarded_size = forwarded_size == 0 ?
+			    256 : forwarded_size * 2;
+			forwarded = realloc(forwarded,
+			    forwarded_size * sizeof(struct forwarding));
+			assert(forwarded != NULL);
+		}
+		bytes = sv_bytes(sv);
+		if ((nsv = malloc(bytes)) == NULL)
+			return 0;
+		memcpy(nsv, sv, bytes);
+		structured_value_init(h, nsv,
+		    (sv->admin & ADMIN_TUPLE) | copy_admin, bytes);
+
+		forwarded[forwarded_top].sv = sv;
+		forwarded[forwarded_top].next = sv->next;
+		forwarded_top++;
+		sv->admin |= ADMIN_FORWARDED;
+		sv->next = nsv;
+
+		if (nsv->admin & ADMIN_TUPLE)
+			mark_push(nsv);
+	}
+	v->value.structured = sv->next;
+	return 1;
+}
+
+/*
+ * Copy src into the heap h (except for those parts of it which are
+ * in the shared heap) and set dst to the copy.  Uses the mark stack
+ * to hold copied tuples whose contents have not yet been copied.
+ */
+static int
+heap_copy(struct heap *h, struct value *dst, const struct value *src)
+{
+	struct tuple *t;
+	struct value *slots;
+	unsigned int i;
+	int ok;
+
+	value_copy(dst, src);
+	forwarded_top = 0;
+	ok = copy_value(h, dst);
+	while (mark_stack_top > 0) {
+		t = (struct tuple *)mark_stack[--mark_stack_top];
+		if (!ok)
+			continue;
+		ok = copy_value(h, &t->tag);
+		slots = (struct value *)(t + 1);
+		for (i = 0; ok && i < t->size; i++)
+			ok = copy_value(h, &slots[i]);
+	}
+
+	while (forwarded_top > 0) {
+		forwarded_top--;
+		forwarded[forwarded_top].sv->admin &= ~ADMIN_FORWARDED;
+		forwarded[forwarded_top].sv->next =
+		    forwarded[forwarded_top].next;
+	}
+
+	return ok;
+}
+
+/*
+ * Public interface to garbage collector.
+ */
+
+/*
+ * Collect every heap at once.  This is the only way the shared heap
+ * is collected, since values in any heap may refer into it.
+ */
+/*
+ * Timing of collections.  clock() measures processor time, which for
+ * a collection is close enough to the time the mutator is paused.
+ */
+#ifdef STANDALONE
+typedef unsigned long gc_clock_t;
+#define gc_clock()	0
+#else
+typedef clock_t gc_clock_t;
+#define gc_clock()	clock()
+#endif
+
+/*
+ * With stats_lock held.
+ */
+static void
+gc_account(gc_clock_t start, unsigned long objects, unsigned long bytes,
+	   unsigned long objects_after, unsigned long bytes_after)
+{
+	unsigned long us;
+
+	us = (unsigned long)((double)(gc_clock() - start) * 1000000.0 /
+	    CLOCKS_PER_SEC);
+	pause_us += us;
+	if (us > max_pause_us)
+		max_pause_us = us;
+	freed_objects += objects - objects_after;
+	freed_bytes += bytes - bytes_after;
+}
+
+#define FOR_EACH_HEAP(h) \
+	for (h = &shared_heap; h != NULL; \
+	     h = (h == &shared_heap ? local_heaps : h->next))
+
+void
+value_gc_collect(value_walker walker)
+{
+	struct heap *h;
+	gc_clock_t start = gc_clock();
+	unsigned long objects = 0, bytes = 0;
+	unsigned long objects_after = 0, bytes_after = 0;
+	int parallel;
+
+	WRLOCK(collect_lock);
+	FOR_EACH_HEAP(h) {
+		objects += h->objects;
+		bytes += h->bytes;
+	}
+
+	mark_skip = 0;
+	parallel = mark_all(walker, objects);
+
+	FOR_EACH_HEAP(h) {
+		sweep_heap(h, parallel);
+		reset_trigger(h);
+		objects_after += h->objects;
+		bytes_after += h->bytes;
+	}
+	pool_release(parallel);
+
+	LOCK(stats_lock);
+	gc_fragmentation = 0;
+	full_collections++;
+	gc_account(start, objects, bytes, objects_after, bytes_after);
+	UNLOCK(stats_lock);
+	RWUNLOCK(collect_lock);
+}
+
+void
+value_gc_set_process_marker(void (*marker)(struct process *))
+{
+	process_marker = marker;
+}
+
+static struct value *gc_root;
+
+static void
+walk_gc_root(value_visitor visitor)
+{
+	visitor(gc_root);
+}
+
+void
+value_gc(struct value *root)
+{
+	gc_root = root;
+	value_gc_collect(walk_gc_root);
+	gc_root = NULL;
+}
+
+/*
+ * Returns true if enough has been allocated in the shared heap since
+ * the last collection that another one is warranted.
+ */
+int
+value_gc_wanted(void)
+{
+	int wanted;
+
+	LOCK(shared_lock);
+	wanted = shared_heap.bytes_since >= shared_heap.trigger;
+	UNLOCK(shared_lock);
+	return wanted;
+}
+
+void
+value_gc_set_threads(unsigned int threads)
+{
+	gc_threads = threads > 0 ? threads : 1;
+}
+
+void
+value_gc_set_compact_threshold(unsigned int percent)
+{
+	compact_threshold = percent;
+}
+
+/*
+ * Fragmentation of the heap as of the last collection.
+ */
+unsigned int
+value_gc_get_fragmentation(void)
+{
+	unsigned int fragmentation;
+
+	LOCK(stats_lock);
+	fragmentation = gc_fragmentation;
+	UNLOCK(stats_lock);
+	return fragmentation;
+}
+
+/*** heaps ***/
+
+static void
+add_allocation(struct allocation *to, const struct allocation *from)
+{
+	to->objects += from->objects;
+	to->bytes += from->bytes;
+	to->tuples += from->tuples;
+	to->symbols += from->symbols;
+	to->dict_layers += from->dict_layers;
+}
+
+struct heap *
+value_heap_new(void)
+{
+	struct heap *h;
+
+	if ((h = malloc(sizeof(struct heap))) == NULL)
+		return NULL;
+	memset(h, 0, sizeof(struct heap));
+	h->min_trigger = h->trigger = LOCAL_MIN_TRIGGER;
+
+	RDLOCK(collect_lock);
+	LOCK(heaps_lock);
+	h->next = local_heaps;
+	if (local_heaps != NULL)
+		local_heaps->prev = h;
+	local_heaps = h;
+	UNLOCK(heaps_lock);
+	RWUNLOCK(collect_lock);
+
+	return h;
+}
+
+/*
+ * A fragment is a heap which belongs to no process, and is not in
+ * the list of heaps; it is never collected.  A value copied into a
+ * fragment can be handed to another thread, which merges it into its
+ * own heap later.
+ */
+struct heap *
+value_heap_new_fragment(void)
+{
+	struct heap *h;
+
+	if ((h = malloc(sizeof(struct heap))) == NULL)
+		return NULL;
+	memset(h, 0, sizeof(struct heap));
+	return h;
+}
+
+/*
+ * Move every value in the fragment into the heap, and free the
+ * fragment.
+ */
+void
+value_heap_merge(struct heap *h, struct heap *frag)
+{
+	struct structured_value *sv;
+
+	if ((sv = frag->sv_head) != NULL) {
+		while (sv->next != NULL)
+			sv = sv->next;
+		sv->next = h->sv_head;
+		h->sv_head = frag->sv_head;
+	}
+	h->objects += frag->objects;
+	h->bytes += frag->bytes;
+	h->bytes_since += frag->bytes;
+	add_allocation(&h->allocated, &frag->allocated);
+	free(frag);
+}
+
+/*
+ * Free the heap and every value in it.  Nothing outside the heap
+ * may refer to those values any longer.
+ */
+void
+value_heap_free(struct heap *h)
+{
+	struct structured_value *sv, *sv_next;
+
+	assert(h != &shared_heap);
+	if (current_heap == h)
+		current_heap = &shared_heap;
+
+	RDLOCK(collect_lock);
+	for (sv = h->sv_head; sv != NULL; sv = sv_next) {
+		sv_next = sv->next;
+		if (!(sv->admin & ADMIN_ARENA))
+			free(sv);
+	}
+	free(h->arena);
+
+	LOCK(heaps_lock);
+	add_allocation(&retired_allocation, &h->allocated);
+	if (h->prev != NULL)
+		h->prev->next = h->next;
+	else if (local_heaps == h)
+		local_heaps = h->next;
+	if (h->next != NULL)
+		h->next->prev = h->prev;
+	UNLOCK(heaps_lock);
+	RWUNLOCK(collect_lock);
+
+	free(h);
+}
+
+struct heap *
+value_heap_get_current(void)
+{
+	return current_heap == &shared_heap ? NULL : current_heap;
+}
+
+void
+value_heap_set_current(struct heap *h)
+{
+	current_heap = h == NULL ? &shared_heap : h;
+}
+
+/*
+ * Copy src into the given heap (or the shared heap, if NULL) unless
+ * that is where it already is.  Precondition: src is in the current
+ * heap (or shared.)
+ */
+int
+value_heap_copy(struct heap *h, struct value *dst, const struct value *src)
+{
+#ifdef HEAP_PROFILE
+	int caller_site_pc = site_pc;
+	int ok;
+#endif
+
+	if (h == NULL)
+		h = &shared_heap;
+	if (h == current_heap || !(src->type & VALUE_STRUCTURED)) {
+		value_copy(dst, src);
+		return 1;
+	}
+#ifdef HEAP_PROFILE
+	site_pc = SITE_MESSAGE;
+	ok = heap_copy(h, dst, src);
+	site_pc = caller_site_pc;
+	return ok;
+#else
+	return heap_copy(h, dst, src);
+#endif
+}
+
+/*
+ * Freezing copies into the shared heap, just as promotion does, but
+ * marks each copy frozen.  Parts of the value which are already in
+ * the shared heap are not copied, but frozen in place, so that no
+ * frozen value refers to one which can still be changed.  Freezes
+ * are made one at a time, so that none can see a shared value which
+ * another is only part of the way through freezing.
+ */
+int
+value_freeze(struct value *dst, const struct value *src)
+{
+	int ok;
+
+	if (!(src->type & VALUE_STRUCTURED) ||
+	    (ATOMIC_READ(src->value.structured->admin) & ADMIN_FROZEN)) {
+		value_copy(dst, src);
+		return 1;
+	}
+	LOCK(freeze_lock);
+	copy_admin = ADMIN_FROZEN;
+	ok = heap_copy(&shared_heap, dst, src);
+	copy_admin = 0;
+	UNLOCK(freeze_lock);
+	return ok;
+}
+
+int
+value_is_frozen(const struct value *v)
+{
+	return !(v->type & VALUE_STRUCTURED) ||
+	    (v->value.structured->admin & ADMIN_FROZEN) != 0;
+}
+
+int
+value_is_shared(const struct value *v)
+{
+	return (v->type & VALUE_STRUCTURED) &&
+	    (v->value.structured->admin & ADMIN_SHARED) != 0;
+}
+
+/*
+ * Collect a single process's heap.  The walker need only visit the
+ * roots which may refer into this heap; the shared heap is left
+ * alone, so there is no need to visit the rest of the world.  Other
+ * threads may be collecting their own heaps meanwhile.
+ */
+void
+value_heap_collect(struct heap *h, value_walker walker)
+{
+	gc_clock_t start = gc_clock();
+	unsigned long objects, bytes;
+	unsigned int fragmented;
+	int parallel, compacted = 0;
+
+	assert(h != NULL);
+	RDLOCK(collect_lock);
+	objects = h->objects;
+	bytes = h->bytes;
+
+	mark_skip = ADMIN_SHARED;
+	parallel = mark_all(walker, objects);
+
+	fragmented = fragmentation(h);
+	if (compact_threshold > 0 &&
+	    mark_bytes >= compact_min_bytes &&
+	    fragmented >= compact_threshold) {
+		compact(h, walker);
+		compacted = 1;
+	} else {
+		sweep_heap(h, parallel);
+	}
+	pool_release(parallel);
+	mark_skip = 0;
+
+	reset_trigger(h);
+	LOCK(stats_lock);
+	gc_fragmentation = compacted ? 0 : fragmented;
+	compactions += compacted;
+	local_collections++;
+	gc_account(start, objects, bytes, h->objects, h->bytes);
+	UNLOCK(stats_lock);
+	RWUNLOCK(collect_lock);
+}
+
+int
+value_heap_gc_wanted(const struct heap *h)
+{
+	assert(h != NULL);
+	return h->bytes_since >= h->trigger;
+}
+
+/*** statistics ***/
+
+/*
+ * Census of live (well, not yet swept) structured values by tuple tag.
+ * There are seldom more than a few dozen distinct tags, so a list
+ * will do.  The tags seen may belong to any heap, so none of them is
+ * kept: a symbol's text is copied, tags which are themselves tuples
+ * are all counted together, and other tags are plain values.
+ */
+struct tag_count {
+	struct value		 tag;		/* unless a symbol */
+	char			*token;		/* if a symbol */
+	unsigned int		 length;
+	unsigned long		 objects;
+	unsigned long		 bytes;
+};
+
+static struct tag_count *tag_counts = NULL;
+static unsigned int tag_counts_size = 0;
+static unsigned int num_tag_counts = 0;
+
+static int
+same_tag(const struct tag_count *tc, const struct value *tag)
+{
+	if (tc->tag.type != tag->type)
+		return 0;
+	if (tag->type == VALUE_SYMBOL) {
+		return tc->length == value_symbol_get_length(tag) &&
+		    memcmp(tc->token, value_symbol_get_token(tag),
+		    tc->length) == 0;
+	}
+	if (tag->type & VALUE_STRUCTURED)
+		return 1;
+	return tc->tag.value.integer == tag->value.integer;
+}
+
+static void
+count_tag(const struct value *tag, unsigned int bytes)
+{
+	struct tag_count *tc;
+	unsigned int i;
+
+	for (i = 0; i < num_tag_counts; i++) {
+		if (same_tag(&tag_counts[i], tag))
+			break;
+	}
+	if (i == num_tag_counts) {
+		if (num_tag_counts == tag_counts_size) {
+			tag_counts_size = tag_counts_size == 0 ?
+			    16 : tag_counts_size * 2;
+			tag_counts = realloc(tag_counts,
+			    tag_counts_size * sizeof(struct tag_count));
+			assert(tag_counts != NULL);
+		}
+		tc = &tag_counts[i];
+		tc->tag.type = tag->type;
+		tc->tag.value.integer = 0;
+		tc->token = NULL;
+		tc->length = 0;
+		if (tag->type == VALUE_SYMBOL) {
+			tc->length = value_symbol_get_length(tag);
+			tc->token = malloc(tc->length + 1);
+			assert(tc->token != NULL);
+			memcpy(tc->token, value_symbol_get_token(tag),
+			    tc->length);
+		} else if (!(tag->type & VALUE_STRUCTURED)) {
+			value_copy(&tc->tag, tag);
+		}
+		tc->objects = 0;
+		tc->bytes = 0;
+		num_tag_counts++;
+	}
+	tag_counts[i].objects++;
+	tag_counts[i].bytes += bytes;
+}
+
+static void
+free_tag_counts(void)
+{
+	while (num_tag_counts > 0)
+		free(tag_counts[--num_tag_counts].token);
+}
+
+/*
+ * Set the given value to a new dictionary describing the state of
+ * all heaps and the history of allocation and collection.  Values
+ * not yet swept count as live.  Sizes are in bytes; times are in
+ * microseconds of processor time.  The "tags" entry maps each tuple
+ * tag seen to a dictionary of the objects and bytes with that tag.
+ */
+static int
+gc_stats(struct value *dict)
+{
+	struct allocation allocated = retired_allocation;
+	struct heap *h;
+	struct structured_value *sv;
+	unsigned long heaps = 0, tuples = 0, tuple_bytes = 0;
+	unsigned long symbols = 0, symbol_bytes = 0;
+	unsigned long shared_objects, shared_bytes;
+	struct value tags, entry, tag;
+	unsigned int i, bytes;
+
+	/*
+	 * Take the census before allocating anything, so that the
+	 * dictionaries we build do not count themselves.
+	 */
+	free_tag_counts();
+	shared_objects = shared_heap.objects;
+	shared_bytes = shared_heap.bytes;
+	FOR_EACH_HEAP(h) {
+		heaps++;
+		add_allocation(&allocated, &h->allocated);
+		for (sv = h->sv_head; sv != NULL; sv = sv->next) {
+			bytes = sv_bytes(sv);
+			if (sv->admin & ADMIN_TUPLE) {
+				tuples++;
+				tuple_bytes += bytes;
+				count_tag(&((struct tuple *)sv)->tag, bytes);
+			} else {
+				symbols++;
+				symbol_bytes += bytes;
+			}
+		}
+	}
+
+	if (!value_dict_new(dict, 63) || !value_dict_new(&tags, 31))
+		return 0;
+
+	value_dict_store_integer(dict, "heaps", heaps);
+	value_dict_store_integer(dict, "objects", tuples + symbols);
+	value_dict_store_integer(dict, "bytes", tuple_bytes + symbol_bytes);
+	value_dict_store_integer(dict, "tuples", tuples);
+	value_dict_store_integer(dict, "tuple-bytes", tuple_bytes);
+	value_dict_store_integer(dict, "symbols", symbols);
+	value_dict_store_integer(dict, "symbol-bytes", symbol_bytes);
+	value_dict_store_integer(dict, "shared-objects", shared_objects);
+	value_dict_store_integer(dict, "shared-bytes", shared_bytes);
+
+	value_dict_store_integer(dict, "allocated-objects", allocated.objects);
+	value_dict_store_integer(dict, "allocated-bytes", allocated.bytes);
+	value_dict_store_integer(dict, "allocated-tuples", allocated.tuples);
+	value_dict_store_integer(dict, "allocated-symbols", allocated.symbols);
+	value_dict_store_integer(dict, "allocated-dict-layers",
+	    allocated.dict_layers);
+
+	value_dict_store_integer(dict, "collections",
+	    local_collections + full_collections);
+	value_dict_store_integer(dict, "local-collections", local_collections);
+	value_dict_store_integer(dict, "full-collections", full_collections);
+	value_dict_store_integer(dict, "compactions", compactions);
+	value_dict_store_integer(dict, "freed-objects", freed_objects);
+	value_dict_store_integer(dict, "freed-bytes", freed_bytes);
+	value_dict_store_integer(dict, "pause-us", pause_us);
+	value_dict_store_integer(dict, "max-pause-us", max_pause_us);
+	value_dict_store_integer(dict, "fragmentation", gc_fragmentation);
+
+	for (i = 0; i < num_tag_counts; i++) {
+		if (tag_counts[i].tag.type == VALUE_SYMBOL) {
+			if (!value_symbol_new(&tag, tag_counts[i].token,
+			    tag_counts[i].length))
+				return 0;
+		} else if (tag_counts[i].tag.type & VALUE_STRUCTURED) {
+			value_symbol_new(&tag, "tuple", 5);
+		} else {
+			value_copy(&tag, &tag_counts[i].tag);
+		}
+		if (!value_dict_new(&entry, 3))
+			return 0;
+		value_dict_store_integer(&entry, "objects",
+		    tag_counts[i].objects);
+		value_dict_store_integer(&entry, "bytes", tag_counts[i].bytes);
+		value_dict_store(&tags, &tag, &entry);
+	}
+	value_symbol_new(&tag, "tags", 4);
+	value_dict_store(dict, &tag, &tags);
+
+	return 1;
+}
+
+/*
+ * The census is taken with no collection in progress, but it walks
+ * every heap, so no other thread may be running a process meanwhile
+ * (see sched_stop_world().)  Heaps are not collected first, so the
+ * figures include garbage, and are approximate in that sense.
+ */
+int
+value_gc_stats(struct value *dict)
+{
+	int ok;
+
+	WRLOCK(collect_lock);
+	ok = gc_stats(dict);
+	RWUNLOCK(collect_lock);
+	return ok;
+}
+
+/*** heap profiling ***/
+
+#ifdef HEAP_PROFILE
+void
+value_profile_set_site(unsigned int process, int pc)
+{
+	site_process = process;
+	site_pc = pc;
+}
+#endif
+
+/*
+ * Totals by allocation site, in an open hash table keyed on process
+ * and pc.
+ */
+struct site_count {
+	unsigned int		 process;
+	int			 pc;
+	unsigned long		 objects;
+	unsigned long		 bytes;
+};
+
+static struct site_count *site_counts = NULL;
+static unsigned int site_counts_size = 0;	/* a power of two */
+static unsigned int num_site_counts;
+
+static struct site_count *
+find_site(unsigned int process, int pc)
+{
+	unsigned int i, mask = site_counts_size - 1;
+
+	for (i = (process * 31 + (unsigned int)pc) & mask;
+	     site_counts[i].objects > 0; i = (i + 1) & mask) {
+		if (site_counts[i].process == process &&
+		    site_counts[i].pc == pc)
+			return &site_counts[i];
+	}
+	site_counts[i].process = process;
+	site_counts[i].pc = pc;
+	num_site_counts++;
+	return &site_counts[i];
+}
+
+static void
+count_site(unsigned int process, int pc, unsigned int bytes)
+{
+	struct site_count *old, *sc;
+	unsigned int i, old_size;
+
+	if (num_site_counts * 2 >= site_counts_size) {
+		old = site_counts;
+		old_size = site_counts_size;
+		site_counts_size = old_size == 0 ? 64 : old_size * 2;
+		site_counts = malloc(site_counts_size *
+		    sizeof(struct site_count));
+		assert(site_counts != NULL);
+		memset(site_counts, 0,
+		    site_counts_size * sizeof(struct site_count));
+		num_site_counts = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old[i].objects == 0)
+				continue;
+			sc = find_site(old[i].process, old[i].pc);
+			sc->objects = old[i].objects;
+			sc->bytes = old[i].bytes;
+		}
+		free(old);
+	}
+	sc = find_site(process, pc);
+	sc->objects++;
+	sc->bytes += bytes;
+}
+
+/*
+ * Set the given value to a new heap profile: a tuple tagged
+ * 'heap-profile' of tuples <site: process, pc, objects, bytes>, one
+ * for each allocation site with live (well, not yet swept) values,
+ * largest first.  Without HEAP_PROFILE, every value is counted at
+ * SITE_NATIVE, with no process.
+ */
+static int
+profile_dump(struct value *dump)
+{
+	struct heap *h;
+	struct structured_value *sv;
+	struct site_count tmp;
+	struct value tag, entry;
+	unsigned int i, j, n, process;
+	int pc;
+
+	if (site_counts != NULL)
+		memset(site_counts, 0,
+		    site_counts_size * sizeof(struct site_count));
+	num_site_counts = 0;
+	FOR_EACH_HEAP(h) {
+		for (sv = h->sv_head; sv != NULL; sv = sv->next) {
+#ifdef HEAP_PROFILE
+			process = sv->site_process;
+			pc = sv->site_pc;
+#else
+			process = 0;
+			pc = SITE_NATIVE;
+#endif
+			count_site(process, pc, sv_bytes(sv));
+		}
+	}
+
+	/* Gather the entries at the front of the table, largest first. */
+	for (i = n = 0; i < site_counts_size; i++) {
+		if (site_counts[i].objects == 0)
+			continue;
+		tmp = site_counts[i];
+		for (j = n; j > 0 && site_counts[j - 1].bytes < tmp.bytes; j--)
+			site_counts[j] = site_counts[j - 1];
+		site_counts[j] = tmp;
+		n++;
+	}
+	assert(n == num_site_counts);
+
+	if (!value_symbol_new(&tag, "heap-profile", 12) ||
+	    !value_tuple_new(dump, &tag, n) ||
+	    !value_symbol_new(&tag, "site", 4))
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (!value_tuple_new(&entry, &tag, 4))
+			return 0;
+		if (site_counts[i].process != 0)
+			value_tuple_store_integer(&entry, 0,
+			    (int)site_counts[i].process);
+		value_tuple_store_integer(&entry, 1, site_counts[i].pc);
+		value_tuple_store_integer(&entry, 2, (int)site_counts[i].objects);
+		value_tuple_store_integer(&entry, 3, (int)site_counts[i].bytes);
+		value_tuple_store(dump, i, &entry);
+	}
+
+	/* The table is no longer a hash table; empty it. */
+	if (site_counts != NULL)
+		memset(site_counts, 0,
+		    site_counts_size * sizeof(struct site_count));
+	num_site_counts = 0;
+
+	return 1;
+}
+
+int
+value_profile_dump(struct value *dump)
+{
+	int ok;
+
+	WRLOCK(collect_lock);
+	ok = profile_dump(dump);
+	RWUNLOCK(collect_lock);
+	return ok;
 }
@@ -85,8 +85,144 @@ int		 value_is_tuple(const struct value *);
 int		 value_equal(const struct value *, const struct value *);
 enum comparison	 value_compare(const struct value *, const struct value *);
 
+/*
+ * Equal symbols, integers and other unstructured values hash equally;
+ * tuples hash by identity.
+ */
+unsigned int	 value_hash(const struct value *);
+
+/*
+ * Garbage collection.
+ * A root walker is a function which applies the given visitor to
+ * every value which the collector should consider live (and, when
+ * compacting, which it may update in place.)
+ */
+typedef void	(*value_visitor)(struct value *);
+typedef void	(*value_walker)(value_visitor);
+
 		 /* public interface to garbage collector */
 void		 value_gc(struct value *);
+void		 value_gc_collect(value_walker);
+int		 value_gc_wanted(void);
+
+/*
+ * Set a function which is called for each process value found while
+ * marking (perhaps by several threads at once), so that a process
+ * which has ended can be freed once no value refers to it.
+ */
+void		 value_gc_set_process_marker(void (*)(struct process *));
+
+/*
+ * Compaction.  When enabled (with a nonzero threshold percentage),
+ * a collection which finds the heap to be more fragmented than the
+ * threshold relocates all live structured values into one contiguous
+ * arena, in breadth-first order from the roots.
+ *
+ * Only the collection of a single process heap compacts; full
+ * collections (of all heaps, with value_gc_collect()) never do.  In
+ * particular the shared heap is never compacted, because its values
+ * are referred to from C globals and locals which no root walker
+ * visits, and so could not be updated if they were moved.
+ */
+void		 value_gc_set_compact_threshold(unsigned int);
+unsigned int	 value_gc_get_fragmentation(void);
+
+/*
+ * Parallel collection.  In builds with THREADS defined, marking and
+ * sweeping are split across this many threads (including the caller.)
+ * Otherwise the setting is accepted but ignored.
+ */
+void		 value_gc_set_threads(unsigned int);
+
+/*
+ * Statistics.  Set the given value to a new dictionary, mapping
+ * symbols to integers, which describes what the heaps hold (in total,
+ * and by type and tuple tag) and what has been allocated and collected
+ * so far (including the number, freed bytes and pause times of
+ * collections.)  Tags which are themselves tuples are counted together
+ * under the symbol "tuple".  The census counts garbage not yet swept,
+ * so it is approximate.  It walks every heap, so with several workers,
+ * stop the others first (with sched_stop_world().)  Returns false if
+ * memory could not be allocated.
+ */
+int		 value_gc_stats(struct value *);
+
+/*
+ * Heap profiling.  In builds with HEAP_PROFILE defined, each structured
+ * value records the allocation site current when it was allocated: a
+ * process (by its number, or 0 for none) and a position in VM code,
+ * or one of the SITE_ codes.  The
+ * VM sets the site as it executes each instruction.  Values copied
+ * between heaps (as messages are) are recorded at SITE_MESSAGE.
+ */
+#define SITE_NATIVE	-1	/* allocated outside of any VM instruction */
+#define SITE_MESSAGE	-2	/* copied in from another heap */
+
+#ifdef HEAP_PROFILE
+void		 value_profile_set_site(unsigned int, int);
+#define	PROFILE_SITE(p, pc)	value_profile_set_site(p, pc)
+#else
+#define	PROFILE_SITE(p, pc)
+#endif
+
+/*
+ * Set the given value to a new tuple describing the live values in
+ * all heaps by allocation site: <heap-profile: <site: process, pc,
+ * objects, bytes>, ...>, largest first, where the process is given by
+ * its number, or null if there was none.  Like value_gc_stats(), it
+ * walks every heap, so with several workers, stop the others first.
+ * Returns false if memory could not be allocated.
+ */
+int		 value_profile_dump(struct value *);
+
+/*
+ * Heaps.  Each VM process allocates into a heap of its own, which can
+ * be collected on its own, given only that process's roots.  Values
+ * allocated with no current heap (NULL), and large symbols, go into
+ * a shared heap, which is collected only by value_gc_collect() (which
+ * must be given the roots of every heap.)  Values passed between heaps
+ * must be copied with value_heap_copy().
+ */
+struct heap;
+
+struct heap	*value_heap_new(void);
+void		 value_heap_free(struct heap *);
+struct heap	*value_heap_get_current(void);
+void		 value_heap_set_current(struct heap *);
+int		 value_heap_copy(struct heap *, struct value *, const struct value *);
+void		 value_heap_collect(struct heap *, value_walker);
+int		 value_heap_gc_wanted(const struct heap *);
+
+/*
+ * Fragments.  A fragment is a heap belonging to no one, which is
+ * never collected, into which a value may be copied by one thread and
+ * merged into another heap (freeing the fragment) by another.  This
+ * is how messages pass between processes running in different threads.
+ * An unmerged fragment is freed with value_heap_free().
+ */
+struct heap	*value_heap_new_fragment(void);
+void		 value_heap_merge(struct heap *, struct heap *);
+
+/*
+ * Frozen values.  Set the given value to a frozen copy of the other:
+ * a copy in the shared heap which may never be changed.  Since it is
+ * in the shared heap, it is sent between processes by reference,
+ * without being copied.  Freezing a value which is already frozen
+ * does not copy it again, and parts of it which are already in the
+ * shared heap are frozen where they are, so they can no longer be
+ * changed through any other reference either.  Returns false if
+ * memory could not be allocated.  Every unstructured value counts as
+ * frozen.  Storing into a frozen tuple or dictionary stores nothing,
+ * and returns false.
+ */
+int		 value_freeze(struct value *, const struct value *);
+int		 value_is_frozen(const struct value *);
+
+/*
+ * Returns true if the value is in the shared heap (as every frozen
+ * value is.)  Unstructured values belong to no heap, and are not.
+ */
+int		 value_is_shared(const struct value *);
 
 /*
  * Unstructured values.
@@ -108,7 +244,8 @@ struct process	*value_get_process(const struct value *);
 
 /*
  * Retrieve an integer code that uniquely identifies this value.
- * Intended for debug output only.
+ * Intended for debug output, and for telling values apart by identity
+ * (as the serializer does); it may change when the heap is compacted.
  * Precondition: value is a structured value.
  */
 PTR_INT		 value_get_unique_id(const struct value *);
@@ -138,17 +275,49 @@ unsigned int	 value_symbol_get_length(const struct value *);
 
 /*
  * Tuples.
+ *
+ * value_tuple_store() returns false, and stores nothing, if the tuple
+ * is frozen.  A shared tuple which is not frozen (only the runtime
+ * makes these) may not refer into a process's heap, so storing a
+ * structured value from a process's heap into it stores a copy of that
+ * value, made in the shared heap; it returns false, and stores nothing,
+ * if the copy could not be made.
  */
 
 int		 value_tuple_new(struct value *, struct value *, unsigned int);
 struct value	*value_tuple_get_tag(const struct value *);
 unsigned int	 value_tuple_get_size(const struct value *);
 struct value	*value_tuple_fetch(const struct value *, unsigned int);
-void		 value_tuple_store(struct value *, unsigned int, const struct value *);
+int		 value_tuple_store(struct value *, unsigned int, const struct value *);
 int		 value_tuple_fetch_integer(const struct value *, unsigned int);
-void		 value_tuple_store_integer(struct value *, unsigned int, int);
+int		 value_tuple_store_integer(struct value *, unsigned int, int);
 clabel		 value_tuple_fetch_label(const struct value *, unsigned int);
 
+/*
+ * Lazy tuples.  The elements of a lazy tuple are made only as they
+ * are first fetched: by calling the load function of its source with
+ * the source, the position which was given when the tuple was made,
+ * and the index of the element, to set the given value to the element.
+ * Until then an element is null.  A lazy tuple, and everything loaded
+ * into it, is in the shared heap and frozen; it may be fetched from
+ * by several threads at once, so the load function must allow for
+ * that.
+ *
+ * Each lazy tuple holds a reference to its source; when the last is
+ * let go (by value_lazy_release(), or when the last lazy tuple is
+ * collected) the source's release function is called.
+ */
+struct lazy_source {
+	int		(*load)(struct lazy_source *, unsigned long,
+				unsigned int, struct value *);
+	void		(*release)(struct lazy_source *);
+	unsigned int	  refs;
+};
+
+int		 value_tuple_new_lazy(struct value *, struct value *,
+		    unsigned int, struct lazy_source *, unsigned long);
+void		 value_lazy_release(struct lazy_source *);
+
 /*
  * Dictionaries.
  * Dictionaries are represented by a linked list of "layers", where
@@ -157,7 +326,8 @@ clabel		 value_tuple_fetch_label(const struct value *, unsigned int);
 
 int		 value_dict_new(struct value *, unsigned int);
 struct value	*value_dict_fetch(const struct value *, const struct value *);
-void		 value_dict_store(struct value *, struct value *, struct value *);
+int		 value_dict_store(struct value *, struct value *, struct value *);
+int		 value_dict_store_integer(struct value *, const char *, int);
 unsigned int	 value_dict_get_length(const struct value *);
 unsigned int	 value_dict_get_layer_size(const struct value *);
 
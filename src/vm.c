@@ -8,11 +8,15 @@
 #include "stream.h"
 #include "file.h"
 #include "vmproc.h"
+#include "sched.h"
+#include "registry.h"
 
 #include "vm.h"
 #include "value.h"
 #include "portray.h"
 #include "save.h"
+#include "load.h"
+#include "snapshot.h"
 
 #include "instrenum.h"
 
@@ -44,7 +48,7 @@
 #define VM_END_DISPATCH()
 #define VM_OPLAB(x)		LABEL_ ## x: VM_DEBUG(x)
 #define VM_NEXT()		goto TOP;
-#define VM_STOP()		cycles = 1; goto TOP;
+#define VM_STOP()		left = cycles; cycles = 1; goto TOP;
 
 #else
 
@@ -53,7 +57,7 @@
 #define VM_END_DISPATCH()	}
 #define VM_OPLAB(x)		case x: VM_DEBUG(x)
 #define VM_NEXT()		break;
-#define VM_STOP()		cycles = 1; break;
+#define VM_STOP()		left = cycles; cycles = 1; break;
 
 #endif
 
@@ -69,14 +73,87 @@
 
 #define XFER_VALUES(from, to, count) value_ar_xfer(from, to, count)
 
+#ifdef DIRECT_THREADING
+/*
+ * The labels of the instructions are known only within vm_run(),
+ * which leaves them here for vm_label_opcode().
+ */
+static clabel *labels = NULL;
+static unsigned int num_labels = 0;
+#endif
+
 #define	IMM_VAL()	(value_tuple_fetch(code, pc))
 #define	IMM_INT()	(value_tuple_fetch_integer(code, pc))
 #define	IMM_ADDR()	(value_tuple_fetch_integer(code, pc))
 
-void
+/*
+ * Start a new process, sharing the code of the given VM, at the given
+ * address, in the same priority class as self, with the same latency
+ * target.
+ */
+static struct process *
+spawn(struct process *self, struct value *vm, int entry)
+{
+	struct process *spawned;
+	struct value t;
+
+	value_vm_new(&t, value_tuple_fetch(vm, VM_CODE));
+	value_tuple_store(&t, VM_AR, &VNULL);
+	value_tuple_store(&t, VM_IS_DIRECT, value_tuple_fetch(vm, VM_IS_DIRECT));
+	value_tuple_store_integer(&t, VM_PC, entry);
+
+	spawned = vmproc_new(&t);
+	sched_set_priority(spawned, self->priority);
+	sched_set_latency(spawned, self->latency / 1000);
+	return spawned;
+}
+
+/*
+ * End self, for the given reason (or NULL, for normal.)  If it is
+ * supervised, and the reason is not normal, start a new process in
+ * its place (unless it has been restarted too often already), which
+ * takes its name.
+ */
+static void
+exit_process(struct process *self, struct value *vm, struct value *reason)
+{
+	struct process *spawned;
+
+	if (reason != NULL && reason->type == VALUE_SYMBOL &&
+	    value_symbol_get_length(reason) == 6 &&
+	    strncmp(value_symbol_get_token(reason), "normal", 6) == 0)
+		reason = NULL;
+	if (self->supervised && reason != NULL && self->restarts > 0) {
+		spawned = spawn(self, vm, self->entry);
+		spawned->supervised = 1;
+		spawned->entry = self->entry;
+		spawned->restarts = self->restarts - 1;
+		registry_replace(self, spawned);
+		sched_add(spawned);
+	}
+	process_exit(self, reason);
+}
+
+/*
+ * End self, as a failure, for the reason named: an instruction could
+ * not be carried out.  If even the reason cannot be allocated, it is
+ * null, which is no less a failure.
+ */
+static void
+fail_process(struct process *self, struct value *vm, const char *name)
+{
+	struct value reason;
+
+	if (!value_symbol_new(&reason, name, strlen(name)))
+		value_copy(&reason, &VNULL);
+	exit_process(self, vm, &reason);
+}
+
+unsigned int
 vm_run(struct value *vm, struct process *self, unsigned int cycles)
 {
 	struct value t1;    /* temporary */
+	unsigned int left = 0; /* cycles unused, if stopped early */
 
 	struct value *a;    /* register, generally used for 1st argument */
 	struct value *b;    /* register, generally used for 2nd argument */
@@ -94,11 +171,19 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 		struct opcode_entry *oe;
 		enum opcode opcode;
 
-		/* convert opcodes to labels */
+		ATOMIC_WRITE(num_labels,
+		    sizeof(instr_label) / sizeof(instr_label[0]));
+		ATOMIC_WRITE(labels, instr_label);
+
+		/*
+		 * Convert opcodes to labels, unless another VM sharing
+		 * the code (as restored ones do) has done so already.
+		 */
 		pc = 0;
 		code = value_tuple_fetch(vm, VM_CODE);
 		a = value_tuple_fetch(code, pc);
-		opcode = (enum opcode)value_get_integer(a);
+		opcode = a->type == VALUE_LABEL ?
+		    INSTR_EOF : (enum opcode)value_get_integer(a);
 		while (opcode != INSTR_EOF) {
 			value_label_set(a, instr_label[value_get_integer(a)]);
 #ifdef DEBUG
@@ -125,6 +210,7 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 
 		pc++;
 		if (--cycles == 0) break;
+		PROFILE_SITE(self->number, (int)pc);
 		VM_DEBUG_PC()
 		VM_DUMP_AR()
 
@@ -224,12 +310,38 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 		 * Pop a tuple value from the stack, then
 		 * an integer index value, then a target value;
 		 * store the target in the tuple at that index.
+		 * If the tuple is frozen (as literals in the code
+		 * are), this process fails, for the reason frozen.
 		 */
 		VM_OPLAB(INSTR_STORE_TUPLE)
 			a = POP_VALUE(); /* tuple */
 			b = POP_VALUE(); /* index */
 			v = POP_VALUE(); /* value */
-			value_tuple_store(a, value_get_integer(b), v);
+			if (!value_tuple_store(a, value_get_integer(b), v)) {
+				fail_process(self, vm, value_is_frozen(a) ?
+				    "frozen" : "nomem");
+				VM_STOP()
+			}
+			VM_NEXT()
+
+		/*
+		 % FREEZE : v -> v
+		 * Pop a value from the stack and push a frozen copy
+		 * of it: one which can no longer be changed, and
+		 * which can be sent to other processes without being
+		 * copied.  Any part of it which is already frozen
+		 * (such as a literal) is not copied again.
+		 * A process which stores into a frozen tuple or
+		 * dictionary fails, for the reason frozen.  If there
+		 * is not enough memory for the copy, this process
+		 * fails, for the reason nomem.
+		 */
+		VM_OPLAB(INSTR_FREEZE)
+			if (!value_freeze(&t1, POP_VALUE())) {
+				fail_process(self, vm, "nomem");
+				VM_STOP()
+			}
+			PUSH_VALUE(&t1);
 			VM_NEXT()
 
 		/*** DICTIONARY OPERATIONS ***/
@@ -263,12 +375,17 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 		 * Pop a dictionary value from the stack, then
 		 * a key value, then a target value; associate
 		 * the key with the target in the dictionary.
+		 * This fails as STORE_TUPLE does.
 		 */
 		VM_OPLAB(INSTR_STORE_DICT)
 			a = POP_VALUE(); /* dictionary */
 			b = POP_VALUE(); /* key */
 			v = POP_VALUE(); /* value */
-			value_dict_store(a, b, v);
+			if (!value_dict_store(a, b, v)) {
+				fail_process(self, vm, value_is_frozen(a) ?
+				    "frozen" : "nomem");
+				VM_STOP()
+			}
 			VM_NEXT()
 
 		/*** BOOLEAN OPERATORS ***/
@@ -562,10 +679,22 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 
 		/*
 		 % HALT : ->
-		 * Stop this virtual machine.
+		 * Stop this virtual machine.  This process ends
+		 * normally.
 		 */
 		VM_OPLAB(INSTR_HALT)
-			self->done = 1;
+			exit_process(self, vm, NULL);
+			VM_STOP()
+
+		/*
+		 % EXIT : v ->
+		 * Pop a reason from the stack, and end this process
+		 * for that reason, which is passed on to any
+		 * processes watching it (see MONITOR and LINK.)
+		 * Any reason but the symbol normal is a failure.
+		 */
+		VM_OPLAB(INSTR_EXIT)
+			exit_process(self, vm, POP_VALUE());
 			VM_STOP()
 
 		/*** CONDITIONAL CONTROL FLOW INSTRUCTIONS ***/
@@ -711,6 +840,22 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 			stream_close(self, value_get_process(a));
 			VM_NEXT()
 
+		/*
+		 % LOAD : n -> v
+		 * Pop a file name off the stack, load the value in
+		 * the image in that file into the shared heap, and
+		 * push it, or null if it could not be loaded.  The
+		 * values of large tuples in it are only loaded when
+		 * they are fetched.  The value is frozen (see FREEZE),
+		 * so it is sent by reference and cannot be stored into.
+		 */
+		VM_OPLAB(INSTR_LOAD)
+			a = POP_VALUE();
+			if (!value_load_lazily(&t1, value_symbol_get_token(a)))
+				value_copy(&t1, &VNULL);
+			PUSH_VALUE(&t1);
+			VM_NEXT()
+
 		/*
 		 % SPAWN a : -> p
 		 * Create a new VM process based on the current
@@ -718,28 +863,69 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 		 * process will share the code from this VM and
 		 * will begin executing at the given address, but
 		 * will not have any ARs of its own, nor will it have
-		 * access to this process's ARs.
+		 * access to this process's ARs.  It starts in the
+		 * same priority class, with the same latency target.
 		 */
 		VM_OPLAB(INSTR_SPAWN)
 		    {
 			struct process *spawned;
 
-			value_vm_new(&t1, value_tuple_fetch(vm, VM_CODE));
-			value_tuple_store(&t1, VM_AR, &VNULL);
-			value_tuple_store(&t1, VM_IS_DIRECT, value_tuple_fetch(vm, VM_IS_DIRECT));
 			pc++;
-			value_tuple_store_integer(&t1, VM_PC, IMM_ADDR());
+			spawned = spawn(self, vm, IMM_ADDR());
+			sched_add(spawned);
+
+			value_process_set(&t1, spawned);
+			PUSH_VALUE(&t1);
+		    }
+			VM_NEXT()
+
+		/*
+		 % SUPERVISE a : i -> p
+		 * Pop a number of restarts, then act like SPAWN,
+		 * except that whenever the new process fails (ends
+		 * by EXIT, for a reason other than normal), another
+		 * is started at the same address in its place, up to
+		 * that many times.  The new process takes the name
+		 * of the one it replaces (see REGISTER.)  Processes
+		 * watching the one which failed are told as usual.
+		 */
+		VM_OPLAB(INSTR_SUPERVISE)
+		    {
+			struct process *spawned;
 
-			spawned = vmproc_new(&t1);
-			/* schedule!! */
-			spawned->next = self->next;
-			self->next = spawned;
+			a = POP_VALUE();
+			pc++;
+			spawned = spawn(self, vm, IMM_ADDR());
+			spawned->supervised = 1;
+			spawned->entry = IMM_ADDR();
+			spawned->restarts = (unsigned int)value_get_integer(a);
+			sched_add(spawned);
 
 			value_process_set(&t1, spawned);
 			PUSH_VALUE(&t1);
 		    }
 			VM_NEXT()
 
+		/*
+		 % MONITOR : p ->
+		 * Pop a process from the stack, and watch it: when
+		 * it ends, this process is sent <down: p, reason>.
+		 * If it has ended already, the reason is noproc.
+		 */
+		VM_OPLAB(INSTR_MONITOR)
+			process_monitor(self, value_get_process(POP_VALUE()));
+			VM_NEXT()
+
+		/*
+		 % LINK : p ->
+		 * Pop a process from the stack, and link it to this
+		 * one: when either ends, the other is sent
+		 * <exit: p, reason>, p being the one which ended.
+		 */
+		VM_OPLAB(INSTR_LINK)
+			process_link(self, value_get_process(POP_VALUE()));
+			VM_NEXT()
+
 		/*** INTER-PROCESS COMMUNICATION ***/
 
 		/*
@@ -752,39 +938,288 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 		 */
 		VM_OPLAB(INSTR_WRITE)
 		    {
-			unsigned int i;
-			unsigned char c;
+			unsigned int i, n = 0, size;
+			unsigned char buffer[256];
 
 			a = POP_VALUE();
 			v = POP_VALUE();
 
 			/*
-			 * XXX this could certainly be optimized
-			 * to use scatter/gather I/O and such
+			 * The bytes are written in as few pieces as
+			 * the buffer allows.
 			 */
-			for (i = 0; i < value_tuple_get_size(v); i++) {
-				c = (unsigned char)value_get_integer(
+			size = value_tuple_get_size(v);
+			for (i = 0; i < size; i++) {
+				buffer[n++] = (unsigned char)value_get_integer(
 				    value_tuple_fetch(v, i)
 				);
-				stream_write(self, value_get_process(a), &c, 1);
+				if (n == sizeof(buffer) || i == size - 1) {
+					stream_write(self, value_get_process(a),
+					    buffer, n);
+					n = 0;
+				}
 			}
 		    }
 			VM_NEXT()
 
+		/*
+		 % FLUSH : s ->
+		 * Pop a stream from the stack, and write out
+		 * anything it has buffered.
+		 */
+		VM_OPLAB(INSTR_FLUSH)
+			stream_flush(self, value_get_process(POP_VALUE()));
+			VM_NEXT()
+
 		/*
 		 % SEND : v p ->
 		 * Pop a process and a value from the stack
-		 * and send the value to the process.  The value
-		 * will be packaged in such a way that a Kosheri
-		 * process on the other end will be able to easily
-		 * unpackage it to retrieve an exact copy of the
-		 * original value.
+		 * and send the value to the process.  A VM process
+		 * receives a copy of the value in its own heap,
+		 * unless the value is frozen (see FREEZE), in which
+		 * case it receives the value itself.
+		 * Any other process receives the value packaged
+		 * in such a way that a Kosheri process on the
+		 * other end of it will be able to easily unpackage
+		 * it to retrieve an exact copy of the original value.
+		 * If the VM process's mailbox is full (see MAILBOX),
+		 * this process may be blocked until there is room.
+		 * A value sent to a process which has ended is dropped.
 		 */
 		VM_OPLAB(INSTR_SEND)
+		    {
+			struct process *p;
+
 			a = POP_VALUE();
 			v = POP_VALUE();
-			
-			value_save(value_get_process(a), v);
+			p = value_get_process(a);
+			if (ATOMIC_READ(p->done)) {
+				/* it has ended; the value is dropped */
+			} else if (p->heap == NULL) {
+				value_save(p, v);
+			} else if (!process_enqueue(p, v) &&
+			    ATOMIC_READ(p->overflow) == MAILBOX_BLOCK) {
+				PUSH_VALUE(v);	/* try again when woken */
+				PUSH_VALUE(a);
+				self->send_to = p;
+				self->waiting = 1;
+				pc--;
+				VM_STOP()
+			}
+		    }
+			VM_NEXT()
+
+		/*
+		 % TRY_SEND : v p -> b
+		 * Act like SEND, except never block: push true if
+		 * the value was sent, or false if the process's
+		 * mailbox was full and it was not.
+		 */
+		VM_OPLAB(INSTR_TRY_SEND)
+		    {
+			struct process *p;
+
+			a = POP_VALUE();
+			v = POP_VALUE();
+			p = value_get_process(a);
+			if (ATOMIC_READ(p->done)) {
+				PUSH_VALUE(&VTRUE);	/* and dropped */
+			} else if (p->heap == NULL) {
+				value_save(p, v);
+				PUSH_VALUE(&VTRUE);
+			} else {
+				PUSH_VALUE(process_enqueue(p, v) ?
+				    &VTRUE : &VFALSE);
+			}
+		    }
+			VM_NEXT()
+
+		/*
+		 % RECV : -> v
+		 * Take the oldest message from this process's
+		 * mailbox and push it onto the stack.  If the
+		 * mailbox is empty, this process is blocked, and
+		 * is not run again until a message arrives.
+		 */
+		VM_OPLAB(INSTR_RECV)
+			if (process_dequeue(self, &t1)) {
+				PUSH_VALUE(&t1);
+				VM_NEXT()
+			}
+			self->waiting = 1;
+			pc--;	/* try again when woken */
+			VM_STOP()
+
+		/*
+		 % RECV_TAG : k -> v
+		 * Pop a tag from the stack, then act like RECV,
+		 * except that the message taken is the oldest which
+		 * is a tuple with that tag.  Other messages are left
+		 * in the mailbox, in order.
+		 */
+		VM_OPLAB(INSTR_RECV_TAG)
+			a = POP_VALUE();
+			if (process_dequeue_tag(self, a, &t1)) {
+				PUSH_VALUE(&t1);
+				VM_NEXT()
+			}
+			PUSH_VALUE(a);	/* try again when woken */
+			self->waiting = 1;
+			pc--;
+			VM_STOP()
+
+		/*
+		 % RECV_MATCH : v k -> v
+		 * Pop a tag and a value from the stack, then act like
+		 * RECV_TAG, except that the message taken must also
+		 * have the value as its first element.  Useful for
+		 * picking out the reply to a particular request.
+		 */
+		VM_OPLAB(INSTR_RECV_MATCH)
+			a = POP_VALUE();
+			b = POP_VALUE();
+			if (process_dequeue_match(self, a, b, &t1)) {
+				PUSH_VALUE(&t1);
+				VM_NEXT()
+			}
+			PUSH_VALUE(b);	/* try again when woken */
+			PUSH_VALUE(a);
+			self->waiting = 1;
+			pc--;
+			VM_STOP()
+
+		/*
+		 % RECV_TIMEOUT a : t ->
+		 * Pop a timeout in milliseconds from the stack,
+		 * then act like RECV, except that if no message
+		 * arrives before the timeout passes, branch to the
+		 * given address instead (pushing nothing.)
+		 */
+		VM_OPLAB(INSTR_RECV_TIMEOUT)
+			a = POP_VALUE();
+			pc++;
+			if (process_dequeue(self, &t1)) {
+				sched_cancel_timer(self);
+				PUSH_VALUE(&t1);
+				VM_NEXT()
+			}
+			if (sched_timeout(self,
+			    (unsigned long)value_get_integer(a))) {
+				pc = IMM_ADDR();
+				pc--;
+				VM_NEXT()
+			}
+			PUSH_VALUE(a);	/* try again when woken */
+			self->waiting = 1;
+			pc -= 2;
+			VM_STOP()
+
+		/*
+		 % SLEEP : t ->
+		 * Pop a time in milliseconds from the stack, and
+		 * block this process until that much time has
+		 * passed.  Messages which arrive meanwhile wait in
+		 * the mailbox; they do not wake it.
+		 */
+		VM_OPLAB(INSTR_SLEEP)
+			a = POP_VALUE();
+			if (sched_timeout(self,
+			    (unsigned long)value_get_integer(a))) {
+				self->sleeping = 0;
+				VM_NEXT()
+			}
+			PUSH_VALUE(a);	/* try again when woken */
+			self->sleeping = 1;
+			self->waiting = 1;
+			pc--;
+			VM_STOP()
+
+		/*
+		 % SELF : -> p
+		 * Push this process onto the stack, so that it may
+		 * be sent to others, who may send messages back.
+		 */
+		VM_OPLAB(INSTR_SELF)
+			value_process_set(&t1, self);
+			PUSH_VALUE(&t1);
+			VM_NEXT()
+
+		/*
+		 % REGISTER : p k -> b
+		 * Pop a symbol and a process from the stack, and
+		 * give the process that name, by which any process
+		 * may find it (see WHEREIS.)  Push true, or false if
+		 * the name belongs to another process, or the process
+		 * already has one or has ended.  A process gives up
+		 * its name when it finishes.
+		 */
+		VM_OPLAB(INSTR_REGISTER)
+			a = POP_VALUE();
+			b = POP_VALUE();
+			PUSH_VALUE(registry_register(value_get_process(b), a) ?
+			    &VTRUE : &VFALSE);
+			VM_NEXT()
+
+		/*
+		 % WHEREIS : k -> p
+		 * Pop a symbol from the stack, and push the process
+		 * with that name, or null if there is none.
+		 */
+		VM_OPLAB(INSTR_WHEREIS)
+		    {
+			struct process *p;
+
+			p = registry_whereis(POP_VALUE());
+			if (p != NULL) {
+				value_process_set(&t1, p);
+				PUSH_VALUE(&t1);
+			} else {
+				PUSH_VALUE(&VNULL);
+			}
+		    }
+			VM_NEXT()
+
+		/*
+		 % PRIORITY : i ->
+		 * Pop an integer and move this process into that
+		 * priority class: 0 (high), 1 (normal) or 2 (low.)
+		 * Ready processes of higher priority run first,
+		 * and in shorter slices; but none waits for long.
+		 */
+		VM_OPLAB(INSTR_PRIORITY)
+			sched_set_priority(self,
+			    value_get_integer(POP_VALUE()));
+			VM_NEXT()
+
+		/*
+		 % LATENCY : i ->
+		 * Pop an integer and make it this process's latency
+		 * target, in milliseconds, or remove its target if
+		 * it is 0.  Whenever a process with a target becomes
+		 * ready, it is due to run within that time, and such
+		 * processes run before all others, earliest first.
+		 */
+		VM_OPLAB(INSTR_LATENCY)
+			sched_set_latency(self, (unsigned long)
+			    value_get_integer(POP_VALUE()));
+			VM_NEXT()
+
+		/*
+		 % MAILBOX : i i ->
+		 * Pop a capacity and a policy from the stack, and
+		 * limit this process's mailbox to that many messages
+		 * (or none, if 0.)  When it is full, a message sent
+		 * to it blocks the sender until there is room (policy
+		 * 0), makes room by dropping the oldest message (1),
+		 * or is refused (2), in which case SEND discards it,
+		 * and TRY_SEND pushes false.
+		 */
+		VM_OPLAB(INSTR_MAILBOX)
+			a = POP_VALUE();
+			b = POP_VALUE();
+			process_set_mailbox(self,
+			    (unsigned int)value_get_integer(a),
+			    value_get_integer(b));
 			VM_NEXT()
 
 		/*
@@ -801,6 +1236,86 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 
 		/*** ADMINISTRATIVE ***/
 
+		/*
+		 % STATS : -> d
+		 * Push a new dictionary of statistics on the heaps
+		 * and the garbage collector onto the stack.  Other
+		 * processes are stopped meanwhile.
+		 */
+		VM_OPLAB(INSTR_STATS)
+			if (!sched_stop_world()) {
+				pc--;		/* try again later */
+				VM_STOP()
+			}
+			value_gc_stats(&t1);
+			sched_start_world();
+			PUSH_VALUE(&t1);
+			VM_NEXT()
+
+		/*
+		 % PROCESS_STATS : p -> d
+		 * Pop a process from the stack, and push a new
+		 * dictionary of statistics on its mailbox: capacity,
+		 * policy, depth (messages now waiting), peak (the
+		 * most there have been),
+		 * and how many were received, dropped and refused.
+		 */
+		VM_OPLAB(INSTR_PROCESS_STATS)
+			process_stats(value_get_process(POP_VALUE()), &t1);
+			PUSH_VALUE(&t1);
+			VM_NEXT()
+
+		/*
+		 % HEAP_DUMP : p ->
+		 * Pop a stream process from the stack and write a
+		 * profile of the live values in all heaps, by the
+		 * code position which allocated them, to it.  Garbage
+		 * not yet collected is counted too.  This is only
+		 * informative in a build with HEAP_PROFILE.  Other
+		 * processes are stopped meanwhile.
+		 */
+		VM_OPLAB(INSTR_HEAP_DUMP)
+			a = POP_VALUE();
+			if (!sched_stop_world()) {
+				PUSH_VALUE(a);	/* try again later */
+				pc--;
+				VM_STOP()
+			}
+			value_profile_dump(&t1);
+			sched_start_world();
+			value_save(value_get_process(a), &t1);
+			VM_NEXT()
+
+		/*
+		 % SNAPSHOT : s -> b
+		 * Pop a stream process from the stack and write the
+		 * state of every process to it: a snapshot, from
+		 * which run --restore can carry on as if from here.
+		 * Push false; but when restored, this process finds
+		 * true pushed instead.  Other processes are stopped
+		 * meanwhile.
+		 */
+		VM_OPLAB(INSTR_SNAPSHOT)
+		    {
+			struct process *p;
+
+			a = POP_VALUE();
+			if (!sched_stop_world()) {
+				PUSH_VALUE(a);	/* try again later */
+				pc--;
+				VM_STOP()
+			}
+			p = value_get_process(a);
+			PUSH_VALUE(&VTRUE);
+			value_tuple_store(vm, VM_AR, &ar);
+			value_tuple_store_integer(vm, VM_PC, pc + 1);
+			snapshot_save(self, p);
+			sched_start_world();
+		    }
+			POP_VALUE();
+			PUSH_VALUE(&VFALSE);
+			VM_NEXT()
+
 		/*
 		 % NOP : ->
 		 * Explicitly do nothing.  Used for padding.
@@ -822,4 +1337,45 @@ vm_run(struct value *vm, struct process *self, unsigned int cycles)
 
 	value_tuple_store(vm, VM_AR, &ar);
 	value_tuple_store_integer(vm, VM_PC, pc);
+
+	return left;
+}
+
+#ifdef DIRECT_THREADING
+int
+vm_label_opcode(clabel label)
+{
+	unsigned int i, n = ATOMIC_READ(num_labels);
+	clabel *l = ATOMIC_READ(labels);
+
+	for (i = 0; i < n; i++) {
+		if (l[i] == label)
+			return (int)i;
+	}
+	return -1;
+}
+#endif
+
+/*
+ * Running for a single cycle does nothing but this.
+ */
+void
+vm_prepare(struct value *vm)
+{
+	vm_run(vm, NULL, 1);
+}
+
+int
+vm_freeze_literals(struct value *code)
+{
+	struct value *v;
+	unsigned int i, size;
+
+	size = value_tuple_get_size(code);
+	for (i = 0; i < size; i++) {
+		v = value_tuple_fetch(code, i);
+		if (v->type == VALUE_TUPLE && !value_freeze(v, v))
+			return 0;
+	}
+	return 1;
 }
@@ -11,6 +11,33 @@
 
 struct process;
 
-void		 vm_run(struct value *, struct process *, unsigned int);
+/*
+ * Run the virtual machine for no more than the given number of
+ * cycles.  Returns the number of cycles left unused when it stopped
+ * of its own accord (to wait, say), or 0 if it used them all.
+ */
+unsigned int	 vm_run(struct value *, struct process *, unsigned int);
+
+/*
+ * Make the virtual machine ready to run, as it would be made when it
+ * first ran: in a build with DIRECT_THREADING, by converting the
+ * opcodes of its code (if no other VM sharing it has) to labels.
+ */
+void		 vm_prepare(struct value *);
+
+/*
+ * Freeze the tuples which appear as literals in the given code, since
+ * every process running that code shares them.  Returns false if
+ * memory could not be allocated.
+ */
+int		 vm_freeze_literals(struct value *);
+
+#ifdef DIRECT_THREADING
+/*
+ * Returns the opcode of the instruction with the given label, or -1.
+ * Only meaningful once some VM has run.
+ */
+int		 vm_label_opcode(clabel);
+#endif
 
 #endif /* !__VM_H_ */
@@ -13,17 +13,45 @@
 static void
 run(struct process *p)
 {
-	vm_run(&p->aux_value, p, 100);
+	p->slice_used = p->slice - vm_run(&p->aux_value, p, p->slice);
+	PROFILE_SITE(0, SITE_NATIVE);
 }
 
 struct process *
-vmproc_new(struct value *vm)
+vmproc_alloc(void)
 {
 	struct process *p;
 
 	p = process_new();
 	p->run = run;
-	value_copy(&p->aux_value, vm);
+	p->heap = value_heap_new();
+	assert(p->heap != NULL);
+
+	return p;
+}
+
+/*
+ * The new process gets a heap of its own, and a virtual machine in
+ * that heap which is a copy of the given one (sharing its code.)
+ */
+struct process *
+vmproc_new(struct value *vm)
+{
+	struct process *p;
+	struct heap *caller_heap;
+	struct value ar;
+
+	p = vmproc_alloc();
+
+	caller_heap = value_heap_get_current();
+	value_heap_set_current(p->heap);
+	value_vm_new(&p->aux_value, value_tuple_fetch(vm, VM_CODE));
+	value_tuple_store(&p->aux_value, VM_PC, value_tuple_fetch(vm, VM_PC));
+	value_tuple_store(&p->aux_value, VM_IS_DIRECT,
+	    value_tuple_fetch(vm, VM_IS_DIRECT));
+	value_heap_set_current(caller_heap);
+	value_heap_copy(p->heap, &ar, value_tuple_fetch(vm, VM_AR));
+	value_tuple_store(&p->aux_value, VM_AR, &ar);
 	p->waiting = 0;
 
 	return p;
@@ -11,5 +11,11 @@ struct process;
 
 struct process	*vmproc_new(struct value *);
 
+/*
+ * A new process with a heap of its own, but no virtual machine yet;
+ * the caller puts one in its aux_value, in that heap.
+ */
+struct process	*vmproc_alloc(void);
+
 #endif /* !__VMPROC_H_ */
 
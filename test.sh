@@ -31,6 +31,11 @@ make clean static >ERRORS 2>&1 || error $?
 echo "Testing 'static' build..."
 falderal -b $TESTS >ERRORS 2>&1 || error $?
 
+make clean heapprofile >ERRORS 2>&1 || error $?
+
+echo "Testing 'heapprofile' build..."
+falderal -b $TESTS ../tests/HeapProfile.markdown >ERRORS 2>&1 || error $?
+
 echo "Building 'debug' version..."
 make clean debug >ERRORS 2>&1 || error $?
 